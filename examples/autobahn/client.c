@@ -34,8 +34,8 @@ static void on_close(struct wic_inst *inst, uint16_t code, const char *reason, u
 
 static void on_handshake_failure_handler(struct wic_inst *inst, enum wic_handshake_failure reason);
 
-static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
-static bool on_message_case_count(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
+static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
+static bool on_message_case_count(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
 
 static void on_open(struct wic_inst *inst);
 static void on_send(struct wic_inst *inst, const void *data, size_t size, enum wic_buffer type);
@@ -44,7 +44,7 @@ static uint32_t do_random(struct wic_inst *inst);
 static void on_close_transport(struct wic_inst *inst);
 static void *on_buffer(struct wic_inst *inst, size_t min_size, enum wic_buffer type, size_t *max_size);
 
-static void do_client(int *s, struct wic_inst *inst, const struct wic_init_arg *arg);
+static void do_client(struct transport *t, struct wic_inst *inst, const struct wic_init_arg *arg);
 
 static int n = 0;
 
@@ -52,36 +52,45 @@ int main(int argc, char **argv)
 {
     static struct wic_inst inst;
     static uint8_t rx_buffer[UINT16_MAX];
+    static uint8_t rx_ring[UINT16_MAX + 1UL];
+    static uint8_t tx_buffer[16U * (UINT16_MAX + 200UL)];
     static char url[1000U];
     
     int tc;
 
     srand(time(NULL));
 
-    static int s = -1;
+    static struct transport t;
 
     struct wic_init_arg arg = {0};
 
+    /* not const since on_message changes between runs */
+    static struct wic_callbacks callbacks = {
+        .on_open = on_open,
+        .on_close = on_close,
+        .on_send = on_send,
+        .on_buffer = on_buffer,
+        .on_close_transport = on_close_transport,
+        .on_handshake_failure = on_handshake_failure_handler,
+        .rand = do_random
+    };
+
     arg.rx = rx_buffer;
     arg.rx_max = sizeof(rx_buffer);
-    arg.on_open = on_open;    
-    arg.on_close = on_close;
-    arg.on_send = on_send;
-    arg.on_buffer = on_buffer;
-    arg.on_close_transport = on_close_transport;
-    arg.on_handshake_failure = on_handshake_failure_handler;
-    arg.rand = do_random;
-    arg.app = &s;
+    arg.callbacks = &callbacks;
+    arg.app = &t;
     arg.role = WIC_ROLE_CLIENT;
     arg.url = url;
 
+    transport_init(&t, rx_ring, sizeof(rx_ring), tx_buffer, sizeof(tx_buffer) / transport_mem_size(1U, UINT16_MAX + 100UL), UINT16_MAX + 100UL);
+
     arg.url = "ws://localhost:9001/getCaseCount?agent=wic";
-    arg.on_message = on_message_case_count;
+    callbacks.on_message = on_message_case_count;
     
-    do_client(&s, &inst, &arg);
+    do_client(&t, &inst, &arg);
 
     arg.url = url;
-    arg.on_message = on_message;
+    callbacks.on_message = on_message;
     
     for(tc=1; tc <= n; tc++){
 
@@ -89,13 +98,13 @@ int main(int argc, char **argv)
 
         LOG("test #%d...", tc)
         
-        do_client(&s, &inst, &arg);
+        do_client(&t, &inst, &arg);
     }
 
     arg.url = "ws://localhost:9001/updateReports?agent=wic";
-    arg.on_message = NULL;
+    callbacks.on_message = NULL;
     
-    do_client(&s, &inst, &arg);
+    do_client(&t, &inst, &arg);
 
     LOG("exiting...")
 
@@ -107,7 +116,7 @@ static void on_handshake_failure_handler(struct wic_inst *inst, enum wic_handsha
     LOG("websocket handshake failed for reason %d", reason);
 }
 
-static void do_client(int *s, struct wic_inst *inst, const struct wic_init_arg *arg)
+static void do_client(struct transport *t, struct wic_inst *inst, const struct wic_init_arg *arg)
 {
     if(!wic_init(inst, arg)){
 
@@ -117,19 +126,19 @@ static void do_client(int *s, struct wic_inst *inst, const struct wic_init_arg *
 
     if(
         transport_open_client(
+            t,
             wic_get_url_schema(inst),
             wic_get_url_hostname(inst),
-            wic_get_url_port(inst),
-            s
+            wic_get_url_port(inst)
         )
     ){
         if(wic_start(inst) == WIC_STATUS_SUCCESS){
 
-            while(transport_recv(*s, inst));
+            while(transport_poll(t, inst, -1));
         }
         else{
 
-            transport_close(s);
+            transport_close(t);
         }
     }
 }
@@ -139,18 +148,19 @@ static void on_close(struct wic_inst *inst, uint16_t code, const char *reason, u
     LOG("websocket closed for reason %u %.*s", code, size, reason);
 }
 
-static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size)
+static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
-    LOG("received %u bytes of %s %s", size, (encoding == WIC_ENCODING_UTF8) ? "text" : "binary", fin ? "(final)" : "");
+    LOG("received %u bytes of %s %s", (unsigned)size, (encoding == WIC_ENCODING_UTF8) ? "text" : "binary", fin ? "(final)" : "");
 
-    wic_send(inst, encoding, fin, data, size);
+    /* wait for the peer to take some output and then carry on */
+    while((wic_send(inst, encoding, fin, data, size) == WIC_STATUS_WOULD_BLOCK) && transport_drain(wic_get_app(inst), -1));
 
     return true;
 }
 
-static bool on_message_case_count(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size)
+static bool on_message_case_count(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
-    LOG("%.*s", size, data);
+    LOG("%.*s", (int)size, data);
 
     if(size > 0){
 
@@ -171,12 +181,12 @@ static void on_send(struct wic_inst *inst, const void *data, size_t size, enum w
 {
     LOG("sending buffer type %d", type);
 
-    transport_write(*(int *)wic_get_app(inst), data, size);
+    transport_send(wic_get_app(inst), data, size);
 }
 
 static void on_close_transport(struct wic_inst *inst)
 {
-    transport_close((int *)wic_get_app(inst));
+    transport_close(wic_get_app(inst));
 }
 
 static uint32_t do_random(struct wic_inst *inst)
@@ -186,9 +196,5 @@ static uint32_t do_random(struct wic_inst *inst)
 
 static void *on_buffer(struct wic_inst *inst, size_t min_size, enum wic_buffer type, size_t *max_size)
 {
-    static uint8_t tx[UINT16_MAX+100UL];
-    
-    *max_size = sizeof(tx);
-
-    return (min_size <= sizeof(tx)) ? tx : NULL;
+    return transport_buffer(wic_get_app(inst), min_size, max_size);
 }
@@ -20,7 +20,7 @@
  * */
 
 #include "wic.h"
-#include "transport.h"
+#include "engine.h"
 #include "log.h"
 
 #include <stdlib.h>
@@ -28,126 +28,83 @@
 #include <signal.h>
 #include <time.h>
 
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <poll.h>
-#include <errno.h>
+bool log_enabled = false;
 
 static void on_close(struct wic_inst *inst, uint16_t code, const char *reason, uint16_t size);
-static void on_text(struct wic_inst *inst,  bool fin, const char *data, uint16_t size);
-static void on_binary(struct wic_inst *inst, bool fin, const void *data, uint16_t size);
+static void on_handshake_failure_handler(struct wic_inst *inst, enum wic_handshake_failure reason);
+static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
 static void on_open(struct wic_inst *inst);
-static void do_write(struct wic_inst *inst, const void *data, size_t size);
 static uint32_t do_random(struct wic_inst *inst);
 
 int main(int argc, char **argv)
 {
-    static struct wic_inst inst;
-    static uint8_t tx[UINT16_MAX+10UL];
-    static uint8_t rx[UINT16_MAX];
-    
+    static struct engine engine;
+    static const struct wic_callbacks callbacks = {
+        .on_open = on_open,
+        .on_close = on_close,
+        .on_message = on_message,
+        .on_handshake_failure = on_handshake_failure_handler,
+        .rand = do_random
+    };
+    struct wic_init_arg wic = {0};
+    struct engine_arg arg = {0};
+    void *mem;
+
     srand(time(NULL));
+    signal(SIGPIPE, SIG_IGN);
 
-    int server = -1;
-    int client = -1;
-
-    struct wic_init_arg arg = {0};
-
-    arg.rx = rx;
-    arg.rx_max = sizeof(rx);
-    arg.tx = tx;
-    arg.tx_max = sizeof(tx);
-    arg.on_open = on_open;    
-    arg.on_close = on_close;
-    arg.on_text = on_text;
-    arg.on_binary = on_binary;
-    arg.write = do_write;
-    arg.rand = do_random;
-    arg.role = WIC_ROLE_SERVER;
-
-    struct sockaddr_in serv_addr;
-    struct sockaddr_in client_addr;
-    socklen_t client_len;
-    
-    server = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-
-    if(server < 0){
-
-        ERROR("socket()")
-        exit(EXIT_FAILURE);            
-    }
+    wic.callbacks = &callbacks;
+
+    /* each connection has its own instance and rx buffer */
+    arg.port = 9002U;
+    arg.max_conn = 8U;
+    arg.rx_max = UINT16_MAX;
+    arg.tx_count = 256U;
+    arg.tx_max = UINT16_MAX+100UL;
+    arg.wic = &wic;
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(9002);
+    mem = malloc(engine_mem_size(&arg));
 
-    if(bind(server, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0){
+    if(!engine_init(&engine, &arg, mem, engine_mem_size(&arg))){
 
-        ERROR("bind()")
+        ERROR("engine_init()")
         exit(EXIT_FAILURE);
     }
 
-    for(;;){
-
-        listen(server, 2);
-
-        client = accept(server, (struct sockaddr *)&client_addr, &client_len);
-
-        if(client < 0){
-
-            ERROR("accept()")
-            break;
-        }
-
-        arg.app = &client;
-
-        if(!wic_init(&inst, &arg)){
+    engine_run(&engine);
+    engine_deinit(&engine);
 
-            ERROR("wic_init()")
-            transport_close(&client);
-            break;
-        }
-        
-        while(transport_recv(client, &inst));
-        
-        wic_close(&inst);
-    }
-
-    transport_close(&server);
+    free(mem);
 
     LOG("exiting...")
 
     exit(EXIT_SUCCESS);
 }
 
-static void on_close(struct wic_inst *inst, uint16_t code, const char *reason, uint16_t size)
+static void on_handshake_failure_handler(struct wic_inst *inst, enum wic_handshake_failure reason)
 {
-    transport_close((int *)wic_get_app(inst));    
+    LOG("websocket handshake failed for reason %d", reason);
 }
 
-static void on_text(struct wic_inst *inst, bool fin, const char *data, uint16_t size)
+static void on_close(struct wic_inst *inst, uint16_t code, const char *reason, uint16_t size)
 {
-    wic_send_text(inst, fin, data, size);
+    LOG("websocket closed for reason %u %.*s", code, size, reason);
 }
 
-static void on_binary(struct wic_inst *inst,  bool fin, const void *data, uint16_t size)
+static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
-    wic_send_binary(inst, fin, data, size);
-}
+    LOG("received %u bytes of %s %s", (unsigned)size, (encoding == WIC_ENCODING_UTF8) ? "text" : "binary", fin ? "(final)" : "");
 
-static void on_open(struct wic_inst *inst)
-{
-    wic_start(inst);
+    wic_send(inst, encoding, fin, data, size);
+
+    return true;
 }
 
-static void do_write(struct wic_inst *inst, const void *data, size_t size)
+static void on_open(struct wic_inst *inst)
 {
-    if(!transport_write(*(int *)wic_get_app(inst), data, size)){
+    LOG("websocket is open");
 
-        ERROR("transport_write()")
+    if(wic_start(inst) != WIC_STATUS_SUCCESS){
 
         wic_close(inst);
     }
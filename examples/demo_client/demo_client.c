@@ -30,7 +30,7 @@
 bool log_enabled = true;
 
 static void on_open_handler(struct wic_inst *inst);
-static bool on_message_handler(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
+static bool on_message_handler(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
 static void on_close_handler(struct wic_inst *inst, uint16_t code, const char *reason, uint16_t size);
 static void on_close_transport_handler(struct wic_inst *inst);
 static void on_send_handler(struct wic_inst *inst, const void *data, size_t size, enum wic_buffer type);
@@ -39,9 +39,21 @@ static void *on_buffer_handler(struct wic_inst *inst, size_t min_size, enum wic_
 
 int main(int argc, char **argv)
 {
-    int s, redirects = 3;
-    static uint8_t rx[1000];
+    int redirects = 3;
+    static struct transport t;
+    static uint8_t ring[4U * 1024U];
+    static uint8_t tx[4U * 1024U];
+    static uint8_t rx[1500];
     static char url[1000] = "ws://echo.websocket.org/";
+    static const struct wic_callbacks callbacks = {
+        .on_send = on_send_handler,
+        .on_buffer = on_buffer_handler,
+        .on_message = on_message_handler,
+        .on_open = on_open_handler,
+        .on_close = on_close_handler,
+        .on_close_transport = on_close_transport_handler,
+        .on_handshake_failure = on_handshake_failure_handler
+    };
     struct wic_inst inst;
     struct wic_init_arg arg = {0};
 
@@ -51,17 +63,18 @@ int main(int argc, char **argv)
     }
     
     arg.rx = rx; arg.rx_max = sizeof(rx);    
-    arg.on_send = on_send_handler;
-    arg.on_buffer = on_buffer_handler;
-    arg.on_message = on_message_handler;        
-    arg.on_open = on_open_handler;        
-    arg.on_close = on_close_handler;        
-    arg.on_close_transport = on_close_transport_handler;        
-    arg.on_handshake_failure = on_handshake_failure_handler;
-    arg.app = &s;
+    arg.callbacks = &callbacks;
+    arg.app = &t;
     arg.url = url;
     arg.role = WIC_ROLE_CLIENT;
 
+    transport_init(&t, ring, sizeof(ring), tx, sizeof(tx) / transport_mem_size(1U, 1000U), 1000U);
+
+#ifdef SIGPIPE
+    /* OpenSSL writes without MSG_NOSIGNAL */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
     for(;;){
 
         if(!wic_init(&inst, &arg)){
@@ -78,20 +91,25 @@ int main(int argc, char **argv)
 
         if(
             transport_open_client(
+                &t,
                 wic_get_url_schema(&inst),
                 wic_get_url_hostname(&inst),
-                wic_get_url_port(&inst),
-                &s
+                wic_get_url_port(&inst)
             )
         ){
 
+            if(transport_resumed(&t)){
+
+                LOG("resumed tls session");
+            }
+
             if(wic_start(&inst) == WIC_STATUS_SUCCESS){
 
-                while(transport_recv(s, &inst));
+                while(transport_poll(&t, &inst, -1));
             }
             else{
 
-                transport_close(&s);
+                transport_close(&t);
             }
         }
 
@@ -109,11 +127,11 @@ int main(int argc, char **argv)
     exit(EXIT_SUCCESS);
 }
 
-static bool on_message_handler(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size)
+static bool on_message_handler(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
     if(encoding == WIC_ENCODING_UTF8){
 
-        LOG("received text: %.*s", size, data);
+        LOG("received text: %.*s", (int)size, data);
     }
 
     wic_close(inst);
@@ -151,21 +169,17 @@ static void on_close_handler(struct wic_inst *inst, uint16_t code, const char *r
 
 static void on_close_transport_handler(struct wic_inst *inst)
 {
-    transport_close((int *)wic_get_app(inst));
+    transport_close(wic_get_app(inst));
 }
 
 static void on_send_handler(struct wic_inst *inst, const void *data, size_t size, enum wic_buffer type)
 {
     LOG("sending buffer type %d", type);
 
-    transport_write(*(int *)wic_get_app(inst), data, size);
+    transport_send(wic_get_app(inst), data, size);
 }
 
 static void *on_buffer_handler(struct wic_inst *inst, size_t min_size, enum wic_buffer type, size_t *max_size)
 {
-    static uint8_t tx[1000U];
-
-    *max_size = sizeof(tx);
-
-    return (min_size <= sizeof(tx)) ? tx : NULL;
+    return transport_buffer(wic_get_app(inst), min_size, max_size);
 }
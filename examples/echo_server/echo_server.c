@@ -0,0 +1,241 @@
+/* Copyright (c) 2020 Cameron Harper
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include "wic.h"
+#include "engine.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define MAX_SHARDS 256U
+
+struct shard {
+
+    pthread_t thread;
+    size_t cpu;
+    struct engine_arg arg;
+    struct engine engine;
+};
+
+static void *run_shard(void *arg);
+
+static void on_open_handler(struct wic_inst *inst);
+static bool on_message_handler(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
+static void on_drain_handler(struct wic_inst *inst);
+static void broadcast_message(struct wic_inst *inst, enum wic_encoding encoding, const char *data, size_t size);
+static void release_frame(struct wic_frame *frame);
+
+static struct shard shards[MAX_SHARDS];
+
+static bool broadcast;
+
+static const struct wic_callbacks callbacks = {
+
+    .on_open = on_open_handler,
+    .on_message = on_message_handler
+};
+
+static const struct wic_init_arg wic = {
+
+    .callbacks = &callbacks
+};
+
+/* usage: echo_server [port] [connections] [shards] [broadcast]
+ *
+ * Each shard is a thread pinned to one CPU with its own listener
+ * (SO_REUSEPORT), engine and memory. Nothing is shared between shards.
+ *
+ * If the fourth argument is "broadcast", messages which arrive in one
+ * piece are encoded once and sent to every connection on the same
+ * shard instead of being echoed. Connections which can't keep up miss
+ * messages. Fragmented messages are still echoed.
+ *
+ * */
+int main(int argc, char **argv)
+{
+    struct engine_arg arg = {0};
+    struct rlimit limit;
+    size_t count;
+    size_t cpus;
+    size_t i;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    cpus = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+    arg.port = (argc > 1) ? (uint16_t)atoi(argv[1]) : 9002U;
+    arg.max_conn = (argc > 2) ? (size_t)atol(argv[2]) : 60000U;
+    count = (argc > 3) ? (size_t)atol(argv[3]) : 1U;
+    broadcast = (argc > 4) && (strcmp(argv[4], "broadcast") == 0);
+
+    count = (count == 0U) ? cpus : count;
+    count = (count > MAX_SHARDS) ? MAX_SHARDS : count;
+
+    /* one descriptor per connection */
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0){
+
+        limit.rlim_cur = ((arg.max_conn + 16U) > limit.rlim_max) ? limit.rlim_max : (arg.max_conn + 16U);
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    LOG("listening on %u for up to %zu connections over %zu shards%s", arg.port, arg.max_conn, count, broadcast ? " (broadcast)" : "")
+
+    /* idle connections only need their wic_inst, receive and transmit
+     * buffers are shared within a shard */
+    arg.max_conn = (arg.max_conn + count - 1U) / count;
+    arg.rx_max = 4096U;
+    arg.rx_count = 256U;
+    arg.tx_count = 1024U;
+    arg.tx_max = 4096U;
+    arg.tx_queue_max = 8U;
+    arg.in_count = 256U;
+    arg.ref_count = broadcast ? (arg.max_conn * 2U) : 0U;
+    arg.handshake_timeout = 5000U;
+    arg.ping_interval = 30000U;
+    arg.pong_timeout = 10000U;
+    arg.close_timeout = 5000U;
+    arg.wic = &wic;
+    arg.on_drain = on_drain_handler;
+    arg.reuse_port = (count > 1U);
+
+    for(i=0U; i < count; i++){
+
+        shards[i].cpu = i % cpus;
+        shards[i].arg = arg;
+
+        if(pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0){
+
+            ERROR("pthread_create()")
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(i=0U; i < count; i++){
+
+        (void)pthread_join(shards[i].thread, NULL);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+static void *run_shard(void *arg)
+{
+    struct shard *self = arg;
+    cpu_set_t set;
+    void *mem;
+
+    CPU_ZERO(&set);
+    CPU_SET(self->cpu, &set);
+
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+
+        ERROR("pthread_setaffinity_np()")
+    }
+
+    /* allocated once pinned so that pages are local to this CPU */
+    mem = malloc(engine_mem_size(&self->arg));
+
+    if(engine_init(&self->engine, &self->arg, mem, engine_mem_size(&self->arg))){
+
+        engine_run(&self->engine);
+        engine_deinit(&self->engine);
+    }
+
+    free(mem);
+
+    return NULL;
+}
+
+static void on_open_handler(struct wic_inst *inst)
+{
+    if(wic_start(inst) != WIC_STATUS_SUCCESS){
+
+        wic_close(inst);
+    }
+}
+
+static bool on_message_handler(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size)
+{
+    bool retval = true;
+
+    /* the engine application pointer is set while a fragmented message
+     * is being echoed */
+    if(broadcast && fin && (engine_get_app(inst) == NULL)){
+
+        broadcast_message(inst, encoding, data, size);
+    }
+    else{
+
+        /* hold the message back until the echo can be queued */
+        retval = (wic_send(inst, encoding, fin, data, size) != WIC_STATUS_WOULD_BLOCK);
+
+        if(retval){
+
+            engine_set_app(inst, fin ? NULL : inst);
+        }
+    }
+
+    return retval;
+}
+
+static void on_drain_handler(struct wic_inst *inst)
+{
+    engine_resume(inst);
+}
+
+static void broadcast_message(struct wic_inst *inst, enum wic_encoding encoding, const char *data, size_t size)
+{
+    struct wic_frame *frame;
+    size_t max = wic_frame_size(size);
+
+    /* released by the last connection to write it */
+    frame = malloc(sizeof(*frame) + max);
+
+    if(frame == NULL){
+
+        ERROR("malloc()")
+    }
+    else if(wic_frame_prepare(frame, &frame[1], max, encoding, data, size) != WIC_STATUS_SUCCESS){
+
+        free(frame);
+    }
+    else{
+
+        frame->release = release_frame;
+
+        (void)engine_broadcast(engine_get_engine(inst), frame);
+
+        wic_frame_unref(frame);
+    }
+}
+
+static void release_frame(struct wic_frame *frame)
+{
+    free(frame);
+}
@@ -0,0 +1,2170 @@
+/* Copyright (c) 2020 Cameron Harper
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#ifdef ENGINE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+#include "engine.h"
+#include "log.h"
+
+#define ENGINE_EVENTS 64U
+#define ENGINE_IOV 16U
+#define ENGINE_ALIGN(X) (((X) + 15U) & ~(size_t)15U)
+#define ENGINE_TICK 100U
+
+struct engine_buf {
+
+    struct engine_buf *next;
+    size_t size;
+    size_t pos;
+
+    /* shared frame queued instead of data */
+    struct wic_frame *frame;
+
+    uint8_t data[];
+};
+
+#ifdef ENGINE_URING
+
+#define ENGINE_SQ_ENTRIES 1024U
+#define ENGINE_CQ_ENTRIES 16384U
+#define ENGINE_RECV_COUNT 256U
+#define ENGINE_BGID 0U
+
+/* smaller buffers are copied rather than sent zero copy */
+#define ENGINE_ZC_MIN 2048U
+
+/* the low bits of user_data say what completed, the rest is the
+ * connection (which is aligned) */
+#define OP_ACCEPT 0U
+#define OP_RECV 1U
+#define OP_SEND 2U
+#define OP_CANCEL 3U
+#define OP_MASK 3U
+
+struct engine_ring {
+
+    int fd;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+
+    /* submission queue, sq_local is published on enter */
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* completion queue */
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* receive buffers provided to the kernel and how many it has */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_mask;
+    uint16_t br_tail;
+    size_t br_free;
+
+    /* tx pool is registered as fixed buffer 0 */
+    bool fixed;
+};
+
+#endif
+
+static size_t ref_count(const struct engine_arg *arg);
+static size_t in_count(const struct engine_arg *arg);
+static size_t rx_size(const struct engine_arg *arg);
+static void conn_open(struct engine *self, int s);
+static void conn_read(struct engine_conn *conn);
+static bool conn_input(struct engine_conn *conn, struct engine_buf *buf);
+static void conn_hold(struct engine_conn *conn, struct engine_buf *buf);
+static void conn_write(struct engine_conn *conn);
+static void conn_sent(struct engine_conn *conn, size_t size);
+static void conn_drained(struct engine_conn *conn);
+static size_t conn_parse(struct engine_conn *conn, const uint8_t *data, size_t size);
+static void conn_check(struct engine_conn *conn);
+static void conn_abort(struct engine_conn *conn);
+static void conn_timer(struct engine_conn *conn);
+static void conn_drop_queue(struct engine_conn *conn);
+static void conn_release(struct engine_conn *conn);
+static void release_pending(struct engine *self);
+static void resume_waiting(struct engine *self);
+static bool wait_ready(const struct engine *self, enum engine_wait_for pool);
+static void wait_add(struct engine_conn *conn, enum engine_wait_for pool);
+static void wait_remove(struct engine_conn *conn, enum engine_wait_for pool);
+static uint32_t pong_timeout(const struct engine *self);
+static uint64_t monotonic_clock(void);
+static void on_timer(struct timer *timer);
+
+static struct engine_buf *get_buf(struct engine *self, bool reserved);
+static void put_buf(struct engine *self, struct engine_buf *buf);
+#ifndef ENGINE_URING
+static struct engine_buf *get_in(struct engine *self);
+#endif
+static void put_in(struct engine *self, struct engine_buf *buf);
+static struct engine_buf *get_ref(struct engine *self);
+static void put_ref(struct engine *self, struct engine_buf *buf);
+static void put_queued(struct engine *self, struct engine_buf *buf);
+static void put_rx(struct engine *self, void *buf);
+static const uint8_t *queued_data(const struct engine_buf *buf);
+static void conn_queue(struct engine_conn *conn, struct engine_buf *buf);
+
+static void on_send(struct wic_inst *inst, const void *data, size_t size, enum wic_buffer type);
+static void *on_buffer(struct wic_inst *inst, size_t min_size, enum wic_buffer type, size_t *max_size);
+static bool on_send_frame(struct wic_inst *inst, struct wic_frame *frame);
+static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
+static void *on_rx_buffer(struct wic_inst *inst);
+static void on_rx_release(struct wic_inst *inst, void *buf);
+static void on_close_transport(struct wic_inst *inst);
+
+#ifdef ENGINE_URING
+static size_t recv_count(const struct engine_arg *arg);
+static bool ring_init(struct engine *self);
+static void ring_deinit(struct engine *self);
+static int ring_enter(struct engine *self, uint32_t min_complete, const struct __kernel_timespec *ts);
+static void ring_reserve(struct engine *self, uint32_t count);
+static struct io_uring_sqe *ring_sqe(struct engine *self);
+static void ring_complete(struct engine *self);
+static void ring_accept(struct engine *self);
+static void ring_recv(struct engine_conn *conn);
+static void ring_cancel_recv(struct engine_conn *conn);
+static void ring_put_recv(struct engine *self, uint16_t bid);
+static void ring_on_accept(struct engine *self, int32_t res, uint32_t flags);
+static void ring_on_recv(struct engine_conn *conn, int32_t res, uint32_t flags);
+static void ring_on_send(struct engine_conn *conn, int32_t res, uint32_t flags);
+#else
+static void do_accept(struct engine *self);
+#endif
+
+/* functions **********************************************************/
+
+size_t engine_mem_size(const struct engine_arg *arg)
+{
+    return ENGINE_ALIGN(arg->max_conn * sizeof(struct engine_conn))
+        + rx_size(arg)
+        + (in_count(arg) * ENGINE_ALIGN(sizeof(struct engine_buf) + arg->tx_max))
+        + (arg->tx_count * ENGINE_ALIGN(sizeof(struct engine_buf) + arg->tx_max))
+        + (ref_count(arg) * ENGINE_ALIGN(sizeof(struct engine_buf)))
+#ifdef ENGINE_URING
+        + (recv_count(arg) * ENGINE_ALIGN(sizeof(struct engine_buf) + arg->tx_max))
+        + ENGINE_ALIGN(sizeof(struct engine_ring))
+#endif
+        ;
+}
+
+bool engine_init(struct engine *self, const struct engine_arg *arg, void *mem, size_t mem_max)
+{
+    struct sockaddr_in addr;
+#ifndef ENGINE_URING
+    struct epoll_event ev;
+#endif
+    uint8_t *ptr = mem;
+    size_t i;
+    int val = 1;
+
+    (void)memset(self, 0, sizeof(*self));
+
+    self->epoll = -1;
+    self->listener = -1;
+
+    if((arg->wic == NULL) || (arg->wic->callbacks == NULL) || (arg->max_conn == 0U) || (arg->rx_max == 0U) || (arg->tx_count == 0U) || (arg->tx_max == 0U)){
+
+        ERROR("engine_arg is incomplete")
+        return false;
+    }
+
+    if((mem == NULL) || (mem_max < engine_mem_size(arg))){
+
+        ERROR("engine needs %zu bytes of memory", engine_mem_size(arg))
+        return false;
+    }
+
+    if(arg->tx_reserve >= arg->tx_count){
+
+        ERROR("tx_reserve must be less than tx_count")
+        return false;
+    }
+
+#ifdef ENGINE_URING
+    if((recv_count(arg) > 32768U) || ((recv_count(arg) & (recv_count(arg) - 1U)) != 0U)){
+
+        ERROR("recv_count must be a power of 2 no more than 32768")
+        return false;
+    }
+#endif
+
+    self->arg = *arg;
+
+    self->callbacks = *arg->wic->callbacks;
+
+    if(arg->rx_count > 0U){
+
+        self->callbacks.on_rx_buffer = on_rx_buffer;
+        self->callbacks.on_rx_release = on_rx_release;
+    }
+    else{
+
+        self->callbacks.on_rx_buffer = NULL;
+        self->callbacks.on_rx_release = NULL;
+    }
+    self->callbacks.on_send = on_send;
+    self->callbacks.on_buffer = on_buffer;
+    self->callbacks.on_send_frame = on_send_frame;
+    self->callbacks.on_close_transport = on_close_transport;
+
+    if(arg->idle_timeout > 0U){
+
+        self->callbacks.on_message = on_message;
+    }
+
+    timer_wheel_init(&self->timers, (arg->timer_tick > 0U) ? arg->timer_tick : ENGINE_TICK, (arg->clock != NULL) ? arg->clock : monotonic_clock);
+
+    self->conn = (struct engine_conn *)ptr;
+    ptr += ENGINE_ALIGN(arg->max_conn * sizeof(struct engine_conn));
+
+    self->rx = ptr;
+    ptr += rx_size(arg);
+
+    self->buf_stride = ENGINE_ALIGN(sizeof(struct engine_buf) + arg->tx_max);
+
+    self->in = ptr;
+    ptr += in_count(arg) * self->buf_stride;
+
+    self->buf = ptr;
+    ptr += arg->tx_count * self->buf_stride;
+
+    self->tx_reserve = (arg->tx_reserve > 0U) ? arg->tx_reserve : (arg->tx_count / 8U);
+
+    self->ref = ptr;
+    ptr += ref_count(arg) * ENGINE_ALIGN(sizeof(struct engine_buf));
+
+#ifdef ENGINE_URING
+    self->recv = ptr;
+    ptr += recv_count(arg) * self->buf_stride;
+
+    /* engine_deinit() looks at the mappings and the inflight counts if
+     * engine_init() fails part way */
+    self->ring = (struct engine_ring *)ptr;
+    (void)memset(self->ring, 0, sizeof(*self->ring));
+    (void)memset(self->conn, 0, arg->max_conn * sizeof(struct engine_conn));
+    self->ring->fd = -1;
+#endif
+
+    for(i=arg->max_conn; i > 0U; i--){
+
+        self->conn[i-1U].s = -1;
+        self->conn[i-1U].next = self->free_conn;
+        self->free_conn = &self->conn[i-1U];
+    }
+
+    for(i=arg->tx_count; i > 0U; i--){
+
+        put_buf(self, (struct engine_buf *)&self->buf[(i-1U) * self->buf_stride]);
+    }
+
+    for(i=in_count(arg); i > 0U; i--){
+
+        put_in(self, (struct engine_buf *)&self->in[(i-1U) * self->buf_stride]);
+    }
+
+    for(i=ref_count(arg); i > 0U; i--){
+
+        put_ref(self, (struct engine_buf *)&self->ref[(i-1U) * ENGINE_ALIGN(sizeof(struct engine_buf))]);
+    }
+
+    for(i=arg->rx_count; i > 0U; i--){
+
+        put_rx(self, &self->rx[(i-1U) * ENGINE_ALIGN(arg->rx_max)]);
+    }
+
+    self->listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(self->listener < 0){
+
+        ERROR("socket() errno %d", errno)
+        return false;
+    }
+
+    (void)setsockopt(self->listener, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    if(arg->reuse_port && (setsockopt(self->listener, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)){
+
+        ERROR("setsockopt(SO_REUSEPORT) errno %d", errno)
+        engine_deinit(self);
+        return false;
+    }
+
+    (void)memset(&addr, 0, sizeof(addr));
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(arg->port);
+
+    if(bind(self->listener, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+
+        ERROR("bind() errno %d", errno)
+        engine_deinit(self);
+        return false;
+    }
+
+    if(listen(self->listener, SOMAXCONN) < 0){
+
+        ERROR("listen() errno %d", errno)
+        engine_deinit(self);
+        return false;
+    }
+
+#ifdef ENGINE_URING
+    if(!ring_init(self)){
+
+        engine_deinit(self);
+        return false;
+    }
+
+    ring_accept(self);
+#else
+    self->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    if(self->epoll < 0){
+
+        ERROR("epoll_create1() errno %d", errno)
+        engine_deinit(self);
+        return false;
+    }
+
+    /* the listener is the only event without a connection */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+
+    if(epoll_ctl(self->epoll, EPOLL_CTL_ADD, self->listener, &ev) < 0){
+
+        ERROR("epoll_ctl() errno %d", errno)
+        engine_deinit(self);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+void engine_run(struct engine *self)
+{
+#ifdef ENGINE_URING
+    struct __kernel_timespec ts;
+#else
+    struct epoll_event events[ENGINE_EVENTS];
+    struct engine_conn *conn;
+    int i;
+#endif
+    uint32_t next;
+    int n;
+
+    self->running = true;
+
+    while(self->running){
+
+        next = timer_wheel_next(&self->timers);
+
+#ifdef ENGINE_URING
+        ts.tv_sec = (long long)(next / 1000U);
+        ts.tv_nsec = (long long)(next % 1000U) * 1000000;
+
+        /* submits whatever the last pass prepared */
+        n = ring_enter(self, 1U, (next == TIMER_NONE) ? NULL : &ts);
+
+        if((n < 0) && (errno != EINTR) && (errno != ETIME) && (errno != EBUSY)){
+
+            ERROR("io_uring_enter() errno %d", errno)
+            break;
+        }
+
+        /* first so that timers started below are timed from now */
+        timer_wheel_run(&self->timers);
+
+        ring_complete(self);
+#else
+        n = epoll_wait(self->epoll, events, ENGINE_EVENTS, (next == TIMER_NONE) ? -1 : ((next > (uint32_t)INT_MAX) ? INT_MAX : (int)next));
+
+        if(n < 0){
+
+            if(errno != EINTR){
+
+                ERROR("epoll_wait() errno %d", errno)
+                break;
+            }
+
+            n = 0;
+        }
+
+        /* first so that timers started below are timed from now */
+        timer_wheel_run(&self->timers);
+
+        for(i=0; i < n; i++){
+
+            conn = events[i].data.ptr;
+
+            if(conn == NULL){
+
+                do_accept(self);
+            }
+            /* released earlier in this pass */
+            else if(conn->s < 0){
+
+                /* nothing */
+            }
+            else{
+
+                if((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0U){
+
+                    conn_write(conn);
+                    conn_drained(conn);
+                }
+
+                if((conn->s >= 0) && ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) != 0U)){
+
+                    conn_read(conn);
+                }
+
+                conn_check(conn);
+            }
+        }
+#endif
+
+        resume_waiting(self);
+
+        /* nothing refers to these connections any more */
+        release_pending(self);
+    }
+}
+
+void engine_stop(struct engine *self)
+{
+    self->running = false;
+}
+
+void engine_deinit(struct engine *self)
+{
+    size_t i;
+#ifdef ENGINE_URING
+    struct __kernel_timespec ts = {.tv_sec = 0, .tv_nsec = 100000000};
+#endif
+
+    if(self->conn != NULL){
+
+        for(i=0U; i < self->arg.max_conn; i++){
+
+            if(self->conn[i].s >= 0){
+
+                wic_close_with_reason(&self->conn[i].inst, WIC_CLOSE_GOING_AWAY, NULL, 0U);
+
+                /* don't wait for the close frame to drain */
+                conn_release(&self->conn[i]);
+            }
+        }
+
+#ifdef ENGINE_URING
+        /* sends still refer to queued buffers and frames */
+        for(i=0U; (i < 10U) && (self->release != NULL) && (self->ring->fd >= 0); i++){
+
+            (void)ring_enter(self, 1U, &ts);
+            ring_complete(self);
+            release_pending(self);
+        }
+#endif
+
+        release_pending(self);
+    }
+
+#ifdef ENGINE_URING
+    if(self->ring != NULL){
+
+        ring_deinit(self);
+    }
+#endif
+
+    if(self->epoll >= 0){
+
+        (void)close(self->epoll);
+        self->epoll = -1;
+    }
+
+    if(self->listener >= 0){
+
+        (void)close(self->listener);
+        self->listener = -1;
+    }
+}
+
+void engine_resume(struct wic_inst *inst)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+
+    if(conn->s >= 0){
+
+        /* a message held back by wic_inst is delivered before new input
+         * (not while parsing the handshake, where no input means the
+         * end of it) */
+        if(wic_get_state(inst) == WIC_STATE_OPEN){
+
+            (void)wic_parse(inst, conn->engine->in, 0U);
+        }
+
+        conn_read(conn);
+        conn_check(conn);
+    }
+}
+
+void *engine_get_app(struct wic_inst *inst)
+{
+    return ((struct engine_conn *)wic_get_app(inst))->app;
+}
+
+void engine_set_app(struct wic_inst *inst, void *app)
+{
+    ((struct engine_conn *)wic_get_app(inst))->app = app;
+}
+
+size_t engine_count(const struct engine *self)
+{
+    return self->count;
+}
+
+struct engine *engine_get_engine(struct wic_inst *inst)
+{
+    return ((struct engine_conn *)wic_get_app(inst))->engine;
+}
+
+struct timer_wheel *engine_get_timers(struct engine *self)
+{
+    return &self->timers;
+}
+
+size_t engine_broadcast(struct engine *self, struct wic_frame *frame)
+{
+    size_t retval = 0U;
+    size_t i;
+
+    for(i=0U; i < self->arg.max_conn; i++){
+
+        if((self->conn[i].s >= 0) && !self->conn[i].closing && (wic_get_state(&self->conn[i].inst) == WIC_STATE_OPEN)){
+
+            if(wic_send_frame(&self->conn[i].inst, frame) == WIC_STATUS_SUCCESS){
+
+                retval++;
+            }
+        }
+    }
+
+    return retval;
+}
+
+/* static functions ***************************************************/
+
+static size_t ref_count(const struct engine_arg *arg)
+{
+    return (arg->ref_count > 0U) ? arg->ref_count : arg->tx_count;
+}
+
+static size_t in_count(const struct engine_arg *arg)
+{
+#ifdef ENGINE_URING
+    /* input stays in the provided receive buffers */
+    (void)arg;
+    return 0U;
+#else
+    return (arg->in_count > 0U) ? arg->in_count : arg->max_conn;
+#endif
+}
+
+static size_t rx_size(const struct engine_arg *arg)
+{
+    return (arg->rx_count > 0U) ? (arg->rx_count * ENGINE_ALIGN(arg->rx_max)) : ENGINE_ALIGN(arg->max_conn * arg->rx_max);
+}
+
+#ifndef ENGINE_URING
+static void do_accept(struct engine *self)
+{
+    int s;
+
+    for(;;){
+
+        s = accept4(self->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(s < 0){
+
+            if((errno == EINTR) || (errno == ECONNABORTED)){
+
+                continue;
+            }
+
+            if((errno != EAGAIN) && (errno != EWOULDBLOCK)){
+
+                ERROR("accept4() errno %d", errno)
+            }
+            break;
+        }
+
+        conn_open(self, s);
+    }
+}
+#endif
+
+static void conn_open(struct engine *self, int s)
+{
+    struct engine_conn *conn;
+    struct wic_init_arg arg;
+#ifndef ENGINE_URING
+    struct epoll_event ev;
+#endif
+    int val = 1;
+
+    if(self->free_conn == NULL){
+
+        ERROR("no free connections")
+        (void)close(s);
+    }
+    else{
+
+        conn = self->free_conn;
+        self->free_conn = conn->next;
+
+        (void)memset(conn, 0, offsetof(struct engine_conn, inst));
+
+        conn->s = s;
+        conn->engine = self;
+
+        conn->accepted = timer_wheel_time(&self->timers);
+        conn->last_rx = conn->accepted;
+        conn->last_msg = conn->accepted;
+
+        timer_init(&conn->timer, on_timer);
+
+        (void)setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+        arg = *self->arg.wic;
+
+        arg.role = WIC_ROLE_SERVER;
+        arg.rx_max = self->arg.rx_max;
+
+        arg.rx = (self->arg.rx_count > 0U) ? NULL : &self->rx[(size_t)(conn - self->conn) * self->arg.rx_max];
+        arg.app = conn;
+        arg.callbacks = &self->callbacks;
+
+        self->count++;
+
+        if(!wic_init(&conn->inst, &arg)){
+
+            ERROR("wic_init()")
+            conn_release(conn);
+        }
+        else{
+#ifdef ENGINE_URING
+            ring_recv(conn);
+            conn_timer(conn);
+#else
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = conn;
+
+            if(epoll_ctl(self->epoll, EPOLL_CTL_ADD, s, &ev) < 0){
+
+                ERROR("epoll_ctl() errno %d", errno)
+                conn_release(conn);
+            }
+            else{
+
+                conn_timer(conn);
+            }
+#endif
+        }
+    }
+}
+
+/* parse input held back by back-pressure and then read until EAGAIN
+ * (with io_uring the recv is armed again instead) */
+static void conn_read(struct engine_conn *conn)
+{
+    struct engine *self = conn->engine;
+    struct engine_buf *spill;
+    size_t pos;
+#ifndef ENGINE_URING
+    struct engine_buf *buf = NULL;
+    ssize_t n;
+#endif
+
+    while(conn->spill != NULL){
+
+        spill = conn->spill;
+
+        pos = conn_parse(conn, &spill->data[spill->pos], spill->size - spill->pos);
+
+        /* released while parsing */
+        if(conn->spill != spill){
+
+            return;
+        }
+
+        spill->pos += pos;
+
+        if(spill->pos < spill->size){
+
+            return;
+        }
+
+        conn->spill = spill->next;
+        put_in(self, spill);
+    }
+
+#ifdef ENGINE_URING
+    if((conn->s >= 0) && !conn->closing && !conn->recv_armed){
+
+        ring_recv(conn);
+    }
+#else
+    while((conn->s >= 0) && !conn->closing){
+
+        if(buf == NULL){
+
+            buf = get_in(self);
+
+            if(buf == NULL){
+
+                wait_add(conn, ENGINE_WAIT_IN);
+                break;
+            }
+        }
+
+        n = recv(conn->s, buf->data, self->arg.tx_max, 0);
+
+        if(n > 0){
+
+            buf->size = (size_t)n;
+            buf->pos = 0U;
+
+            /* stop reading until it has been parsed */
+            if(conn_input(conn, buf)){
+
+                buf = NULL;
+                break;
+            }
+        }
+        else if(n == 0){
+
+            wic_close_with_reason(&conn->inst, WIC_CLOSE_ABNORMAL_2, NULL, 0U);
+            break;
+        }
+        else if(errno == EINTR){
+
+            /* again */
+        }
+        else if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+
+            break;
+        }
+        else{
+
+            wic_close_with_reason(&conn->inst, WIC_CLOSE_ABNORMAL_2, NULL, 0U);
+            break;
+        }
+    }
+
+    if(buf != NULL){
+
+        put_in(self, buf);
+    }
+#endif
+}
+
+/* parse new input unless older input is still waiting, returns true if
+ * back-pressure left some of it to be held */
+static bool conn_input(struct engine_conn *conn, struct engine_buf *buf)
+{
+    bool retval = false;
+
+    conn->last_rx = timer_wheel_time(&conn->engine->timers);
+
+    if(conn->spill == NULL){
+
+        buf->pos += conn_parse(conn, &buf->data[buf->pos], buf->size - buf->pos);
+    }
+
+    /* nothing to hold if the connection was released */
+    if((buf->pos < buf->size) && (conn->s >= 0)){
+
+        conn_hold(conn, buf);
+        retval = true;
+    }
+
+    return retval;
+}
+
+/* put a buffer on the end of the spill chain */
+static void conn_hold(struct engine_conn *conn, struct engine_buf *buf)
+{
+    struct engine_buf *tail;
+
+    buf->next = NULL;
+
+    if(conn->spill == NULL){
+
+        conn->spill = buf;
+    }
+    else{
+
+        for(tail = conn->spill; tail->next != NULL; tail = tail->next){
+
+            /* find the end */
+        }
+
+        tail->next = buf;
+    }
+}
+
+#ifdef ENGINE_URING
+/* send queued output as one linked chain, the next chain goes when
+ * the last completion for this one comes back */
+static void conn_write(struct engine_conn *conn)
+{
+    struct engine *self = conn->engine;
+    struct io_uring_sqe *sqe;
+    struct engine_buf *buf;
+    uint32_t count = 0U;
+
+    if((conn->s >= 0) && (conn->sending == 0U) && !conn->error){
+
+        for(buf = conn->head; (buf != NULL) && (count < ENGINE_IOV); buf = buf->next){
+
+            count++;
+        }
+
+        /* a chain mustn't be split across submissions */
+        ring_reserve(self, count);
+
+        for(buf = conn->head; (buf != NULL) && (conn->sending < count); buf = buf->next){
+
+            sqe = ring_sqe(self);
+
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->s;
+            sqe->addr = (uint64_t)(uintptr_t)&queued_data(buf)[buf->pos];
+            sqe->len = (uint32_t)(buf->size - buf->pos);
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+
+            if(self->ring->fixed && (buf->frame == NULL) && (sqe->len >= ENGINE_ZC_MIN)){
+
+                sqe->opcode = IORING_OP_SEND_ZC;
+                sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+                sqe->buf_index = 0U;
+            }
+
+            conn->sending++;
+            conn->inflight++;
+
+            if(conn->sending < count){
+
+                sqe->flags = IOSQE_IO_LINK;
+            }
+        }
+    }
+
+    if(conn->error){
+
+        conn_drop_queue(conn);
+    }
+
+    if(conn->closing && (conn->head == NULL)){
+
+        conn_release(conn);
+    }
+}
+#else
+/* write queued output until EAGAIN (EPOLLOUT brings us back) */
+static void conn_write(struct engine_conn *conn)
+{
+    struct iovec iov[ENGINE_IOV];
+    struct engine_buf *buf;
+    size_t count;
+    ssize_t n;
+
+    while((conn->head != NULL) && !conn->error){
+
+        count = 0U;
+
+        for(buf = conn->head; (buf != NULL) && (count < ENGINE_IOV); buf = buf->next){
+
+            iov[count].iov_base = (void *)&queued_data(buf)[buf->pos];
+            iov[count].iov_len = buf->size - buf->pos;
+            count++;
+        }
+
+        n = writev(conn->s, iov, (int)count);
+
+        if(n >= 0){
+
+            conn_sent(conn, (size_t)n);
+        }
+        else if(errno == EINTR){
+
+            /* again */
+        }
+        else if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+
+            break;
+        }
+        else{
+
+            conn->error = true;
+        }
+    }
+
+    if(conn->error){
+
+        conn_drop_queue(conn);
+    }
+
+    if(conn->closing && (conn->head == NULL)){
+
+        conn_release(conn);
+    }
+}
+#endif
+
+/* remove what has been written from the front of the queue */
+static void conn_sent(struct engine_conn *conn, size_t size)
+{
+    struct engine_buf *buf;
+
+    while((conn->head != NULL) && (size >= (conn->head->size - conn->head->pos))){
+
+        buf = conn->head;
+        size -= buf->size - buf->pos;
+        conn->head = buf->next;
+        conn->queued--;
+        put_queued(conn->engine, buf);
+    }
+
+    if(conn->head == NULL){
+
+        conn->tail = NULL;
+    }
+    else{
+
+        conn->head->pos += size;
+    }
+}
+
+static void conn_drained(struct engine_conn *conn)
+{
+    struct engine *self = conn->engine;
+
+    if((conn->s >= 0) && conn->blocked && (conn->queued == 0U)){
+
+        conn->blocked = false;
+        wait_remove(conn, ENGINE_WAIT_TX);
+
+        if(self->arg.on_drain != NULL){
+
+            self->arg.on_drain(&conn->inst);
+        }
+    }
+}
+
+static size_t conn_parse(struct engine_conn *conn, const uint8_t *data, size_t size)
+{
+    size_t pos = 0U;
+    size_t n;
+
+    while(pos < size){
+
+        n = wic_parse(&conn->inst, &data[pos], size - pos);
+
+        /* back-pressure */
+        if(n == 0U){
+
+            break;
+        }
+
+        pos += n;
+    }
+
+    return pos;
+}
+
+/* a write error can't be handled from inside on_send */
+static void conn_check(struct engine_conn *conn)
+{
+    if((conn->s >= 0) && conn->error){
+
+        conn_abort(conn);
+    }
+}
+
+/* drop the connection without waiting for output to drain */
+static void conn_abort(struct engine_conn *conn)
+{
+    if(!conn->closing){
+
+        wic_close_with_reason(&conn->inst, WIC_CLOSE_ABNORMAL_2, NULL, 0U);
+    }
+
+    /* wic_inst was already closed */
+    if(conn->s >= 0){
+
+        conn_release(conn);
+    }
+}
+
+/* start the timer for whichever deadline is next */
+static void conn_timer(struct engine_conn *conn)
+{
+    struct engine *self = conn->engine;
+    uint64_t now = timer_wheel_time(&self->timers);
+    uint64_t next = UINT64_MAX;
+    uint64_t at;
+    uint32_t poll;
+
+    if(conn->closing){
+
+        if(self->arg.close_timeout > 0U){
+
+            next = conn->closed + self->arg.close_timeout;
+        }
+    }
+    else if(wic_get_state(&conn->inst) != WIC_STATE_OPEN){
+
+        if(self->arg.handshake_timeout > 0U){
+
+            next = conn->accepted + self->arg.handshake_timeout;
+        }
+        else{
+
+            /* check again later for keepalive and idle */
+            poll = (self->arg.ping_interval > 0U) ? self->arg.ping_interval : self->arg.idle_timeout;
+
+            if(poll > 0U){
+
+                next = now + poll;
+            }
+        }
+    }
+    else{
+
+        if(self->arg.idle_timeout > 0U){
+
+            next = conn->last_msg + self->arg.idle_timeout;
+        }
+
+        if(self->arg.ping_interval > 0U){
+
+            at = conn->ping ? (conn->ping_sent + pong_timeout(self)) : (conn->last_rx + self->arg.ping_interval);
+            next = (at < next) ? at : next;
+        }
+    }
+
+    if(next == UINT64_MAX){
+
+        timer_stop(&conn->timer);
+    }
+    else{
+
+        timer_start(&self->timers, &conn->timer, (next > now) ? (uint32_t)(next - now) : 0U);
+    }
+}
+
+static void conn_drop_queue(struct engine_conn *conn)
+{
+    struct engine_buf *buf;
+
+    /* buffers the kernel is sending from go once it's done with them */
+    while((conn->head != NULL) && (conn->sending == 0U)){
+
+        buf = conn->head;
+        conn->head = buf->next;
+        conn->queued--;
+        put_queued(conn->engine, buf);
+    }
+
+    if(conn->head == NULL){
+
+        conn->tail = NULL;
+    }
+}
+
+static void conn_release(struct engine_conn *conn)
+{
+    struct engine *self = conn->engine;
+    struct engine_buf *spill;
+    size_t i;
+
+    if(conn->s >= 0){
+
+#ifdef ENGINE_URING
+        /* ends the multishot recv and any send in progress */
+        (void)shutdown(conn->s, SHUT_RDWR);
+#endif
+        /* also removes it from epoll */
+        (void)close(conn->s);
+        conn->s = -1;
+
+        conn_drop_queue(conn);
+        timer_stop(&conn->timer);
+
+        for(i=0U; i < (size_t)ENGINE_WAIT_MAX; i++){
+
+            wait_remove(conn, (enum engine_wait_for)i);
+        }
+
+        while(conn->spill != NULL){
+
+            spill = conn->spill;
+            conn->spill = spill->next;
+            put_in(self, spill);
+        }
+
+        self->count--;
+
+        conn->next = self->release;
+        self->release = conn;
+    }
+}
+
+static void release_pending(struct engine *self)
+{
+    struct engine_conn *conn;
+    struct engine_conn *held = NULL;
+
+    while(self->release != NULL){
+
+        conn = self->release;
+        self->release = conn->next;
+
+        /* io_uring completions still refer to it */
+        if(conn->inflight > 0U){
+
+            conn->next = held;
+            held = conn;
+        }
+        else{
+
+            conn->next = self->free_conn;
+            self->free_conn = conn;
+        }
+    }
+
+    self->release = held;
+}
+
+/* connections are resumed in the order they started waiting */
+static void resume_waiting(struct engine *self)
+{
+    struct engine_conn *conn;
+    size_t count;
+    size_t i;
+
+    for(i=0U; i < (size_t)ENGINE_WAIT_MAX; i++){
+
+        /* those which have to wait again go to the back of the line and
+         * aren't resumed twice in one pass */
+        for(count = self->wait_count[i]; (count > 0U) && (self->wait_head[i] != NULL) && wait_ready(self, (enum engine_wait_for)i); count--){
+
+            conn = self->wait_head[i];
+
+            wait_remove(conn, (enum engine_wait_for)i);
+
+            if((enum engine_wait_for)i == ENGINE_WAIT_TX){
+
+                conn->blocked = false;
+
+                if(self->arg.on_drain != NULL){
+
+                    self->arg.on_drain(&conn->inst);
+                }
+            }
+            else{
+
+                engine_resume(&conn->inst);
+            }
+        }
+    }
+}
+
+static bool wait_ready(const struct engine *self, enum engine_wait_for pool)
+{
+    bool retval;
+
+    switch(pool){
+    default:
+    case ENGINE_WAIT_RX:
+        retval = (self->free_rx != NULL);
+        break;
+    case ENGINE_WAIT_TX:
+        retval = (self->free_count > self->tx_reserve) || (self->free_ref != NULL);
+        break;
+    case ENGINE_WAIT_IN:
+#ifdef ENGINE_URING
+        retval = (self->ring->br_free > 0U);
+#else
+        retval = (self->free_in != NULL);
+#endif
+        break;
+    }
+
+    return retval;
+}
+
+static void wait_add(struct engine_conn *conn, enum engine_wait_for pool)
+{
+    struct engine *self = conn->engine;
+    struct engine_wait *wait = &conn->wait[pool];
+
+    if(!wait->waiting){
+
+        wait->waiting = true;
+        wait->prev = self->wait_tail[pool];
+        wait->next = NULL;
+
+        if(self->wait_tail[pool] != NULL){
+
+            self->wait_tail[pool]->wait[pool].next = conn;
+        }
+        else{
+
+            self->wait_head[pool] = conn;
+        }
+
+        self->wait_tail[pool] = conn;
+        self->wait_count[pool]++;
+    }
+}
+
+static void wait_remove(struct engine_conn *conn, enum engine_wait_for pool)
+{
+    struct engine *self = conn->engine;
+    struct engine_wait *wait = &conn->wait[pool];
+
+    if(wait->waiting){
+
+        if(wait->prev != NULL){
+
+            wait->prev->wait[pool].next = wait->next;
+        }
+        else{
+
+            self->wait_head[pool] = wait->next;
+        }
+
+        if(wait->next != NULL){
+
+            wait->next->wait[pool].prev = wait->prev;
+        }
+        else{
+
+            self->wait_tail[pool] = wait->prev;
+        }
+
+        wait->prev = NULL;
+        wait->next = NULL;
+        wait->waiting = false;
+        self->wait_count[pool]--;
+    }
+}
+
+static uint32_t pong_timeout(const struct engine *self)
+{
+    return (self->arg.pong_timeout > 0U) ? self->arg.pong_timeout : self->arg.ping_interval;
+}
+
+static uint64_t monotonic_clock(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000U) + ((uint64_t)ts.tv_nsec / 1000000U);
+}
+
+static void on_timer(struct timer *timer)
+{
+    struct engine_conn *conn = (struct engine_conn *)((uint8_t *)timer - offsetof(struct engine_conn, timer));
+    struct engine *self = conn->engine;
+    uint64_t now = timer_wheel_time(&self->timers);
+
+    if(conn->closing){
+
+        if((self->arg.close_timeout > 0U) && ((now - conn->closed) >= self->arg.close_timeout)){
+
+            conn_release(conn);
+        }
+    }
+    else if(wic_get_state(&conn->inst) != WIC_STATE_OPEN){
+
+        if((self->arg.handshake_timeout > 0U) && ((now - conn->accepted) >= self->arg.handshake_timeout)){
+
+            conn_abort(conn);
+        }
+    }
+    else if((self->arg.idle_timeout > 0U) && ((now - conn->last_msg) >= self->arg.idle_timeout)){
+
+        wic_close_with_reason(&conn->inst, WIC_CLOSE_GOING_AWAY, NULL, 0U);
+    }
+    else if(self->arg.ping_interval > 0U){
+
+        /* any input will do as an answer */
+        if(conn->ping && (conn->last_rx >= conn->ping_sent)){
+
+            conn->ping = false;
+        }
+
+        if(conn->ping){
+
+            if((now - conn->ping_sent) >= pong_timeout(self)){
+
+                conn_abort(conn);
+            }
+        }
+        else if((now - conn->last_rx) >= self->arg.ping_interval){
+
+            /* a ping that can't be queued still has a deadline since
+             * the connection isn't draining */
+            (void)wic_send_ping(&conn->inst);
+
+            conn->ping = true;
+            conn->ping_sent = now;
+        }
+        else{
+
+            /* not due */
+        }
+    }
+    else{
+
+        /* not due */
+    }
+
+    if(conn->s >= 0){
+
+        conn_timer(conn);
+    }
+}
+
+/* the last tx_reserve buffers are only for reserved uses */
+static struct engine_buf *get_buf(struct engine *self, bool reserved)
+{
+    struct engine_buf *buf = NULL;
+
+    if(self->free_count > (reserved ? 0U : self->tx_reserve)){
+
+        buf = self->free_buf;
+
+        self->free_buf = buf->next;
+        self->free_count--;
+        buf->next = NULL;
+    }
+
+    return buf;
+}
+
+static void put_buf(struct engine *self, struct engine_buf *buf)
+{
+    buf->frame = NULL;
+    buf->next = self->free_buf;
+    self->free_buf = buf;
+    self->free_count++;
+}
+
+#ifndef ENGINE_URING
+static struct engine_buf *get_in(struct engine *self)
+{
+    struct engine_buf *buf = self->free_in;
+
+    if(buf != NULL){
+
+        self->free_in = buf->next;
+        buf->next = NULL;
+    }
+
+    return buf;
+}
+#endif
+
+/* with io_uring input buffers go back to the kernel */
+static void put_in(struct engine *self, struct engine_buf *buf)
+{
+#ifdef ENGINE_URING
+    ring_put_recv(self, (uint16_t)(((uint8_t *)buf - self->recv) / self->buf_stride));
+#else
+    buf->next = self->free_in;
+    self->free_in = buf;
+#endif
+}
+
+static struct engine_buf *get_ref(struct engine *self)
+{
+    struct engine_buf *buf = self->free_ref;
+
+    if(buf != NULL){
+
+        self->free_ref = buf->next;
+        buf->next = NULL;
+    }
+
+    return buf;
+}
+
+static void put_ref(struct engine *self, struct engine_buf *buf)
+{
+    buf->frame = NULL;
+    buf->next = self->free_ref;
+    self->free_ref = buf;
+}
+
+/* return a queued element to whichever pool it came from */
+static void put_queued(struct engine *self, struct engine_buf *buf)
+{
+    struct wic_frame *frame = buf->frame;
+
+    if(frame != NULL){
+
+        put_ref(self, buf);
+        wic_frame_unref(frame);
+    }
+    else{
+
+        put_buf(self, buf);
+    }
+}
+
+/* a free rx buffer holds the link to the next one */
+static void put_rx(struct engine *self, void *buf)
+{
+    *(void **)buf = self->free_rx;
+    self->free_rx = buf;
+}
+
+static const uint8_t *queued_data(const struct engine_buf *buf)
+{
+    return (buf->frame != NULL) ? buf->frame->data : buf->data;
+}
+
+static void conn_queue(struct engine_conn *conn, struct engine_buf *buf)
+{
+    if(conn->tail != NULL){
+
+        conn->tail->next = buf;
+    }
+    else{
+
+        conn->head = buf;
+    }
+
+    conn->tail = buf;
+
+    /* nothing else is queued so it can go straight out */
+    if(conn->head == buf){
+
+        conn_write(conn);
+    }
+}
+
+static void on_send(struct wic_inst *inst, const void *data, size_t size, enum wic_buffer type)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+    struct engine_buf *buf = (struct engine_buf *)((uint8_t *)data - offsetof(struct engine_buf, data));
+
+    (void)type;
+
+    if(size == 0U){
+
+        conn->queued--;
+        put_buf(conn->engine, buf);
+    }
+    else{
+
+        buf->size = size;
+        buf->pos = 0U;
+        buf->next = NULL;
+
+        conn_queue(conn, buf);
+    }
+}
+
+static void *on_buffer(struct wic_inst *inst, size_t min_size, enum wic_buffer type, size_t *max_size)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+    struct engine *self = conn->engine;
+    struct engine_buf *buf = NULL;
+
+    *max_size = self->arg.tx_max;
+
+    if(min_size > self->arg.tx_max){
+
+        /* wic_inst reports WIC_STATUS_TOO_LARGE */
+    }
+    else if((self->arg.tx_queue_max > 0U) && (conn->queued >= self->arg.tx_queue_max)){
+
+        conn->blocked = true;
+    }
+    else{
+
+        /* so that a handshake can be answered and a connection closed
+         * however many buffers are queued to slow readers */
+        buf = get_buf(self, (type == WIC_BUFFER_HTTP) || (type == WIC_BUFFER_CLOSE) || (type == WIC_BUFFER_CLOSE_RESPONSE));
+
+        if(buf != NULL){
+
+            conn->queued++;
+        }
+        else{
+
+            /* resumed once a buffer is returned since nothing of its
+             * own may be queued */
+            conn->blocked = true;
+            wait_add(conn, ENGINE_WAIT_TX);
+        }
+    }
+
+    return (buf != NULL) ? buf->data : NULL;
+}
+
+/* the frame is referenced rather than copied */
+static bool on_send_frame(struct wic_inst *inst, struct wic_frame *frame)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+    struct engine *self = conn->engine;
+    struct engine_buf *buf = NULL;
+
+    if((self->arg.tx_queue_max > 0U) && (conn->queued >= self->arg.tx_queue_max)){
+
+        conn->blocked = true;
+    }
+    else{
+
+        buf = get_ref(self);
+
+        if(buf != NULL){
+
+            wic_frame_ref(frame);
+
+            buf->frame = frame;
+            buf->size = frame->size;
+            buf->pos = 0U;
+
+            conn->queued++;
+
+            conn_queue(conn, buf);
+        }
+        else{
+
+            conn->blocked = true;
+            wait_add(conn, ENGINE_WAIT_TX);
+        }
+    }
+
+    return (buf != NULL);
+}
+
+/* only used with idle_timeout */
+static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+    struct engine *self = conn->engine;
+
+    conn->last_msg = timer_wheel_time(&self->timers);
+
+    return (self->arg.wic->callbacks->on_message != NULL) ? self->arg.wic->callbacks->on_message(inst, encoding, fin, data, size) : true;
+}
+
+static void *on_rx_buffer(struct wic_inst *inst)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+    struct engine *self = conn->engine;
+    void *buf = self->free_rx;
+
+    if(buf != NULL){
+
+        self->free_rx = *(void **)buf;
+    }
+    else{
+
+        wait_add(conn, ENGINE_WAIT_RX);
+    }
+
+    return buf;
+}
+
+static void on_rx_release(struct wic_inst *inst, void *buf)
+{
+    put_rx(((struct engine_conn *)wic_get_app(inst))->engine, buf);
+}
+
+static void on_close_transport(struct wic_inst *inst)
+{
+    struct engine_conn *conn = wic_get_app(inst);
+
+    /* let the close frame drain first */
+    if(conn->head != NULL){
+
+        conn->closing = true;
+        conn->closed = timer_wheel_time(&conn->engine->timers);
+
+        conn_timer(conn);
+    }
+    else{
+
+        conn_release(conn);
+    }
+}
+
+#ifdef ENGINE_URING
+
+static size_t recv_count(const struct engine_arg *arg)
+{
+    return (arg->recv_count > 0U) ? arg->recv_count : ENGINE_RECV_COUNT;
+}
+
+static bool ring_init(struct engine *self)
+{
+    struct engine_ring *ring = self->ring;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct iovec iov;
+    uint8_t *sq;
+    uint8_t *cq;
+    size_t i;
+
+    (void)memset(ring, 0, sizeof(*ring));
+
+    (void)memset(&p, 0, sizeof(p));
+
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = ENGINE_CQ_ENTRIES;
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, ENGINE_SQ_ENTRIES, &p);
+
+    /* older kernels don't know the optional flags */
+    if((ring->fd < 0) && (errno == EINVAL)){
+
+        (void)memset(&p, 0, sizeof(p));
+
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = ENGINE_CQ_ENTRIES;
+
+        ring->fd = (int)syscall(__NR_io_uring_setup, ENGINE_SQ_ENTRIES, &p);
+    }
+
+    if(ring->fd < 0){
+
+        ERROR("io_uring_setup() errno %d", errno)
+        return false;
+    }
+
+    if((p.features & (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) != (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)){
+
+        ERROR("io_uring needs IORING_FEAT_NODROP and IORING_FEAT_EXT_ARG")
+        return false;
+    }
+
+    ring->sq_map_size = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+    ring->cq_map_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+
+    if((p.features & IORING_FEAT_SINGLE_MMAP) != 0U){
+
+        ring->sq_map_size = (ring->cq_map_size > ring->sq_map_size) ? ring->cq_map_size : ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(ring->sq_map == MAP_FAILED){
+
+        ring->sq_map = NULL;
+        ERROR("mmap() errno %d", errno)
+        return false;
+    }
+
+    if((p.features & IORING_FEAT_SINGLE_MMAP) != 0U){
+
+        ring->cq_map = ring->sq_map;
+    }
+    else{
+
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if(ring->cq_map == MAP_FAILED){
+
+            ring->cq_map = NULL;
+            ERROR("mmap() errno %d", errno)
+            return false;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->sqes == MAP_FAILED){
+
+        ring->sqes = NULL;
+        ERROR("mmap() errno %d", errno)
+        return false;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+
+    ring->sq_head = (uint32_t *)&sq[p.sq_off.head];
+    ring->sq_tail = (uint32_t *)&sq[p.sq_off.tail];
+    ring->sq_array = (uint32_t *)&sq[p.sq_off.array];
+    ring->sq_mask = *(uint32_t *)&sq[p.sq_off.ring_mask];
+    ring->sq_entries = *(uint32_t *)&sq[p.sq_off.ring_entries];
+    ring->sq_local = *ring->sq_tail;
+
+    ring->cq_head = (uint32_t *)&cq[p.cq_off.head];
+    ring->cq_tail = (uint32_t *)&cq[p.cq_off.tail];
+    ring->cq_mask = *(uint32_t *)&cq[p.cq_off.ring_mask];
+    ring->cqes = (struct io_uring_cqe *)&cq[p.cq_off.cqes];
+
+    /* the buffer ring must be page aligned */
+    ring->br_size = recv_count(&self->arg) * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(ring->br == MAP_FAILED){
+
+        ring->br = NULL;
+        ERROR("mmap() errno %d", errno)
+        return false;
+    }
+
+    ring->br_mask = (uint16_t)(recv_count(&self->arg) - 1U);
+
+    (void)memset(&reg, 0, sizeof(reg));
+
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = (uint32_t)recv_count(&self->arg);
+    reg.bgid = ENGINE_BGID;
+
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+
+        ERROR("IORING_REGISTER_PBUF_RING errno %d", errno)
+        return false;
+    }
+
+    for(i=0U; i < recv_count(&self->arg); i++){
+
+        ring_put_recv(self, (uint16_t)i);
+    }
+
+    /* sends copy from user memory if the pool can't be pinned */
+    iov.iov_base = self->buf;
+    iov.iov_len = self->arg.tx_count * self->buf_stride;
+
+    ring->fixed = (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+
+    return true;
+}
+
+static void ring_deinit(struct engine *self)
+{
+    struct engine_ring *ring = self->ring;
+    size_t i;
+
+    if(ring->fd >= 0){
+
+        /* cancels whatever is still in flight */
+        (void)close(ring->fd);
+        ring->fd = -1;
+    }
+
+    if(ring->br != NULL){
+
+        (void)munmap(ring->br, ring->br_size);
+        ring->br = NULL;
+    }
+
+    if(ring->sqes != NULL){
+
+        (void)munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+
+    if((ring->cq_map != NULL) && (ring->cq_map != ring->sq_map)){
+
+        (void)munmap(ring->cq_map, ring->cq_map_size);
+    }
+
+    ring->cq_map = NULL;
+
+    if(ring->sq_map != NULL){
+
+        (void)munmap(ring->sq_map, ring->sq_map_size);
+        ring->sq_map = NULL;
+    }
+
+    /* completions that never came */
+    for(i=0U; i < self->arg.max_conn; i++){
+
+        if((self->conn != NULL) && (self->conn[i].inflight > 0U)){
+
+            self->conn[i].inflight = 0U;
+            self->conn[i].sending = 0U;
+
+            conn_drop_queue(&self->conn[i]);
+        }
+    }
+
+    release_pending(self);
+}
+
+/* submit what has been prepared and optionally wait for a completion */
+static int ring_enter(struct engine *self, uint32_t min_complete, const struct __kernel_timespec *ts)
+{
+    struct engine_ring *ring = self->ring;
+    struct io_uring_getevents_arg arg;
+    uint32_t to_submit;
+    int retval;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+    to_submit = ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(min_complete > 0U){
+
+        (void)memset(&arg, 0, sizeof(arg));
+
+        arg.ts = (uint64_t)(uintptr_t)ts;
+
+        retval = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    else{
+
+        retval = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 0U, 0U, NULL, 0U);
+    }
+
+    return retval;
+}
+
+/* make room for count entries in the submission queue */
+static void ring_reserve(struct engine *self, uint32_t count)
+{
+    struct engine_ring *ring = self->ring;
+
+    if((ring->sq_entries - (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE))) < count){
+
+        (void)ring_enter(self, 0U, NULL);
+    }
+}
+
+static struct io_uring_sqe *ring_sqe(struct engine *self)
+{
+    struct engine_ring *ring = self->ring;
+    struct io_uring_sqe *sqe;
+    uint32_t index;
+
+    ring_reserve(self, 1U);
+
+    index = ring->sq_local & ring->sq_mask;
+
+    sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sq_local++;
+
+    (void)memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+static void ring_complete(struct engine *self)
+{
+    struct engine_ring *ring = self->ring;
+    struct engine_conn *conn;
+    struct io_uring_cqe *cqe;
+    uint32_t head = *ring->cq_head;
+    uint64_t user_data;
+    uint32_t flags;
+    int32_t res;
+
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+
+        cqe = &ring->cqes[head & ring->cq_mask];
+
+        user_data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+
+        /* the entry can be reused now it has been copied */
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        conn = (struct engine_conn *)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+
+        switch(user_data & OP_MASK){
+        default:
+        case OP_ACCEPT:
+            ring_on_accept(self, res, flags);
+            break;
+        case OP_RECV:
+            ring_on_recv(conn, res, flags);
+            break;
+        case OP_SEND:
+            ring_on_send(conn, res, flags);
+            break;
+        case OP_CANCEL:
+            conn->inflight--;
+            break;
+        }
+    }
+}
+
+static void ring_accept(struct engine *self)
+{
+    struct io_uring_sqe *sqe = ring_sqe(self);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = self->listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void ring_recv(struct engine_conn *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(conn->engine);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->s;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ENGINE_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+
+    conn->recv_armed = true;
+    conn->inflight++;
+}
+
+/* stop receiving while the application applies back-pressure */
+static void ring_cancel_recv(struct engine_conn *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(conn->engine);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_CANCEL;
+
+    conn->recv_cancel = true;
+    conn->inflight++;
+}
+
+/* give a receive buffer back to the kernel */
+static void ring_put_recv(struct engine *self, uint16_t bid)
+{
+    struct engine_ring *ring = self->ring;
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & ring->br_mask];
+
+    /* the last field of the first entry is the tail so don't memset */
+    buf->addr = (uint64_t)(uintptr_t)((struct engine_buf *)&self->recv[bid * self->buf_stride])->data;
+    buf->len = (uint32_t)self->arg.tx_max;
+    buf->bid = bid;
+
+    ring->br_tail++;
+    ring->br_free++;
+
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void ring_on_accept(struct engine *self, int32_t res, uint32_t flags)
+{
+    if(res >= 0){
+
+        conn_open(self, res);
+    }
+    else{
+
+        ERROR("accept errno %d", -res)
+    }
+
+    /* multishot accept has stopped */
+    if((flags & IORING_CQE_F_MORE) == 0U){
+
+        ring_accept(self);
+    }
+}
+
+static void ring_on_recv(struct engine_conn *conn, int32_t res, uint32_t flags)
+{
+    struct engine *self = conn->engine;
+    struct engine_buf *buf;
+    uint16_t bid;
+
+    /* the last completion for this recv */
+    if((flags & IORING_CQE_F_MORE) == 0U){
+
+        conn->recv_armed = false;
+        conn->recv_cancel = false;
+        conn->inflight--;
+    }
+
+    if((flags & IORING_CQE_F_BUFFER) != 0U){
+
+        bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        buf = (struct engine_buf *)&self->recv[bid * self->buf_stride];
+
+        self->ring->br_free--;
+
+        buf->size = (res > 0) ? (size_t)res : 0U;
+        buf->pos = 0U;
+
+        /* completions which arrive before the cancel join the spill
+         * chain and the buffer stays out of the kernel's hands until
+         * it has been parsed */
+        if((res <= 0) || (conn->s < 0) || conn->closing || !conn_input(conn, buf)){
+
+            ring_put_recv(self, bid);
+        }
+    }
+    else if((conn->s < 0) || conn->closing){
+
+        /* nothing */
+    }
+    else if(res == 0){
+
+        wic_close_with_reason(&conn->inst, WIC_CLOSE_ABNORMAL_2, NULL, 0U);
+    }
+    /* out of provided buffers or cancelled, armed again below */
+    else if((res == -ENOBUFS) || (res == -ECANCELED)){
+
+        /* nothing */
+    }
+    else{
+
+        wic_close_with_reason(&conn->inst, WIC_CLOSE_ABNORMAL_2, NULL, 0U);
+    }
+
+    if((conn->s >= 0) && !conn->closing){
+
+        if(conn->spill != NULL){
+
+            if(conn->recv_armed && !conn->recv_cancel){
+
+                ring_cancel_recv(conn);
+            }
+        }
+        else if(conn->recv_armed){
+
+            /* still armed */
+        }
+        /* armed again once a buffer is given back */
+        else if((res == -ENOBUFS) && (self->ring->br_free == 0U)){
+
+            wait_add(conn, ENGINE_WAIT_IN);
+        }
+        else{
+
+            ring_recv(conn);
+        }
+    }
+
+    conn_check(conn);
+}
+
+static void ring_on_send(struct engine_conn *conn, int32_t res, uint32_t flags)
+{
+    struct engine *self = conn->engine;
+
+    conn->sending--;
+    conn->inflight--;
+
+    if((flags & IORING_CQE_F_NOTIF) != 0U){
+
+        /* the kernel is done with a zero copy buffer */
+    }
+    else{
+
+        /* the buffer is still in use until the notification */
+        if((flags & IORING_CQE_F_MORE) != 0U){
+
+            conn->sending++;
+            conn->inflight++;
+        }
+
+        if(res == -ECANCELED){
+
+            /* something earlier in the chain didn't complete */
+        }
+        else if(((res == -EINVAL) || (res == -EOPNOTSUPP)) && self->ring->fixed){
+
+            /* the chain is sent again without zero copy */
+            self->ring->fixed = false;
+        }
+        else if(res < 0){
+
+            conn->error = true;
+        }
+        else{
+
+            conn->sent += (size_t)res;
+        }
+    }
+
+    /* the chain is finished with so the buffers can go */
+    if(conn->sending == 0U){
+
+        if(conn->s < 0){
+
+            conn_drop_queue(conn);
+        }
+        else{
+
+            conn_sent(conn, conn->sent);
+            conn->sent = 0U;
+
+            conn_write(conn);
+            conn_drained(conn);
+            conn_check(conn);
+        }
+    }
+}
+
+#endif
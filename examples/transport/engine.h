@@ -0,0 +1,445 @@
+/* Copyright (c) 2020 Cameron Harper
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wic.h"
+#include "timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An edge-triggered epoll server which drives many server role wic_inst
+ * from one thread.
+ *
+ * Memory is given to engine_init() and divided into a connection pool
+ * (a wic_inst and rx buffer each), a pool of buffers input is read
+ * into and a pool of transmit buffers shared by all connections. With
+ * engine_arg.rx_count set the rx buffers are pooled as well and only
+ * lent to a connection while it is receiving a frame (see
+ * #wic_on_rx_buffer_fn), so that idle connections hold no receive
+ * memory. Sockets are non-blocking, output that can't be written
+ * straight away stays queued until EPOLLOUT.
+ *
+ * Input that back-pressure leaves unparsed stays in the buffer it was
+ * read into and the connection stops reading until engine_resume(), so
+ * it never needs more than one (with ENGINE_URING, no more than it had
+ * already received, see engine_arg.recv_count). A few transmit buffers are kept back
+ * for handshake responses and close frames (engine_arg.tx_reserve) so
+ * that connections which don't read their output can't starve the
+ * rest. A connection which finds a pool empty waits in line and is
+ * resumed once a buffer is returned (engine_arg.on_drain for transmit
+ * buffers).
+ *
+ * Handshake, keepalive, idle and close deadlines are kept on a timer
+ * wheel (see timer.h) which the application may also use. Activity only
+ * records a timestamp, a connection's timer works out what is due when
+ * it expires and is then started again for the next deadline.
+ *
+ * Frames from wic_frame_prepare() are queued by reference so sending
+ * one message to many connections costs a small pool element per
+ * connection rather than a copy (see engine_broadcast()).
+ *
+ * Built with ENGINE_URING defined the engine uses io_uring (Linux 6.0
+ * or later) instead of epoll: multishot accept, multishot recv into a
+ * ring of kernel provided buffers, and linked sends (zero copy from the
+ * transmit pool, which is registered with the kernel, when a buffer is
+ * large enough to be worth it). Many passes then need only the
+ * one io_uring_enter() that waits for the next completion.
+ *
+ * An engine is only used by the thread which runs it. To use more
+ * cores run one engine per thread, each with its own memory and
+ * engine_arg.reuse_port set.
+ *
+ * Linux only.
+ *
+ * */
+
+struct engine_buf;
+struct engine_ring;
+struct engine;
+struct engine_conn;
+
+typedef void (*engine_on_drain_fn)(struct wic_inst *inst);
+
+/* pools a connection can wait in line for */
+enum engine_wait_for {
+
+    ENGINE_WAIT_RX,     /* rx buffer */
+    ENGINE_WAIT_TX,     /* transmit buffer or frame reference */
+    ENGINE_WAIT_IN,     /* buffer to read into */
+    ENGINE_WAIT_MAX
+};
+
+struct engine_wait {
+
+    bool waiting;
+    struct engine_conn *prev;
+    struct engine_conn *next;
+};
+
+struct engine_conn {
+
+    int s;
+
+    struct engine *engine;
+
+    /* queued output (oldest first) */
+    struct engine_buf *head;
+    struct engine_buf *tail;
+    size_t queued;
+
+    /* input not yet parsed because of back-pressure (the buffer it
+     * was read into) */
+    struct engine_buf *spill;
+
+    /* close once queued output is written */
+    bool closing;
+
+    /* on_buffer or on_send_frame failed since the queue was last
+     * empty */
+    bool blocked;
+
+    /* failed write, close at the end of this pass */
+    bool error;
+
+    /* timestamps for the deadlines below */
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t last_rx;
+    uint64_t last_msg;
+    uint64_t ping_sent;
+
+    /* ping sent and nothing received since */
+    bool ping;
+
+    /* next deadline */
+    struct timer timer;
+
+    /* io_uring requests which haven't completed, the connection isn't
+     * reused until they have (0 with epoll) */
+    uint32_t inflight;
+
+    /* io_uring completions to come for sends from the head of the
+     * queue and the bytes they have written so far */
+    uint32_t sending;
+    size_t sent;
+
+    /* io_uring multishot recv is armed or being cancelled */
+    bool recv_armed;
+    bool recv_cancel;
+
+    /* place in line for each pool */
+    struct engine_wait wait[ENGINE_WAIT_MAX];
+
+    void *app;
+
+    /* free or pending release */
+    struct engine_conn *next;
+
+    struct wic_inst inst;
+};
+
+struct engine_arg {
+
+    /** TCP port to listen on */
+    uint16_t port;
+
+    /** **OPTIONAL** set SO_REUSEPORT so that one engine per thread can
+     * listen on the same port, the kernel then spreads new connections
+     * between them and each stays with the engine that accepted it */
+    bool reuse_port;
+
+    /** connections that can be open at once */
+    size_t max_conn;
+
+    /** size of wic_init_arg.rx for each connection */
+    size_t rx_max;
+
+    /** **OPTIONAL** rx buffers shared by all connections (0 means one
+     * per connection)
+     *
+     * A connection that finds the pool empty stops reading until a
+     * buffer is returned.
+     *
+     * */
+    size_t rx_count;
+
+    /** transmit buffers shared by all connections */
+    size_t tx_count;
+
+    /** size of each transmit buffer (also the most read at once) */
+    size_t tx_max;
+
+    /** **OPTIONAL** transmit buffers only given out for handshake
+     * responses and close frames, less than tx_count (0 means
+     * tx_count / 8) */
+    size_t tx_reserve;
+
+    /** **OPTIONAL** buffers of tx_max which input is read into, shared
+     * by all connections (0 means one per connection)
+     *
+     * A buffer is only held between reads while back-pressure leaves
+     * part of it unparsed. A connection that finds the pool empty stops
+     * reading until a buffer is returned. Not used with ENGINE_URING
+     * (see recv_count).
+     *
+     * */
+    size_t in_count;
+
+    /** **OPTIONAL** most transmit buffers one connection may have
+     * queued (0 means no limit) */
+    size_t tx_queue_max;
+
+    /** **OPTIONAL** references to frames from wic_frame_prepare() that
+     * can be queued at once across all connections (0 means tx_count) */
+    size_t ref_count;
+
+    /** **OPTIONAL** receive buffers of tx_max given to the kernel with
+     * ENGINE_URING, a power of 2 (0 means 256)
+     *
+     * Input that back-pressure leaves unparsed is kept in the buffers
+     * it was received into and the kernel gets them back once they
+     * have been parsed. Since a connection may already have received
+     * several by the time it holds back, allow for that. A connection
+     * whose receive finds none left waits until one is returned.
+     *
+     * */
+    size_t recv_count;
+
+    /** **OPTIONAL** milliseconds to complete the handshake (0 means no
+     * limit) */
+    uint32_t handshake_timeout;
+
+    /** **OPTIONAL** send a ping after this many milliseconds without
+     * input (0 means never) */
+    uint32_t ping_interval;
+
+    /** **OPTIONAL** milliseconds to wait for input after a ping before
+     * dropping the connection (0 means ping_interval) */
+    uint32_t pong_timeout;
+
+    /** **OPTIONAL** close connections which haven't received a message
+     * in this many milliseconds (0 means never) */
+    uint32_t idle_timeout;
+
+    /** **OPTIONAL** milliseconds for output to drain after closing
+     * before the connection is dropped (0 means no limit) */
+    uint32_t close_timeout;
+
+    /** **OPTIONAL** timer resolution in milliseconds (0 means 100) */
+    uint32_t timer_tick;
+
+    /** **OPTIONAL** clock for timers (defaults to CLOCK_MONOTONIC) */
+    timer_clock_fn clock;
+
+    /** given to wic_init() for every connection
+     *
+     * role, rx, rx_max and app are set by the engine. callbacks is
+     * copied once into engine.callbacks, where on_send, on_buffer,
+     * on_send_frame, on_rx_buffer, on_rx_release and
+     * on_close_transport are set by the engine and on_message is
+     * wrapped if idle_timeout is set.
+     *
+     * */
+    const struct wic_init_arg *wic;
+
+    /** **OPTIONAL** called once queued output has been written on a
+     * connection which got WIC_STATUS_WOULD_BLOCK */
+    engine_on_drain_fn on_drain;
+};
+
+struct engine {
+
+    struct engine_arg arg;
+
+    /* shared by every connection */
+    struct wic_callbacks callbacks;
+
+    int epoll;
+    int listener;
+
+    bool running;
+
+    struct engine_conn *conn;
+    uint8_t *rx;
+
+    /* buffers input is read into */
+    uint8_t *in;
+    struct engine_buf *free_in;
+
+    size_t buf_stride;
+    uint8_t *buf;
+
+    /* free transmit buffers and how many of them are kept back */
+    size_t free_count;
+    size_t tx_reserve;
+
+    /* references to shared frames */
+    uint8_t *ref;
+
+    /* io_uring state and provided receive buffers (ENGINE_URING) */
+    struct engine_ring *ring;
+    uint8_t *recv;
+
+    /* pooled rx buffers */
+    void *free_rx;
+
+    /* connections waiting in line for each pool */
+    struct engine_conn *wait_head[ENGINE_WAIT_MAX];
+    struct engine_conn *wait_tail[ENGINE_WAIT_MAX];
+    size_t wait_count[ENGINE_WAIT_MAX];
+
+    struct engine_conn *free_conn;
+    struct engine_conn *release;
+    struct engine_buf *free_buf;
+    struct engine_buf *free_ref;
+
+    size_t count;
+
+    struct timer_wheel timers;
+};
+
+/** Bytes of memory engine_init() needs for these arguments
+ *
+ * @param[in] arg
+ *
+ * @return bytes
+ *
+ * */
+size_t engine_mem_size(const struct engine_arg *arg);
+
+/** Listen and initialise pools
+ *
+ * @param[in] self
+ * @param[in] arg
+ * @param[in] mem       at least engine_mem_size() bytes
+ * @param[in] mem_max   size of mem
+ *
+ * @retval true     ready to run
+ * @retval false
+ *
+ * */
+bool engine_init(struct engine *self, const struct engine_arg *arg, void *mem, size_t mem_max);
+
+/** Serve connections until engine_stop()
+ *
+ * @param[in] self
+ *
+ * */
+void engine_run(struct engine *self);
+
+/** Make engine_run() return after the current pass
+ *
+ * May be called from any wic_inst callback.
+ *
+ * @param[in] self
+ *
+ * */
+void engine_stop(struct engine *self);
+
+/** Close all connections and the listener
+ *
+ * @param[in] self
+ *
+ * */
+void engine_deinit(struct engine *self);
+
+/** Continue reading after wic_on_message_fn returned false
+ *
+ * Must not be called from a wic_inst callback.
+ *
+ * @param[in] inst
+ *
+ * */
+void engine_resume(struct wic_inst *inst);
+
+/** Application pointer for a connection (NULL when accepted)
+ *
+ * @param[in] inst
+ *
+ * @return pointer
+ *
+ * */
+void *engine_get_app(struct wic_inst *inst);
+
+/** Set application pointer for a connection
+ *
+ * @param[in] inst
+ * @param[in] app
+ *
+ * */
+void engine_set_app(struct wic_inst *inst, void *app);
+
+/** Number of open connections
+ *
+ * @param[in] self
+ *
+ * @return count
+ *
+ * */
+size_t engine_count(const struct engine *self);
+
+/** Engine serving a connection
+ *
+ * @param[in] inst
+ *
+ * @return engine
+ *
+ * */
+struct engine *engine_get_engine(struct wic_inst *inst);
+
+/** Timer wheel driven by an engine
+ *
+ * Timers started on it expire from engine_run() on the engine's own
+ * thread.
+ *
+ * @param[in] self
+ *
+ * @return wheel
+ *
+ * */
+struct timer_wheel *engine_get_timers(struct engine *self);
+
+/** Send a frame from wic_frame_prepare() to every open connection
+ *
+ * Connections which are part way through sending another message, or
+ * which can't queue any more output, are skipped.
+ *
+ * @param[in] self
+ * @param[in] frame
+ *
+ * @return number of connections the frame was queued to
+ *
+ * */
+size_t engine_broadcast(struct engine *self, struct wic_frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+/* Copyright (c) 2020 Cameron Harper
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#include <string.h>
+
+#include "timer.h"
+
+#define LEVEL_SHIFT(L) ((L) * TIMER_SLOT_BITS)
+#define SLOT_MASK ((uint64_t)TIMER_SLOTS - 1U)
+#define WHEEL_SPAN ((uint64_t)1U << LEVEL_SHIFT(TIMER_LEVELS))
+
+static void place(struct timer_wheel *self, struct timer *timer);
+static void cascade(struct timer_wheel *self, size_t level, size_t index);
+
+static void list_init(struct timer_list *self);
+static bool list_empty(const struct timer_list *self);
+static void list_append(struct timer_list *self, struct timer_list *item);
+static void list_remove(struct timer_list *item);
+static void list_take(struct timer_list *self, struct timer_list *from);
+
+/* functions **********************************************************/
+
+void timer_wheel_init(struct timer_wheel *self, uint32_t tick, timer_clock_fn clock)
+{
+    size_t level;
+    size_t index;
+
+    (void)memset(self, 0, sizeof(*self));
+
+    for(level=0U; level < TIMER_LEVELS; level++){
+
+        for(index=0U; index < TIMER_SLOTS; index++){
+
+            list_init(&self->slot[level][index]);
+        }
+    }
+
+    self->clock = clock;
+    self->tick = (tick > 0U) ? tick : 1U;
+    self->now = clock();
+    self->current = self->now / self->tick;
+}
+
+void timer_wheel_run(struct timer_wheel *self)
+{
+    struct timer_list work;
+    struct timer *timer;
+    uint64_t target;
+    size_t level;
+    size_t index;
+
+    self->now = self->clock();
+
+    target = self->now / self->tick;
+
+    /* an empty wheel can skip ahead */
+    if((self->count == 0U) && (target >= self->current)){
+
+        self->current = target + 1U;
+    }
+
+    while(self->current <= target){
+
+        index = (size_t)(self->current & SLOT_MASK);
+
+        /* the first level has turned so bring the next turn down */
+        for(level=1U; (level < TIMER_LEVELS) && (index == 0U); level++){
+
+            index = (size_t)((self->current >> LEVEL_SHIFT(level)) & SLOT_MASK);
+
+            cascade(self, level, index);
+        }
+
+        list_take(&work, &self->slot[0U][self->current & SLOT_MASK]);
+
+        /* timers started from fn for this tick land in the next one */
+        self->current++;
+
+        while(!list_empty(&work)){
+
+            timer = (struct timer *)work.next;
+
+            list_remove(&timer->link);
+            timer->wheel = NULL;
+            self->count--;
+
+            timer->fn(timer);
+        }
+    }
+}
+
+uint64_t timer_wheel_time(const struct timer_wheel *self)
+{
+    return self->now;
+}
+
+uint32_t timer_wheel_next(const struct timer_wheel *self)
+{
+    uint32_t retval = TIMER_NONE;
+    uint64_t tick;
+    uint64_t at;
+
+    if(self->count > 0U){
+
+        tick = self->current;
+
+        /* stop at the first timer or where the next cascade happens */
+        while(((tick & SLOT_MASK) != 0U) && list_empty(&self->slot[0U][tick & SLOT_MASK])){
+
+            tick++;
+        }
+
+        at = tick * self->tick;
+
+        if(at <= self->now){
+
+            retval = 0U;
+        }
+        else if((at - self->now) >= TIMER_NONE){
+
+            retval = TIMER_NONE - 1U;
+        }
+        else{
+
+            retval = (uint32_t)(at - self->now);
+        }
+    }
+
+    return retval;
+}
+
+void timer_init(struct timer *self, timer_fn fn)
+{
+    (void)memset(self, 0, sizeof(*self));
+
+    self->fn = fn;
+}
+
+void timer_start(struct timer_wheel *wheel, struct timer *self, uint32_t timeout)
+{
+    timer_stop(self);
+
+    /* rounded up so that it never expires early */
+    self->expires = (wheel->now + timeout + wheel->tick - 1U) / wheel->tick;
+    self->wheel = wheel;
+
+    wheel->count++;
+
+    place(wheel, self);
+}
+
+void timer_stop(struct timer *self)
+{
+    if(self->wheel != NULL){
+
+        list_remove(&self->link);
+
+        self->wheel->count--;
+        self->wheel = NULL;
+    }
+}
+
+bool timer_pending(const struct timer *self)
+{
+    return (self->wheel != NULL);
+}
+
+/* static functions ***************************************************/
+
+static void place(struct timer_wheel *self, struct timer *timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    size_t level;
+
+    /* overdue timers expire on the next tick */
+    expires = (expires < self->current) ? self->current : expires;
+
+    delta = expires - self->current;
+
+    /* parked at the far edge and placed again when it comes round */
+    if(delta >= WHEEL_SPAN){
+
+        delta = WHEEL_SPAN - 1U;
+        expires = self->current + delta;
+    }
+
+    for(level=0U; (level < (TIMER_LEVELS - 1U)) && (delta >= ((uint64_t)1U << LEVEL_SHIFT(level + 1U))); level++){
+
+        /* find level */
+    }
+
+    list_append(&self->slot[level][(expires >> LEVEL_SHIFT(level)) & SLOT_MASK], &timer->link);
+}
+
+static void cascade(struct timer_wheel *self, size_t level, size_t index)
+{
+    struct timer_list work;
+    struct timer *timer;
+
+    list_take(&work, &self->slot[level][index]);
+
+    while(!list_empty(&work)){
+
+        timer = (struct timer *)work.next;
+
+        list_remove(&timer->link);
+
+        place(self, timer);
+    }
+}
+
+static void list_init(struct timer_list *self)
+{
+    self->next = self;
+    self->prev = self;
+}
+
+static bool list_empty(const struct timer_list *self)
+{
+    return (self->next == self);
+}
+
+static void list_append(struct timer_list *self, struct timer_list *item)
+{
+    item->next = self;
+    item->prev = self->prev;
+    self->prev->next = item;
+    self->prev = item;
+}
+
+static void list_remove(struct timer_list *item)
+{
+    item->prev->next = item->next;
+    item->next->prev = item->prev;
+    item->next = NULL;
+    item->prev = NULL;
+}
+
+/* move everything in from onto self (which needn't be initialised) */
+static void list_take(struct timer_list *self, struct timer_list *from)
+{
+    if(list_empty(from)){
+
+        list_init(self);
+    }
+    else{
+
+        self->next = from->next;
+        self->prev = from->prev;
+        self->next->prev = self;
+        self->prev->next = self;
+
+        list_init(from);
+    }
+}
@@ -0,0 +1,193 @@
+/* Copyright (c) 2020 Cameron Harper
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A hierarchical timer wheel.
+ *
+ * Timers are intrusive (embed struct timer in whatever it times) and
+ * starting or stopping one is O(1) regardless of how many are pending.
+ * The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots, a slot on the
+ * first level covers one tick and a slot on each level above covers a
+ * whole turn of the level below. Timers further out than the wheel can
+ * reach are parked in the top level and looked at again when their slot
+ * comes around.
+ *
+ * Time comes from a clock function so that it can be replaced (e.g. to
+ * simulate time). The clock is read once per timer_wheel_run() and
+ * timeouts are measured from that reading, so an event loop should call
+ * timer_wheel_run() as soon as it wakes.
+ *
+ * Nothing here is thread-safe.
+ *
+ * */
+
+#define TIMER_LEVELS 4U
+#define TIMER_SLOT_BITS 6U
+#define TIMER_SLOTS (1U << TIMER_SLOT_BITS)
+
+/* returned by timer_wheel_next() if no timers are pending */
+#define TIMER_NONE UINT32_MAX
+
+struct timer;
+struct timer_wheel;
+
+/** Milliseconds from any fixed point (must not go backwards)
+ *
+ * @return time
+ *
+ * */
+typedef uint64_t (*timer_clock_fn)(void);
+
+/** Timer has expired
+ *
+ * The timer is no longer pending and may be started again.
+ *
+ * @param[in] timer
+ *
+ * */
+typedef void (*timer_fn)(struct timer *timer);
+
+struct timer_list {
+
+    struct timer_list *next;
+    struct timer_list *prev;
+};
+
+struct timer {
+
+    /* must be first */
+    struct timer_list link;
+
+    struct timer_wheel *wheel;
+
+    /* tick */
+    uint64_t expires;
+
+    timer_fn fn;
+};
+
+struct timer_wheel {
+
+    timer_clock_fn clock;
+
+    /* milliseconds per tick */
+    uint32_t tick;
+
+    /* clock at the last run */
+    uint64_t now;
+
+    /* next tick to expire */
+    uint64_t current;
+
+    size_t count;
+
+    struct timer_list slot[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/** Initialise a wheel
+ *
+ * @param[in] self
+ * @param[in] tick      resolution in milliseconds (timers never expire early
+ *                      but may expire up to this much late)
+ * @param[in] clock     clock function
+ *
+ * */
+void timer_wheel_init(struct timer_wheel *self, uint32_t tick, timer_clock_fn clock);
+
+/** Read the clock and expire all timers which are due
+ *
+ * @param[in] self
+ *
+ * */
+void timer_wheel_run(struct timer_wheel *self);
+
+/** Clock reading taken by the last timer_wheel_run()
+ *
+ * @param[in] self
+ *
+ * @return milliseconds
+ *
+ * */
+uint64_t timer_wheel_time(const struct timer_wheel *self);
+
+/** Milliseconds until timer_wheel_run() may next have work to do
+ *
+ * This can be earlier than the next timer expires since timers further
+ * out are moved down the wheel first.
+ *
+ * @param[in] self
+ *
+ * @return milliseconds
+ *
+ * @retval TIMER_NONE no timers are pending
+ *
+ * */
+uint32_t timer_wheel_next(const struct timer_wheel *self);
+
+/** Initialise a timer
+ *
+ * @param[in] self
+ * @param[in] fn    called on expiry
+ *
+ * */
+void timer_init(struct timer *self, timer_fn fn);
+
+/** Start (or restart) a timer
+ *
+ * @param[in] wheel
+ * @param[in] self
+ * @param[in] timeout   milliseconds from the last timer_wheel_run()
+ *
+ * */
+void timer_start(struct timer_wheel *wheel, struct timer *self, uint32_t timeout);
+
+/** Stop a timer if it is pending
+ *
+ * @param[in] self
+ *
+ * */
+void timer_stop(struct timer *self);
+
+/** Is timer pending?
+ *
+ * @param[in] self
+ *
+ * @retval true
+ * @retval false
+ *
+ * */
+bool timer_pending(const struct timer *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,6 +19,8 @@
  *
  * */
 
+#include <stdbool.h>
+
 #ifdef WIN32
 
 #include <windows.h>
@@ -26,17 +28,24 @@
 #include <ws2tcpip.h>
 #pragma comment(lib, "ws2_32.lib")
 #define close closesocket
+#define poll WSAPoll
 #undef ssize_t
 #ifdef _WIN64
 typedef __int64 ssize_t;
 #else
 typedef int ssize_t;
 #endif
-void transport_init() {
+static void startup(void) {
     WORD wVersionRequested; WSADATA wsaData;
     wVersionRequested = MAKEWORD(2, 2);
     WSAStartup(wVersionRequested, &wsaData);
 }
+static bool set_nonblocking(int s) {
+    u_long mode = 1;
+    return (ioctlsocket(s, FIONBIO, &mode) == 0);
+}
+#define WOULD_BLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define INTERRUPTED() (WSAGetLastError() == WSAEINTR)
 
 #else
 
@@ -47,25 +56,118 @@ void transport_init() {
 #include <unistd.h>
 #include <netdb.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
 
-void transport_init() {}
+static void startup(void) {}
+static bool set_nonblocking(int s) {
+    int flags = fcntl(s, F_GETFL, 0);
+    return (flags >= 0) && (fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+#define WOULD_BLOCK() ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+#define INTERRUPTED() (errno == EINTR)
+
+#endif
 
+/* a peer that has gone away shouldn't raise SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#ifdef TRANSPORT_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #endif
 
 #include <string.h>
+#include <stdio.h>
+#include <limits.h>
 #include "transport.h"
 #include "log.h"
 
-bool transport_open_client(enum wic_schema schema, const char *host, uint16_t port, int *s)
+#define TRANSPORT_ALIGN(X) (((X) + 15U) & ~(size_t)15U)
+
+#ifndef TRANSPORT_SESSION_CACHE
+#define TRANSPORT_SESSION_CACHE 16U
+#endif
+
+struct transport_buf {
+
+    struct transport_buf *next;
+    size_t size;
+    size_t pos;
+    uint8_t data[];
+};
+
+static void put_buf(struct transport *self, struct transport_buf *buf);
+static bool flush(struct transport *self);
+static void drop_queue(struct transport *self);
+static bool wait_for(struct transport *self, short events, int timeout, short *revents);
+static ssize_t write_some(struct transport *self, const void *data, size_t size);
+static ssize_t read_some(struct transport *self, void *data, size_t size);
+static bool pending(const struct transport *self);
+static void parse(struct transport *self, struct wic_inst *inst);
+
+#ifdef TRANSPORT_TLS
+
+struct session {
+
+    char peer[TRANSPORT_PEER_MAX];
+    SSL_SESSION *session;
+    unsigned long used;
+};
+
+static SSL_CTX *tls_ctx;
+static struct session sessions[TRANSPORT_SESSION_CACHE];
+static unsigned long session_clock;
+
+static SSL_CTX *tls_context(void);
+static bool tls_open(struct transport *self, const char *host);
+static ssize_t tls_result(struct transport *self, int n);
+static struct session *session_find(const char *peer);
+static void session_forget(const char *peer);
+static int on_new_session(SSL *ssl, SSL_SESSION *session);
+
+#endif
+
+/* functions **********************************************************/
+
+size_t transport_mem_size(size_t tx_count, size_t tx_max)
 {
-    transport_init();
+    return tx_count * TRANSPORT_ALIGN(sizeof(struct transport_buf) + tx_max);
+}
+
+void transport_init(struct transport *self, void *rx, size_t rx_max, void *mem, size_t tx_count, size_t tx_max)
+{
+    size_t stride = TRANSPORT_ALIGN(sizeof(struct transport_buf) + tx_max);
+    size_t i;
+
+    (void)memset(self, 0, sizeof(*self));
+
+    self->s = -1;
+    self->rx = rx;
+    self->rx_max = rx_max;
+    self->tx_max = tx_max;
+
+    for(i=tx_count; i > 0U; i--){
+
+        put_buf(self, (struct transport_buf *)&((uint8_t *)mem)[(i-1U) * stride]);
+    }
+}
+
+bool transport_open_client(struct transport *self, enum wic_schema schema, const char *host, uint16_t port)
+{
+    startup();
 
     char pbuf[20];
     struct addrinfo *res;
     bool retval = false;
     const char *service = NULL;
+    bool tls = false;
     int tmp;
+    int s;
 
     (void)memset(pbuf, 0, sizeof(pbuf));
 
@@ -73,13 +175,22 @@ bool transport_open_client(enum wic_schema schema, const char *host, uint16_t po
     case WIC_SCHEMA_HTTPS:
     case WIC_SCHEMA_WSS:
 
-        ERROR("not supporting https or wss schemas at the moment")
+#ifdef TRANSPORT_TLS
+        tls = true;
+        break;
+#else
+        ERROR("https and wss need a transport built with TRANSPORT_TLS")
         return false;
+#endif
 
     default:
         break;
     }
 
+    /* anything queued belonged to the last connection */
+    drop_queue(self);
+    self->error = false;
+
     if(port != 0){
     
         (void)snprintf(pbuf, sizeof(pbuf), "%u", port);
@@ -87,9 +198,11 @@ bool transport_open_client(enum wic_schema schema, const char *host, uint16_t po
     }
     else{
 
-        service = "80";
+        service = tls ? "443" : "80";
     }
 
+    (void)snprintf(self->peer, sizeof(self->peer), "%s:%s", host, service);
+
     tmp = getaddrinfo(host, service, NULL, &res);
 
     if(tmp != 0){
@@ -99,12 +212,12 @@ bool transport_open_client(enum wic_schema schema, const char *host, uint16_t po
     else{
 
 #ifdef __APPLE__
-        *s = socket(res->ai_family, /*res->ai_socktype*/SOCK_STREAM, /*res->ai_protocol*/IPPROTO_TCP); // was datagram/udp on macos
+        s = socket(res->ai_family, /*res->ai_socktype*/SOCK_STREAM, /*res->ai_protocol*/IPPROTO_TCP); // was datagram/udp on macos
 #else
-        *s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 #endif
 
-        if(*s < 0){
+        if(s < 0){
 
             ERROR("socket() errno %d", errno);
         }
@@ -113,18 +226,35 @@ bool transport_open_client(enum wic_schema schema, const char *host, uint16_t po
 #if 0
             {
                 int val = 1;
-                (void)setsockopt(*s, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+                (void)setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
             }
 #endif            
 
-            if(connect(*s, res->ai_addr, res->ai_addrlen) < 0){
+            if(connect(s, res->ai_addr, res->ai_addrlen) < 0){
 
                 ERROR("connect() errno %d", errno)
-                close(*s);
+                close(s);
             }
             else{
 
+                self->s = s;
                 retval = true;
+
+#ifdef TRANSPORT_TLS
+                /* handshake while the socket still blocks */
+                retval = !tls || tls_open(self, host);
+#endif
+
+                if(retval && !set_nonblocking(s)){
+
+                    ERROR("could not make socket non-blocking")
+                    retval = false;
+                }
+
+                if(!retval){
+
+                    transport_close(self);
+                }
             }
         }
 
@@ -134,55 +264,576 @@ bool transport_open_client(enum wic_schema schema, const char *host, uint16_t po
     return retval;
 }
 
-void transport_write(int s, const void *data, size_t size)
+bool transport_resumed(const struct transport *self)
 {
-    const uint8_t *ptr = (const uint8_t *)data;
-    size_t pos;
-    int retval;
-    
-    for(pos=0U; pos < size; pos += retval){
-
-#ifdef WIN32
-        retval = send(s, &ptr[pos], size - pos, 0);
+#ifdef TRANSPORT_TLS
+    return (self->ssl != NULL) && (SSL_session_reused(self->ssl) == 1);
 #else
-        retval = write(s, &ptr[pos], size - pos);
+    (void)self;
+    return false;
 #endif
-        
-        if(retval <= 0){
+}
+
+bool transport_poll(struct transport *self, struct wic_inst *inst, int timeout)
+{
+    short events = 0;
+    short revents;
+
+    if(self->s >= 0){
+
+        /* input held back by back-pressure is offered again first */
+        parse(self, inst);
+
+        if(self->rx_size < self->rx_max){
+
+            events |= POLLIN;
+        }
+
+        if(self->head != NULL){
+
+            events |= POLLOUT;
+        }
+
+        /* parse() may have closed the socket, and a full ring with
+         * nothing queued has nothing to wait for (input is offered again
+         * by the next call) */
+        if(self->s < 0){
+
+            /* nothing */
+        }
+        /* input which OpenSSL has already decrypted won't wake poll() */
+        else if((events != 0) && (wait_for(self, events, pending(self) ? 0 : timeout, &revents) || pending(self))){
+
+            if((revents & (POLLOUT | POLLERR | POLLHUP)) != 0){
+
+                (void)flush(self);
+            }
+
+            if(!self->error && (((revents & (POLLIN | POLLERR | POLLHUP)) != 0) || pending(self))){
+
+                (void)transport_recv(self, inst);
+            }
+        }
+
+        /* a write error can't be handled from inside on_send */
+        if(self->error && (self->s >= 0)){
+
+            wic_close_with_reason(inst, WIC_CLOSE_ABNORMAL_2, NULL, 0);
+            transport_close(self);
+        }
+    }
+
+    return (self->s >= 0);
+}
+
+bool transport_drain(struct transport *self, int timeout)
+{
+    short revents;
+
+    while((self->s >= 0) && !self->error && (self->free == NULL)){
+
+        if(!wait_for(self, POLLOUT, timeout, &revents)){
 
             break;
         }
+
+        (void)flush(self);
     }
+
+    return (self->free != NULL) && !self->error;
 }
 
-bool transport_recv(int s, struct wic_inst *inst)
+bool transport_recv(struct transport *self, struct wic_inst *inst)
 {
-    static uint8_t buffer[1000U];
     ssize_t bytes;
-    size_t retval, pos;
+    size_t end;
+
+    do{
+
+        parse(self, inst);
+
+        bytes = 0;
+
+        /* read into the free space after the input, up to the end of the ring */
+        if((self->s >= 0) && (self->rx_size < self->rx_max)){
+
+            end = self->rx_pos + self->rx_size;
 
-    bytes = recv(s, buffer, sizeof(buffer), 0);
+            if(end < self->rx_max){
 
-    if(bytes > 0){
+                bytes = read_some(self, &self->rx[end], self->rx_max - end);
+            }
+            else{
+
+                bytes = read_some(self, &self->rx[end - self->rx_max], self->rx_max - self->rx_size);
+            }
+
+            if(bytes > 0){
 
-        for(pos=0U; pos < bytes; pos += retval){
-        
-            retval = wic_parse(inst, &buffer[pos], bytes - pos);
+                self->rx_size += (size_t)bytes;
+            }
+            else if(bytes < 0){
+
+                wic_close_with_reason(inst, WIC_CLOSE_ABNORMAL_2, NULL, 0);
+            }
+            else{
+
+                /* nothing to read */
+            }
         }
     }
-    
-    if(bytes <= 0){
+    while(bytes > 0);
+
+    return (self->s >= 0);
+}
+
+void *transport_buffer(struct transport *self, size_t min_size, size_t *max_size)
+{
+    struct transport_buf *buf = NULL;
+
+    *max_size = self->tx_max;
+
+    /* wic_inst reports WIC_STATUS_TOO_LARGE if min_size > tx_max and
+     * WIC_STATUS_WOULD_BLOCK if there is no buffer */
+    if((min_size <= self->tx_max) && (self->free != NULL)){
+
+        buf = self->free;
+        self->free = buf->next;
+        buf->next = NULL;
+    }
+
+    return (buf != NULL) ? buf->data : NULL;
+}
+
+void transport_send(struct transport *self, const void *data, size_t size)
+{
+    struct transport_buf *buf = (struct transport_buf *)((uint8_t *)data - offsetof(struct transport_buf, data));
+
+    if((size == 0U) || self->error || (self->s < 0)){
+
+        put_buf(self, buf);
+    }
+    else{
+
+        buf->size = size;
+        buf->pos = 0U;
+        buf->next = NULL;
+
+        if(self->tail != NULL){
+
+            self->tail->next = buf;
+        }
+        else{
+
+            self->head = buf;
+        }
+
+        self->tail = buf;
+        self->queued++;
+
+        /* nothing else is queued so it can go straight out */
+        if(self->head == buf){
+
+            (void)flush(self);
+        }
+    }
+}
+
+size_t transport_queued(const struct transport *self)
+{
+    return self->queued;
+}
+
+void transport_close(struct transport *self)
+{
+    if(self->s >= 0){
+
+        (void)flush(self);
+
+#ifdef TRANSPORT_TLS
+        if(self->ssl != NULL){
+
+            /* close_notify is best effort on a non-blocking socket */
+            if(!self->error){
+
+                (void)SSL_shutdown(self->ssl);
+            }
+
+            SSL_free(self->ssl);
+            self->ssl = NULL;
+        }
+#endif
+
+        close(self->s);
+        self->s = -1;
+
+        drop_queue(self);
+
+        /* unparsed input belonged to this connection */
+        self->rx_pos = 0U;
+        self->rx_size = 0U;
+    }
+}
+
+/* static functions ***************************************************/
+
+static void put_buf(struct transport *self, struct transport_buf *buf)
+{
+    buf->next = self->free;
+    self->free = buf;
+}
+
+/* write until the queue is empty or the socket would block */
+static bool flush(struct transport *self)
+{
+    struct transport_buf *buf;
+    ssize_t n;
+
+    while((self->head != NULL) && !self->error){
+
+        buf = self->head;
+
+        n = write_some(self, &buf->data[buf->pos], buf->size - buf->pos);
+
+        if(n > 0){
+
+            buf->pos += (size_t)n;
+
+            if(buf->pos == buf->size){
+
+                self->head = buf->next;
+
+                if(self->head == NULL){
+
+                    self->tail = NULL;
+                }
+
+                self->queued--;
+                put_buf(self, buf);
+            }
+        }
+        else if(n == 0){
+
+            break;
+        }
+        else{
 
-        wic_close_with_reason(inst, WIC_CLOSE_ABNORMAL_2, NULL, 0);
+            self->error = true;
+            drop_queue(self);
+        }
+    }
+
+    return !self->error;
+}
+
+static void drop_queue(struct transport *self)
+{
+    struct transport_buf *buf;
+
+    while(self->head != NULL){
+
+        buf = self->head;
+        self->head = buf->next;
+        put_buf(self, buf);
+    }
+
+    self->tail = NULL;
+    self->queued = 0U;
+}
+
+static bool wait_for(struct transport *self, short events, int timeout, short *revents)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = self->s;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    do{
+
+        n = poll(&pfd, 1, timeout);
+    }
+    while((n < 0) && INTERRUPTED());
+
+    *revents = pfd.revents;
+
+    return (n > 0);
+}
+
+/* bytes written, 0 if the socket would block, -1 on error */
+static ssize_t write_some(struct transport *self, const void *data, size_t size)
+{
+    ssize_t retval;
+
+#ifdef TRANSPORT_TLS
+    if(self->ssl != NULL){
+
+        return tls_result(self, SSL_write(self->ssl, data, (size > (size_t)INT_MAX) ? INT_MAX : (int)size));
+    }
+#endif
+
+    do{
+
+        retval = send(self->s, (const char *)data, size, SEND_FLAGS);
+    }
+    while((retval < 0) && INTERRUPTED());
+
+    if((retval < 0) && WOULD_BLOCK()){
+
+        retval = 0;
+    }
+
+    return retval;
+}
+
+/* bytes read, 0 if there is nothing to read, -1 on error or end of stream */
+static ssize_t read_some(struct transport *self, void *data, size_t size)
+{
+    ssize_t retval;
+
+#ifdef TRANSPORT_TLS
+    if(self->ssl != NULL){
+
+        return tls_result(self, SSL_read(self->ssl, data, (size > (size_t)INT_MAX) ? INT_MAX : (int)size));
+    }
+#endif
+
+    retval = recv(self->s, (char *)data, size, 0);
+
+    if(retval > 0){
+
+        /* data */
+    }
+    else if((retval < 0) && (WOULD_BLOCK() || INTERRUPTED())){
+
+        retval = 0;
+    }
+    else{
+
+        retval = -1;
+    }
+
+    return retval;
+}
+
+/* decrypted input that there is room to read */
+static bool pending(const struct transport *self)
+{
+#ifdef TRANSPORT_TLS
+    return (self->ssl != NULL) && (self->rx_size < self->rx_max) && (SSL_pending(self->ssl) > 0);
+#else
+    (void)self;
+    return false;
+#endif
+}
+
+/* parse from the receive ring until it is empty or back-pressure stops it */
+static void parse(struct transport *self, struct wic_inst *inst)
+{
+    size_t size;
+    size_t n;
+
+    /* a message held back by wic_inst is offered again even when there
+     * is no new input (not while parsing the handshake, where no input
+     * means the end of it) */
+    if((self->s >= 0) && (self->rx_size == 0U) && (wic_get_state(inst) == WIC_STATE_OPEN)){
+
+        (void)wic_parse(inst, self->rx, 0U);
+    }
+
+    while((self->s >= 0) && (self->rx_size > 0U)){
+
+        /* as far as the end of the ring */
+        size = self->rx_max - self->rx_pos;
+        size = (size < self->rx_size) ? size : self->rx_size;
+
+        n = wic_parse(inst, &self->rx[self->rx_pos], size);
+
+        /* back-pressure, or closed (which empties the ring) */
+        if((n == 0U) || (self->s < 0)){
+
+            break;
+        }
+
+        self->rx_pos += n;
+        self->rx_size -= n;
+
+        if((self->rx_pos == self->rx_max) || (self->rx_size == 0U)){
+
+            self->rx_pos = 0U;
+        }
+    }
+}
+
+#ifdef TRANSPORT_TLS
+
+static SSL_CTX *tls_context(void)
+{
+    if(tls_ctx == NULL){
+
+        tls_ctx = SSL_CTX_new(TLS_client_method());
+
+        if(tls_ctx != NULL){
+
+            (void)SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+            (void)SSL_CTX_set_default_verify_paths(tls_ctx);
+            SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+
+            /* writes are retried from the same queued buffer */
+            (void)SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+            /* sessions are kept by peer in the cache here rather than by
+             * OpenSSL (which looks them up by session ID as a server) */
+            (void)SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(tls_ctx, on_new_session);
+        }
     }
 
-    return (bytes > 0);
+    return tls_ctx;
 }
 
-void transport_close(int *s)
+static bool tls_open(struct transport *self, const char *host)
 {
-    if(*s > 0){
-        close(*s);        
-        *s = -1;
+    SSL_CTX *ctx = tls_context();
+    struct session *cached;
+    bool retval = false;
+
+    if(ctx == NULL){
+
+        ERROR("SSL_CTX_new() failed")
     }
+    else{
+
+        self->ssl = SSL_new(ctx);
+
+        if(self->ssl == NULL){
+
+            ERROR("SSL_new() failed")
+        }
+        else{
+
+            (void)SSL_set_app_data(self->ssl, self);
+            (void)SSL_set_fd(self->ssl, self->s);
+            (void)SSL_set_tlsext_host_name(self->ssl, host);
+            (void)SSL_set1_host(self->ssl, host);
+
+            cached = session_find(self->peer);
+
+            if(cached != NULL){
+
+                (void)SSL_set_session(self->ssl, cached->session);
+            }
+
+            if(SSL_connect(self->ssl) != 1){
+
+                ERROR("SSL_connect() %s", ERR_reason_error_string(ERR_get_error()))
+
+                /* don't offer it again */
+                session_forget(self->peer);
+
+                SSL_free(self->ssl);
+                self->ssl = NULL;
+            }
+            else{
+
+                retval = true;
+            }
+        }
+    }
+
+    return retval;
 }
+
+/* map an SSL_read() or SSL_write() result to read_some() and write_some() */
+static ssize_t tls_result(struct transport *self, int n)
+{
+    ssize_t retval = -1;
+
+    if(n > 0){
+
+        retval = n;
+    }
+    else{
+
+        switch(SSL_get_error(self->ssl, n)){
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            retval = 0;
+            break;
+        default:
+            ERR_clear_error();
+            break;
+        }
+    }
+
+    return retval;
+}
+
+static struct session *session_find(const char *peer)
+{
+    struct session *retval = NULL;
+    size_t i;
+
+    for(i=0U; i < TRANSPORT_SESSION_CACHE; i++){
+
+        if((sessions[i].session != NULL) && (strcmp(sessions[i].peer, peer) == 0)){
+
+            retval = &sessions[i];
+            retval->used = ++session_clock;
+            break;
+        }
+    }
+
+    return retval;
+}
+
+static void session_forget(const char *peer)
+{
+    struct session *entry = session_find(peer);
+
+    if(entry != NULL){
+
+        SSL_SESSION_free(entry->session);
+        entry->session = NULL;
+        entry->used = 0U;
+    }
+}
+
+/* keep the newest session for each peer, TLS1.3 tickets can arrive at
+ * any time after the handshake */
+static int on_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    struct transport *self = SSL_get_app_data(ssl);
+    struct session *entry = session_find(self->peer);
+    size_t i;
+
+    if(entry == NULL){
+
+        /* the least recently used peer makes way */
+        entry = &sessions[0];
+
+        for(i=1U; i < TRANSPORT_SESSION_CACHE; i++){
+
+            if(sessions[i].used < entry->used){
+
+                entry = &sessions[i];
+            }
+        }
+
+        (void)memcpy(entry->peer, self->peer, sizeof(entry->peer));
+    }
+
+    if(entry->session != NULL){
+
+        SSL_SESSION_free(entry->session);
+    }
+
+    entry->session = session;
+    entry->used = ++session_clock;
+
+    /* the cache keeps the reference */
+    return 1;
+}
+
+#endif
@@ -31,10 +31,205 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-bool transport_open_client(enum wic_schema schema, const char *host, uint16_t port, int *s);
-bool transport_recv(int s, struct wic_inst *inst);
-void transport_write(int s, const void *data, size_t size);
-void transport_close(int *s);
+
+/* A client transport for one wic_inst which never blocks on a write.
+ *
+ * The socket is made non-blocking once it is connected. Output is
+ * written straight away if nothing is queued ahead of it, otherwise it
+ * stays queued in the buffer wic_inst wrote it into until the socket is
+ * writable again. Buffers come from a pool given to transport_init(),
+ * if they run out transport_buffer() returns NULL and wic_inst reports
+ * WIC_STATUS_WOULD_BLOCK.
+ *
+ * Input is read into a receive ring given to transport_init() and
+ * parsed from there. When wic_inst applies back-pressure the rest of
+ * the input stays in the ring and is offered again by the next
+ * transport_poll(), nothing more is read while the ring is full.
+ *
+ * Call transport_buffer() from wic_on_buffer_fn, transport_send() from
+ * wic_on_send_fn and transport_close() from wic_on_close_transport_fn.
+ *
+ * Built with TRANSPORT_TLS (and linked with OpenSSL) the wss and https
+ * schemas are supported. The last session (or ticket) from each
+ * host:port is cached so that reconnecting resumes it rather than
+ * repeating the full handshake. The cache holds TRANSPORT_SESSION_CACHE
+ * peers, is shared by every transport in the process and is not thread
+ * safe. OpenSSL writes to the socket without MSG_NOSIGNAL so SIGPIPE
+ * should be ignored.
+ *
+ * */
+
+/* "host:port" */
+#define TRANSPORT_PEER_MAX 262U
+
+struct transport_buf;
+struct ssl_st;
+
+struct transport {
+
+    int s;
+
+    /* TLS connection (TRANSPORT_TLS) */
+    struct ssl_st *ssl;
+
+    /* session cache key */
+    char peer[TRANSPORT_PEER_MAX];
+
+    /* receive ring, unparsed input is rx_size bytes from rx_pos */
+    uint8_t *rx;
+    size_t rx_max;
+    size_t rx_pos;
+    size_t rx_size;
+
+    /* queued output (oldest first) */
+    struct transport_buf *head;
+    struct transport_buf *tail;
+    size_t queued;
+
+    struct transport_buf *free;
+
+    /* size of each buffer */
+    size_t tx_max;
+
+    /* failed write, wic_inst is closed by the next transport_poll() */
+    bool error;
+};
+
+/** Bytes of memory transport_init() needs
+ *
+ * @param[in] tx_count  number of transmit buffers
+ * @param[in] tx_max    size of each transmit buffer
+ *
+ * @return bytes
+ *
+ * */
+size_t transport_mem_size(size_t tx_count, size_t tx_max);
+
+/** Initialise a transport
+ *
+ * A larger receive ring means fewer, larger reads.
+ *
+ * @param[in] self
+ * @param[in] rx        receive ring
+ * @param[in] rx_max    size of receive ring
+ * @param[in] mem       transport_mem_size() bytes
+ * @param[in] tx_count  number of transmit buffers
+ * @param[in] tx_max    size of each transmit buffer
+ *
+ * */
+void transport_init(struct transport *self, void *rx, size_t rx_max, void *mem, size_t tx_count, size_t tx_max);
+
+/** Connect to a server
+ *
+ * Connecting (and the TLS handshake) blocks, the socket is non-blocking
+ * afterwards.
+ *
+ * @param[in] self
+ * @param[in] schema
+ * @param[in] host
+ * @param[in] port      0 for the schema default
+ *
+ * @retval true     connected
+ * @retval false
+ *
+ * */
+bool transport_open_client(struct transport *self, enum wic_schema schema, const char *host, uint16_t port);
+
+/** Was the last TLS session resumed
+ *
+ * @param[in] self
+ *
+ * @retval true     resumed from the session cache
+ * @retval false    full handshake or not TLS
+ *
+ * */
+bool transport_resumed(const struct transport *self);
+
+/** Wait for the socket then write queued output and parse input
+ *
+ * Returns without waiting if back-pressure has filled the receive ring
+ * and no output is queued, so that the held input is offered again by
+ * the next call.
+ *
+ * @param[in] self
+ * @param[in] inst
+ * @param[in] timeout   milliseconds (-1 to wait forever)
+ *
+ * @retval true     still connected
+ * @retval false    closed
+ *
+ * */
+bool transport_poll(struct transport *self, struct wic_inst *inst, int timeout);
+
+/** Wait until a transmit buffer is free
+ *
+ * For use from a wic_inst callback which got WIC_STATUS_WOULD_BLOCK and
+ * has nothing better to do than wait.
+ *
+ * @param[in] self
+ * @param[in] timeout   milliseconds (-1 to wait forever)
+ *
+ * @retval true     a buffer is free
+ * @retval false    timeout or error
+ *
+ * */
+bool transport_drain(struct transport *self, int timeout);
+
+/** Parse input left in the receive ring, then read and parse until the
+ * socket has nothing more or back-pressure fills the ring
+ *
+ * @param[in] self
+ * @param[in] inst
+ *
+ * @retval true     still connected
+ * @retval false    closed
+ *
+ * */
+bool transport_recv(struct transport *self, struct wic_inst *inst);
+
+/** Get a transmit buffer (for wic_on_buffer_fn)
+ *
+ * @param[in] self
+ * @param[in] min_size
+ * @param[out] max_size
+ *
+ * @return buffer
+ *
+ * @retval NULL no buffer free
+ *
+ * */
+void *transport_buffer(struct transport *self, size_t min_size, size_t *max_size);
+
+/** Queue a buffer from transport_buffer() (for wic_on_send_fn)
+ *
+ * A size of zero returns the buffer without writing it.
+ *
+ * @param[in] self
+ * @param[in] data
+ * @param[in] size
+ *
+ * */
+void transport_send(struct transport *self, const void *data, size_t size);
+
+/** Number of buffers queued for writing
+ *
+ * @param[in] self
+ *
+ * @return count
+ *
+ * */
+size_t transport_queued(const struct transport *self);
+
+/** Close the socket
+ *
+ * Queued output is written if the socket will take it without blocking,
+ * anything left over is discarded.
+ *
+ * @param[in] self
+ *
+ * */
+void transport_close(struct transport *self);
+
 #ifdef __cplusplus
 }
 #endif
@@ -100,10 +100,43 @@ extern "C" {
 #endif
 
 #ifndef WIC_HOSTNAME_MAXLEN
-/** redefine size of #wic_inst hostname buffer */
+/** redefine size of #wic_handshake hostname buffer */
 #   define WIC_HOSTNAME_MAXLEN 256U
 #endif
 
+#ifndef WIC_HEADER_INDEX_SIZE
+/** redefine number of slots in the #wic_handshake header index
+ * (must be a power of 2)
+ *
+ * wic_get_header() falls back to a linear search if the handshake has
+ * more header fields than fit in the index.
+ *
+ * */
+#   define WIC_HEADER_INDEX_SIZE 16U
+#endif
+
+/** bytes of wic_init_arg.pmd needed for permessage-deflate
+ *
+ * @param[in] RX_BITS   wic_init_arg.pmd_rx_window_bits (8..15)
+ * @param[in] TX_BITS   wic_init_arg.pmd_tx_window_bits (8..15)
+ *
+ * e.g. WIC_PMD_SIZE(15U, 15U) is 272KB and WIC_PMD_SIZE(10U, 10U)
+ * is 24KB
+ *
+ * */
+#define WIC_PMD_SIZE(RX_BITS, TX_BITS) (16384UL + (1UL << (RX_BITS)) + (7UL << (TX_BITS)))
+
+/** bytes at the end of wic_init_arg.rx taken by handshake state
+ *
+ * This applies unless wic_init_arg.handshake or wic_init_arg.rx_header
+ * is set. wic_init() fails if wic_init_arg.rx_max is smaller than this,
+ * and the received handshake fields only have what is left over, so
+ * wic_init_arg.rx_max should be this plus the largest handshake
+ * expected.
+ *
+ * */
+#define WIC_RX_HANDSHAKE_SIZE (sizeof(struct wic_handshake) + sizeof(uint64_t))
+
 /* the following reasons will be sent over the wire */
 
 /** the purpose for which the connection was established has been fulfilled */
@@ -147,6 +180,54 @@ extern "C" {
 #define WIC_CLOSE_TLS               1015U
 
 struct wic_inst;
+struct wic_handshake;
+struct wic_fast_mask;
+struct wic_cork;
+struct wic_reserve;
+struct wic_ext_state;
+struct wic_inflate;
+struct wic_deflate;
+
+/** Scatter-gather element passed to wic_on_sendv_fn */
+struct wic_iovec {
+
+    const void *data;
+    size_t size;
+};
+
+struct wic_frame;
+
+/** Called by wic_frame_unref() when the last reference is dropped
+ *
+ * @param[in] frame
+ *
+ * */
+typedef void (*wic_frame_release_fn)(struct wic_frame *frame);
+
+/** A complete unmasked message encoded once by wic_frame_prepare() so
+ * that it can be sent to many server role instances
+ *
+ * The reference count is not atomic so a frame must only be shared
+ * between instances served by the same thread.
+ *
+ * */
+struct wic_frame {
+
+    /** references held (wic_frame_prepare() sets 1) */
+    size_t refs;
+
+    /** **OPTIONAL** called when refs reaches zero */
+    wic_frame_release_fn release;
+
+    /** **OPTIONAL** application specific data */
+    void *app;
+
+    /** encoded frame (header then payload) */
+    const uint8_t *data;
+
+    /** size of data */
+    size_t size;
+};
 
 /** this enum is used to communicate the purpose of the buffer
  *
@@ -201,8 +282,13 @@ enum wic_handshake_failure {
  * become full. In this situation wic should block (i.e. stop parsing
  * new input data) to ensure that messages are not dropped.
  *
+ * data is never NULL, even if size is zero, and is only valid for the
+ * duration of this call. If
+ * wic_init_arg.rx_direct is set it may point into the buffer that was
+ * passed to wic_parse().
+ *
  * */
-typedef bool (*wic_on_message_fn)(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
+typedef bool (*wic_on_message_fn)(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, size_t size);
 
 /** Websocket open event
  *
@@ -210,8 +296,11 @@ typedef bool (*wic_on_message_fn)(struct wic_inst *inst, enum wic_encoding encod
  * return WIC_STATE_READY. This means, among other things, that
  * handshake fields from the peer are accessible.
  *
- * If inst is a server, this handler must call wic_start()
+ * If inst is a server, this handler should call wic_start()
  * in order to send the handshake response and open the websocket.
+ * A server that doesn't (or can't yet) stays in WIC_STATE_READY until
+ * wic_start() succeeds. It may also call wic_close() to refuse the
+ * connection.
  *
  * @param[in] inst
  *
@@ -261,6 +350,41 @@ typedef void (*wic_on_close_transport_fn)(struct wic_inst *inst);
  * */
 typedef void (*wic_on_send_fn)(struct wic_inst *inst, const void *data, size_t size, enum wic_buffer type);
 
+/** Write a frame to transport from several pieces of memory
+ *
+ * Called instead of wic_on_buffer_fn and wic_on_send_fn to send unmasked
+ * WIC_BUFFER_USER frames when wic_callbacks.on_sendv is set. The first
+ * element is always the frame header, the second (if present) is the
+ * payload passed to wic_send().
+ *
+ * Memory referenced by iov is only valid for the duration of this call.
+ *
+ * @param[in] inst
+ * @param[in] iov
+ * @param[in] count number of elements in iov
+ * @param[in] type  may be used for prioritisation
+ *
+ * @retval true     frame accepted by transport
+ * @retval false    frame not accepted (WIC_STATUS_WOULD_BLOCK)
+ *
+ * */
+typedef bool (*wic_on_sendv_fn)(struct wic_inst *inst, const struct wic_iovec *iov, size_t count, enum wic_buffer type);
+
+/** Queue a frame prepared by wic_frame_prepare() without copying it
+ *
+ * Called by wic_send_frame() when wic_callbacks.on_send_frame is set.
+ * Use wic_frame_ref() to keep the frame beyond this call and
+ * wic_frame_unref() once it has been written (or dropped).
+ *
+ * @param[in] inst
+ * @param[in] frame
+ *
+ * @retval true     frame accepted by transport
+ * @retval false    frame not accepted (WIC_STATUS_WOULD_BLOCK)
+ *
+ * */
+typedef bool (*wic_on_send_frame_fn)(struct wic_inst *inst, struct wic_frame *frame);
+
 /** Get a buffer of a minimum size for transporting a particular
  * frame type.
  *
@@ -284,6 +408,31 @@ typedef void (*wic_on_send_fn)(struct wic_inst *inst, const void *data, size_t s
  * */
 typedef void *(*wic_on_buffer_fn)(struct wic_inst *inst, size_t min_size, enum wic_buffer type, size_t *max_size);
 
+/** Borrow wic_init_arg.rx_max bytes for receiving
+ *
+ * Called when wic_callbacks.on_rx_buffer is set and a frame payload (or
+ * the handshake) needs to be stored. The buffer is returned through
+ * #wic_on_rx_release_fn once its contents have been delivered, so an
+ * idle instance holds no receive memory.
+ *
+ * @param[in] inst
+ *
+ * @return pointer to wic_init_arg.rx_max bytes
+ *
+ * @retval NULL     none available, wic_parse() stops consuming input
+ *                  until it is called again
+ *
+ * */
+typedef void *(*wic_on_rx_buffer_fn)(struct wic_inst *inst);
+
+/** Return a buffer from #wic_on_rx_buffer_fn
+ *
+ * @param[in] inst
+ * @param[in] buf
+ *
+ * */
+typedef void (*wic_on_rx_release_fn)(struct wic_inst *inst, void *buf);
+
 /** Called to get a 32bit random number
  *
  * @param[in] inst
@@ -306,6 +455,185 @@ typedef void (*wic_on_ping_fn)(struct wic_inst *inst);
  * */
 typedef void (*wic_on_pong_fn)(struct wic_inst *inst);
 
+/** RSV bits (as found in the first byte of a frame) an extension may claim */
+#define WIC_RSV1 0x40U
+#define WIC_RSV2 0x20U
+#define WIC_RSV3 0x10U
+
+/** result of giving input to an extension transform */
+enum wic_ext_status {
+
+    WIC_EXT_OK,     /**< all input taken */
+    WIC_EXT_FULL,   /**< output must be taken before going further */
+    WIC_EXT_ERROR   /**< input cannot be transformed */
+};
+
+/** Write extension parameters for the handshake offer
+ *
+ * Parameters follow the extension name, e.g. "; max_delta=4".
+ *
+ * @param[in] inst
+ * @param[out] params
+ * @param[in] max       size of params
+ * @param[out] size     bytes written to params (set larger than max if
+ *                      the parameters don't fit)
+ *
+ * @retval true     offer this extension
+ * @retval false    leave this extension out of the offer
+ *
+ * */
+typedef bool (*wic_ext_offer_fn)(struct wic_inst *inst, char *params, size_t max, size_t *size);
+
+/** Peer accepted an offered extension
+ *
+ * params is the text after the extension name up to the next extension
+ * in the response, e.g. "; max_delta=2". It is not null-terminated.
+ *
+ * @param[in] inst
+ * @param[in] params
+ * @param[in] size      size of params
+ *
+ * @retval true     extension is active
+ * @retval false    parameters are unacceptable (fails the handshake)
+ *
+ * */
+typedef bool (*wic_ext_accept_fn)(struct wic_inst *inst, const char *params, size_t size);
+
+/** Answer an extension offered by a client
+ *
+ * offer is the text after the extension name up to the next extension
+ * in the offer, e.g. "; max_delta=4". It is not null-terminated. A
+ * client may offer an extension more than once (e.g. with different
+ * parameters), this is called for each until one is answered.
+ *
+ * This may be called again if wic_start() doesn't succeed.
+ *
+ * @param[in] inst
+ * @param[in] offer
+ * @param[in] offer_size    size of offer
+ * @param[out] params       parameters to answer with, e.g. "; max_delta=2"
+ * @param[in] max           size of params
+ * @param[out] size         bytes written to params (set larger than max
+ *                          if the parameters don't fit)
+ *
+ * @retval true     extension is active
+ * @retval false    decline this offer
+ *
+ * */
+typedef bool (*wic_ext_respond_fn)(struct wic_inst *inst, const char *offer, size_t offer_size, char *params, size_t max, size_t *size);
+
+/** Choose whether an active extension transforms a message being sent
+ *
+ * Called before the first frame of each text or binary message. It may
+ * be called again for the same message if nothing was sent because of
+ * WIC_STATUS_WOULD_BLOCK.
+ *
+ * @param[in] inst
+ * @param[in] encoding
+ *
+ * @retval true     transform this message
+ * @retval false    let the next extension have it
+ *
+ * */
+typedef bool (*wic_ext_select_fn)(struct wic_inst *inst, enum wic_encoding encoding);
+
+/** Give payload to a transform
+ *
+ * @param[in] inst
+ * @param[in] data
+ * @param[in] size      size of data (zero to continue after WIC_EXT_FULL)
+ * @param[out] used     bytes of data taken
+ *
+ * @return wic_ext_status
+ *
+ * */
+typedef enum wic_ext_status (*wic_ext_write_fn)(struct wic_inst *inst, const void *data, size_t size, size_t *used);
+
+/** Finish the input given to a transform so far
+ *
+ * Called once all input has been written and the output taken. This
+ * must also finish anything left over from WIC_EXT_FULL. Returning
+ * WIC_EXT_FULL means this will be called again once the output is
+ * taken. No more output may be produced after WIC_EXT_OK.
+ *
+ * Sending calls this at the end of every wic_send(). Receiving calls
+ * this at the end of every message.
+ *
+ * @param[in] inst
+ * @param[in] fin       end of message
+ *
+ * @return wic_ext_status
+ *
+ * */
+typedef enum wic_ext_status (*wic_ext_end_fn)(struct wic_inst *inst, bool fin);
+
+/** Next contiguous piece of transform output
+ *
+ * @param[in] inst
+ * @param[out] size     size of this piece
+ * @param[out] pending  all output waiting to be taken
+ *
+ * @return pointer to output
+ *
+ * */
+typedef const void *(*wic_ext_output_fn)(struct wic_inst *inst, size_t *size, size_t *pending);
+
+/** Output has been taken
+ *
+ * @param[in] inst
+ * @param[in] size      bytes taken from the piece returned by wic_ext_output_fn
+ *
+ * */
+typedef void (*wic_ext_consume_fn)(struct wic_inst *inst, size_t size);
+
+/** one direction of an extension */
+struct wic_ext_transform {
+
+    wic_ext_write_fn write;
+    wic_ext_end_fn end;
+    wic_ext_output_fn output;
+    wic_ext_consume_fn consume;
+};
+
+/** An extension (RFC6455 section 9)
+ *
+ * Messages are transformed by at most one extension. A received text or
+ * binary message is given to the active extension which claimed exactly
+ * the RSV bits set in its first frame. A message being sent is given to
+ * the first active extension (in the order given to wic_init()) which
+ * has a tx transform and selects it.
+ *
+ * Callbacks can find per-instance state through wic_get_app().
+ *
+ * */
+struct wic_extension {
+
+    /** null-terminated extension token, e.g. "x-delta" */
+    const char *name;
+
+    /** RSV bits claimed by this extension (WIC_RSV1 | WIC_RSV2 | WIC_RSV3) */
+    uint8_t rsv;
+
+    /** **OPTIONAL** parameters to offer (name alone if not set) */
+    wic_ext_offer_fn offer;
+
+    /** **OPTIONAL** check the response (parameters are refused if not set) */
+    wic_ext_accept_fn accept;
+
+    /** **OPTIONAL** answer an offer when this instance is a server
+     * (offers with parameters are declined if not set) */
+    wic_ext_respond_fn respond;
+
+    /** **OPTIONAL** choose messages to transform (all if not set) */
+    wic_ext_select_fn select;
+
+    /** **OPTIONAL** transform messages being sent */
+    const struct wic_ext_transform *tx;
+
+    /** **OPTIONAL** transform received messages */
+    const struct wic_ext_transform *rx;
+};
+
 /** An instance is either a client or a server */
 enum wic_role {
 
@@ -321,14 +649,13 @@ enum wic_schema {
     WIC_SCHEMA_WSS
 };
 
-/** wic_init() argument */
-struct wic_init_arg {
-
-    /** Buffer used to store received frame payload and received handshake */
-    void *rx;    
-
-    /** Maximum size of rx payload and received handshake */
-    size_t rx_max;      
+/** Handlers given to wic_init() through wic_init_arg.callbacks
+ *
+ * The table is not copied, so it must remain valid for the life of the
+ * instance. One const table can be shared by any number of instances.
+ *
+ * */
+struct wic_callbacks {
 
     /** **OPTIONAL** handler called when text or binary is received */
     wic_on_message_fn on_message;
@@ -357,9 +684,159 @@ struct wic_init_arg {
     /** handler called to write message to transport */
     wic_on_send_fn on_send;
 
-    /** handler called to get a buffer (prior to calling wic_init_arg.on_send) */
+    /** handler called to get a buffer (prior to calling wic_callbacks.on_send) */
     wic_on_buffer_fn on_buffer;
 
+    /** **OPTIONAL** handler called to write unmasked text and binary
+     * frames to transport without first copying the payload into a
+     * buffer from wic_callbacks.on_buffer
+     *
+     * Only servers send unmasked frames so this has no effect for
+     * clients.
+     *
+     * */
+    wic_on_sendv_fn on_sendv;
+
+    /** **OPTIONAL** handler called by wic_send_frame() to queue a shared
+     * frame rather than copying it into a buffer from
+     * wic_callbacks.on_buffer
+     *
+     * */
+    wic_on_send_frame_fn on_send_frame;
+
+    /** **OPTIONAL** borrow receive buffers (of wic_init_arg.rx_max bytes)
+     * only while they are needed rather than holding wic_init_arg.rx for
+     * the life of the instance
+     *
+     * Must be set together with wic_callbacks.on_rx_release. A client
+     * borrows a buffer for the handshake from wic_init().
+     *
+     * */
+    wic_on_rx_buffer_fn on_rx_buffer;
+
+    /** **OPTIONAL** return a buffer from wic_callbacks.on_rx_buffer */
+    wic_on_rx_release_fn on_rx_release;
+};
+
+/** wic_init() argument */
+struct wic_init_arg {
+
+    /** Buffer used to store received frame payload and received handshake
+     *
+     * Unless wic_init_arg.rx_header or wic_init_arg.handshake is set,
+     * handshake state (a struct wic_handshake) is also kept at the end
+     * of this buffer until the instance opens. rx_max must then be at
+     * least WIC_RX_HANDSHAKE_SIZE bytes, and the handshake fields only
+     * get what is left after the state. A handshake with more fields
+     * than fit fails.
+     *
+     * Not used if wic_callbacks.on_rx_buffer is set.
+     *
+     * */
+    void *rx;    
+
+    /** Maximum size of rx payload and received handshake */
+    size_t rx_max;      
+
+    /** **OPTIONAL** buffer used to store the received handshake
+     *
+     * If set, handshake fields (and handshake state) are kept here
+     * rather than in wic_init_arg.rx and remain accessible for the life
+     * of the instance. This also means wic_init_arg.rx does not need to
+     * be sized for the handshake.
+     *
+     * */
+    void *rx_header;
+
+    /** Maximum size of rx_header */
+    size_t rx_header_max;
+
+    /** **OPTIONAL** memory for handshake state
+     *
+     * Set this to keep handshake state out of the handshake buffer
+     * (e.g. if wic_init_arg.rx is small). It is no longer used once the
+     * instance opens unless wic_init_arg.rx_header is also set.
+     *
+     * */
+    struct wic_handshake *handshake;
+
+    /** **OPTIONAL** pass unmasked payload to wic_callbacks.on_message
+     * directly from the buffer given to wic_parse() when the rest of the
+     * frame is available, rather than copying it into wic_init_arg.rx
+     * first
+     *
+     * Frames which are masked or split across wic_parse() calls are
+     * still buffered in wic_init_arg.rx.
+     *
+     * */
+    bool rx_direct;
+
+    /** handlers (on_send and on_buffer are required) */
+    const struct wic_callbacks *callbacks;
+
+    /** **OPTIONAL** memory for a fast per-instance mask generator
+     * (xoshiro128**)
+     *
+     * Masks and the handshake nonce are then generated here rather than
+     * by calling wic_callbacks.rand every time. wic_callbacks.rand is
+     * only called four times to seed the generator.
+     *
+     * */
+    struct wic_fast_mask *fast_mask;
+
+    /** **OPTIONAL** memory needed by wic_cork() */
+    struct wic_cork *cork;
+
+    /** **OPTIONAL** memory needed by wic_send_reserve() */
+    struct wic_reserve *reserve;
+
+    /** **OPTIONAL** memory for permessage-deflate (RFC7692)
+     *
+     * If set, permessage-deflate is offered in the handshake and text
+     * and binary messages are compressed if the peer accepts. Use
+     * WIC_PMD_SIZE() to find the size required.
+     *
+     * Requires wic_init_arg.ext_state.
+     *
+     * */
+    void *pmd;
+
+    /** Size of pmd */
+    size_t pmd_max;
+
+    /** **OPTIONAL** largest LZ77 window (as bits) the peer may use to
+     * compress messages sent to this instance (8..15, 0 means 15) */
+    uint8_t pmd_rx_window_bits;
+
+    /** **OPTIONAL** largest LZ77 window (as bits) this instance will use
+     * to compress messages (8..15, 0 means 15) */
+    uint8_t pmd_tx_window_bits;
+
+    /** **OPTIONAL** ask the peer to compress every message without
+     * reference to previous messages */
+    bool pmd_rx_no_context_takeover;
+
+    /** **OPTIONAL** compress every message without reference to
+     * previous messages */
+    bool pmd_tx_no_context_takeover;
+
+    /** **OPTIONAL** extensions to offer in order of preference
+     *
+     * permessage-deflate (if enabled) is offered after these. No more
+     * than eight extensions may be offered in total.
+     *
+     * Requires wic_init_arg.ext_state.
+     *
+     * */
+    const struct wic_extension *ext;
+
+    /** Number of extensions in ext */
+    size_t ext_count;
+
+    /** **OPTIONAL** memory for extension state (required if
+     * wic_init_arg.ext or wic_init_arg.pmd is set) */
+    struct wic_ext_state *ext_state;
+
     /** **OPTIONAL** any data you wish to associate with instance */
     void *app;
 
@@ -432,21 +909,18 @@ struct wic_header {
 
 struct wic_rx_frame {
 
+    /* enums are stored as uint8_t so that the frame fits in one cache
+     * line (on 64 bit targets) */
+    uint8_t state;      /* enum wic_rx_state */
+    uint8_t opcode;     /* enum wic_opcode */
+    uint8_t frag;       /* enum wic_opcode */
+    uint8_t rsv;
     bool fin;
-    bool rsv1;
-    bool rsv2;
-    bool rsv3;
-
-    enum wic_opcode opcode;
-    enum wic_opcode frag;
-    
-    uint8_t mask[4U];
-    uint64_t size;
-    uint16_t pos;
     bool masked;
-    
-    enum wic_rx_state state;
     uint16_t utf8;
+    uint8_t mask[4U];
+    uint16_t pos;
+    uint64_t size;
 
     struct wic_stream s;
 };
@@ -468,6 +942,103 @@ enum wic_header_state {
     WIC_HEADER_STATE_VALUE
 };
 
+/** State only needed until the handshake is complete
+ *
+ * This is kept at the end of the handshake buffer unless
+ * wic_init_arg.handshake is set.
+ *
+ * */
+struct wic_handshake {
+
+    struct http_parser http;
+
+    enum wic_header_state header_state;
+
+    struct wic_header *tx_header;
+
+    /* received handshake fields (same buffer as wic_inst.rx.s unless
+     * wic_init_arg.rx_header is set) */
+    struct wic_stream rx_header;
+
+    /* offset+1 of each received header name (0 is empty) */
+    uint16_t header_index[WIC_HEADER_INDEX_SIZE];
+    bool header_index_full;
+
+    /* wic_get_next_header() position */
+    size_t pos;
+
+    uint8_t hash[20U];
+
+    /* bit n is set if extension n was offered */
+    uint8_t ext_offered;
+
+    const char *redirect_url;
+
+    /* The default size should cover all use cases */
+    char hostname[WIC_HOSTNAME_MAXLEN];
+};
+
+/** State for wic_init_arg.fast_mask */
+struct wic_fast_mask {
+
+    uint32_t state[4U];
+    bool seeded;
+};
+
+/** State for wic_cork() */
+struct wic_cork {
+
+    /* frames held back */
+    struct wic_stream s;
+    bool corked;
+};
+
+/** State for wic_send_reserve() */
+struct wic_reserve {
+
+    /* buffer held until wic_send_commit() or wic_send_abort() */
+    char *buf;
+    size_t header;
+    size_t max;
+    enum wic_opcode opcode;
+};
+
+/** State for wic_init_arg.ext and wic_init_arg.pmd */
+struct wic_ext_state {
+
+    /* wic_init_arg.ext followed by permessage-deflate (if enabled)
+     *
+     * bit n of active is set if extension n was accepted
+     *
+     * */
+    const struct wic_extension *ext;
+    size_t count;
+    uint8_t active;
+
+    /* extension transforming the message being sent and how far it
+     * got before WIC_STATUS_WOULD_BLOCK */
+    const struct wic_extension *tx;
+    size_t tx_in;
+    bool tx_ended;
+    bool tx_busy;
+
+    /* extension transforming the message being received (set by the
+     * first frame) and bytes of payload given to it */
+    const struct wic_extension *rx;
+    size_t rx_pos;
+    bool rx_full;
+    bool rx_ended;
+
+    /* permessage-deflate */
+    struct wic_inflate *inflate;
+    struct wic_deflate *deflate;
+    uint8_t pmd_rx_bits;
+    uint8_t pmd_tx_bits;
+    bool pmd_rx_nct;
+    bool pmd_tx_nct;
+    uint8_t pmd_rx_tail;
+};
+
 enum wic_status {
 
     WIC_STATUS_SUCCESS,         /**< operation complete successfully */
@@ -479,55 +1050,50 @@ enum wic_status {
     WIC_STATUS_TIMEOUT
 };
 
-/** WIC instance */
+/** WIC instance
+ *
+ * Only what every instance needs is kept here. Handlers are found
+ * through wic_init_arg.callbacks and optional features keep their state
+ * in memory given to wic_init().
+ *
+ * */
 struct wic_inst {
 
-    enum wic_role role;
-
-    enum wic_state state;
-
+    /* fields used for every frame come first */
     struct wic_rx_frame rx;
 
-    wic_on_message_fn on_message;
-    
-    wic_on_open_fn on_open;
-    wic_on_close_fn on_close;
-    wic_on_close_transport_fn on_close_transport;
-    wic_on_handshake_failure_fn on_handshake_failure;
-    
-    wic_on_send_fn on_send;
-    wic_on_buffer_fn on_buffer;
-    
-    wic_rand_fn rand;
-
-    wic_on_ping_fn on_ping;
-    wic_on_pong_fn on_pong;
-    
+    const struct wic_callbacks *cb;
     void *app;
 
-    const char *url;
-    enum wic_schema schema;    
+    enum wic_state state;
+    enum wic_role role;
+    enum wic_opcode frag;
+
     uint16_t status_code;
-    uint16_t port;
+    uint16_t utf8_tx;
+    uint16_t utf8_rx;
 
-    struct wic_header *tx_header;
-    enum wic_header_state header_state;
+    bool rx_direct;
 
-    struct http_parser http;
+    /* set if hs stays with the fields in wic_init_arg.rx_header */
+    bool hs_keep;
 
-    enum wic_opcode frag;
-    uint16_t pos;
-    uint16_t tx_max;
+    const char *url;
 
-    uint16_t utf8_tx;
-    uint16_t utf8_rx;
+    /* NULL once the handshake state is no longer needed */
+    struct wic_handshake *hs;
 
-    uint8_t hash[20U];
+    /* largest buffer on_buffer has offered for user frames */
+    size_t tx_max;
 
-    /* The default size should cover all use cases */
-    char hostname[WIC_HOSTNAME_MAXLEN];
+    /* bytes of a message sent before WIC_STATUS_WOULD_BLOCK */
+    size_t tx_offset;
 
-    const char *redirect_url;
+    /* optional features (NULL unless given to wic_init()) */
+    struct wic_fast_mask *fast_mask;
+    struct wic_cork *cork;
+    struct wic_reserve *reserve;
+    struct wic_ext_state *ext;
 };
 
 /** Initialise an instance
@@ -560,6 +1126,9 @@ void *wic_get_app(struct wic_inst *self);
 const char *wic_get_url(const struct wic_inst *self);
 
 /** Get status code of handshake
+ *
+ * A client gets the status code of the response. A server gets the
+ * status code it responded with.
  *
  * @param[in] self
  *
@@ -569,12 +1138,15 @@ const char *wic_get_url(const struct wic_inst *self);
 uint16_t wic_get_status_code(const struct wic_inst *self);
 
 /** Get URL hostname string
+ *
+ * The hostname is kept with the handshake state and so is not available
+ * once the instance opens, unless wic_init_arg.rx_header is set.
  * 
  * @param[in]   self
  *
  * @return null-terminated hostname
  *
- * @retval NULL URL not set
+ * @retval NULL URL not set or handshake state released
  *
  * */
 const char *wic_get_url_hostname(const struct wic_inst *self);
@@ -599,6 +1171,9 @@ enum wic_schema wic_get_url_schema(const struct wic_inst *self);
 
 /** Get a redirect URL if the server handshake response was a valid
  * redirect.
+ *
+ * If wic_callbacks.on_rx_buffer is set this is only available until
+ * #wic_on_handshake_failure_fn returns.
  * 
  * @param[in] self
  *
@@ -610,6 +1185,10 @@ enum wic_schema wic_get_url_schema(const struct wic_inst *self);
 const char *wic_get_redirect_url(const struct wic_inst *self);
 
 /** Start instance
+ *
+ * A client sends the handshake request. A server sends the handshake
+ * response to the request it has received (usually from
+ * #wic_on_open_fn).
  *
  * @param[in] self
  *
@@ -631,7 +1210,8 @@ enum wic_status wic_start(struct wic_inst *self);
  * consumed, and to call wic_parse again to continue parsing.
  *
  * If no bytes are consumed it means that wic_inst is either blocked
- * (see #wic_on_message_fn) or that wic_inst has entered closed state.
+ * (see #wic_on_message_fn and #wic_on_rx_buffer_fn) or that wic_inst
+ * has entered closed state.
  *
  * */
 size_t wic_parse(struct wic_inst *self, const void *data, size_t size);
@@ -678,15 +1258,24 @@ void wic_close_with_reason(struct wic_inst *self, uint16_t code, const char *rea
  * Equivalent to calling wic_send() with WIC_ENCODING_BINARY encoding.
  *
  * */
-enum wic_status wic_send_binary(struct wic_inst *self, bool fin, const void *data, uint16_t size);
+enum wic_status wic_send_binary(struct wic_inst *self, bool fin, const void *data, size_t size);
 
 /**
  * Equivalent to calling wic_send() with WIC_ENCODING_UTF8 encoding.
  *
  * */
-enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data, uint16_t size);
+enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data, size_t size);
 
 /** Send a message with either UTF or binary encoding
+ *
+ * Data that will not fit in the buffers offered by wic_callbacks.on_buffer
+ * is sent as several continuation frames.
+ *
+ * If WIC_STATUS_WOULD_BLOCK is returned part of data may already have
+ * been sent. Call again with the same arguments to send the rest.
+ *
+ * If an extension (e.g. permessage-deflate) transforms the message the
+ * frames carry its output instead.
  *
  * @param[in] self
  * @param[in] encoding  encoding of data
@@ -699,10 +1288,166 @@ enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data,
  * @retval WIC_STATUS_SUCCESS
  * @retval WIC_STATUS_NOT_OPEN
  * @retval WIC_STATUS_WOULD_BLOCK
- * @retval WIC_STATUS_TOO_LARGE    
+ * @retval WIC_STATUS_TOO_LARGE     buffer cannot fit any payload
+ * @retval WIC_STATUS_BAD_INPUT     extension failed to transform data
+ *
+ * */
+enum wic_status wic_send(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, size_t size);
+
+/** Reserve a buffer for the payload of the next message so that it
+ * can be written in place rather than copied by wic_send()
+ *
+ * The buffer is taken from wic_callbacks.on_buffer with space for the
+ * frame header in front of the returned pointer. Finish with
+ * wic_send_commit() or wic_send_abort().
+ *
+ * Control frames may still be sent (e.g. by wic_parse()) while a
+ * reservation is held so wic_callbacks.on_buffer must be able to
+ * provide another buffer in the meantime.
+ *
+ * @note max_size should not be much larger than needed since the payload
+ * is moved if the committed size has a shorter length encoding
+ *
+ * @param[in] self
+ * @param[in] encoding  encoding of data
+ * @param[in] max_size  maximum size of data
+ *
+ * @return pointer to max_size bytes of writable memory
+ *
+ * @retval NULL     not open, reservation already held, fragmentation of
+ *                  a different encoding in progress, no buffer, or
+ *                  wic_init_arg.reserve not set
+ *
+ * */
+void *wic_send_reserve(struct wic_inst *self, enum wic_encoding encoding, size_t max_size);
+
+/** Send the payload written to memory returned by wic_send_reserve()
+ *
+ * The reservation is released whatever the result, except that if an
+ * extension is transforming the message and WIC_STATUS_WOULD_BLOCK is
+ * returned it is kept so that wic_send_commit() can be called again.
+ *
+ * @param[in] self
+ * @param[in] size  size of data (must not exceed max_size)
+ * @param[in] fin   true if final fragment
+ *
+ * @return #wic_status
+ *
+ * @retval WIC_STATUS_SUCCESS
+ * @retval WIC_STATUS_NOT_OPEN
+ * @retval WIC_STATUS_WOULD_BLOCK
+ * @retval WIC_STATUS_TOO_LARGE
+ * @retval WIC_STATUS_BAD_STATE     nothing reserved
+ * @retval WIC_STATUS_BAD_INPUT     payload is not UTF8
+ *
+ * */
+enum wic_status wic_send_commit(struct wic_inst *self, size_t size, bool fin);
+
+/** Release memory returned by wic_send_reserve() without sending it
+ *
+ * @param[in] self
+ *
+ * */
+void wic_send_abort(struct wic_inst *self);
+
+/** Pack text and binary frames into a shared buffer rather than calling
+ * wic_callbacks.on_send once per frame
+ *
+ * The buffer is sent when the next frame won't fit, when a control
+ * frame is sent (the held frames go first), or by wic_flush() and
+ * wic_uncork(). wic_callbacks.on_sendv is not used while corked.
+ *
+ * This has no effect unless wic_init_arg.cork was set.
+ *
+ * @param[in] self
+ *
+ * */
+void wic_cork(struct wic_inst *self);
+
+/** Send any frames held back by wic_cork() and go back to sending
+ * each frame as it is written
+ *
+ * @param[in] self
+ *
+ * */
+void wic_uncork(struct wic_inst *self);
+
+/** Send any frames held back by wic_cork() but stay corked
+ *
+ * @param[in] self
+ *
+ * */
+void wic_flush(struct wic_inst *self);
+
+/** Size of the frame wic_frame_prepare() encodes for a payload
+ *
+ * @param[in] size  size of payload
+ *
+ * @return bytes
+ *
+ * */
+size_t wic_frame_size(size_t size);
+
+/** Encode a complete unmasked text or binary message once so that
+ * the same bytes can be given to many instances with wic_send_frame()
+ *
+ * Extensions are not applied to the payload (RSV bits are clear) so
+ * the frame is valid for every connection whatever was negotiated.
+ *
+ * frame.release and frame.app are left as they are.
+ *
+ * @param[in] frame
+ * @param[in] buf       memory for the encoded frame
+ * @param[in] max       size of buf (see wic_frame_size())
+ * @param[in] encoding  encoding of data
+ * @param[in] data      payload (must not overlap buf)
+ * @param[in] size      size of data
+ *
+ * @return #wic_status
+ *
+ * @retval WIC_STATUS_SUCCESS       frame.refs is 1
+ * @retval WIC_STATUS_TOO_LARGE     buf is too small
+ * @retval WIC_STATUS_BAD_INPUT     payload is not UTF8
+ *
+ * */
+enum wic_status wic_frame_prepare(struct wic_frame *frame, void *buf, size_t max, enum wic_encoding encoding, const void *data, size_t size);
+
+/** Take a reference to a frame
+ *
+ * @param[in] frame
+ *
+ * */
+void wic_frame_ref(struct wic_frame *frame);
+
+/** Drop a reference to a frame
+ *
+ * wic_frame.release is called when the last reference is dropped.
+ *
+ * @param[in] frame
+ *
+ * */
+void wic_frame_unref(struct wic_frame *frame);
+
+/** Send a frame prepared by wic_frame_prepare()
+ *
+ * The frame is given to wic_callbacks.on_send_frame if set, otherwise it
+ * is copied into a buffer from wic_callbacks.on_buffer. Only servers can
+ * send prepared frames since clients must mask every frame.
+ *
+ * @param[in] self
+ * @param[in] frame
+ *
+ * @return #wic_status
+ *
+ * @retval WIC_STATUS_SUCCESS
+ * @retval WIC_STATUS_NOT_OPEN
+ * @retval WIC_STATUS_WOULD_BLOCK
+ * @retval WIC_STATUS_TOO_LARGE     frame doesn't fit buffer
+ * @retval WIC_STATUS_BAD_STATE     not a server, or another message is
+ *                                  part way through being sent
  *
  * */
-enum wic_status wic_send(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
+enum wic_status wic_send_frame(struct wic_inst *self, struct wic_frame *frame);
 
 /** Send a Ping message
  *
@@ -756,7 +1501,7 @@ enum wic_status wic_send_ping_with_payload(struct wic_inst *self, const void *da
  * @param[in] header    wic_header
  *
  * @retval true     header linked
- * @retval false    
+ * @retval false    invalid header or handshake state not available
  * 
  * */
 bool wic_set_header(struct wic_inst *self, struct wic_header *header);
@@ -768,6 +1513,9 @@ bool wic_set_header(struct wic_inst *self, struct wic_header *header);
  *
  * If instance is intialised as a server, this function will get
  * headers sent by the client.
+ *
+ * Headers are only available while wic_get_state() == WIC_STATE_READY
+ * unless wic_init_arg.rx_header was set.
  * 
  * @param[in] self
  * @param[in] name  null-terminated key/name
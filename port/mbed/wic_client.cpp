@@ -126,7 +126,7 @@ ClientBase::handle_open(struct wic_inst *self)
 }
 
 bool
-ClientBase::handle_message(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, uint16_t size)
+ClientBase::handle_message(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
     bool retval = false;
     ClientBase *obj = to_obj(self);
@@ -205,6 +205,24 @@ ClientBase::do_open()
 
     struct wic_init_arg init_arg = {0};
 
+    /* one table shared by every client */
+    static const struct wic_callbacks callbacks = [](){
+
+        struct wic_callbacks cb = {0};
+
+        cb.on_open = handle_open;
+        cb.on_close = handle_close;
+        cb.on_message = handle_message;
+        cb.on_close_transport = handle_close_transport;
+        cb.on_handshake_failure = handle_handshake_failure;
+
+        cb.on_send = handle_send;
+        cb.on_buffer = handle_buffer;
+        cb.rand = handle_rand;
+
+        return cb;
+    }();
+
     if(state != CLOSED){
 
         switch(state){
@@ -229,16 +247,9 @@ ClientBase::do_open()
 
     init_arg.rx = rx->data;
     init_arg.rx_max = rx->max;
+    init_arg.handshake = &handshake;
 
-    init_arg.on_open = handle_open;
-    init_arg.on_close = handle_close;
-    init_arg.on_message = handle_message;
-    init_arg.on_close_transport = handle_close_transport;
-    init_arg.on_handshake_failure = handle_handshake_failure;
-
-    init_arg.on_send = handle_send;
-    init_arg.on_buffer = handle_buffer;
-    init_arg.rand = handle_rand;
+    init_arg.callbacks = &callbacks;
 
     init_arg.role = WIC_ROLE_CLIENT;
 
@@ -320,7 +331,7 @@ ClientBase::do_close()
 }
 
 void
-ClientBase::do_send(enum wic_encoding encoding, bool fin, const char *value, uint16_t size)
+ClientBase::do_send(enum wic_encoding encoding, bool fin, const char *value, size_t size)
 {
     job.status = wic_send(&inst, encoding, fin, value, size);
     job.done = true;
@@ -545,7 +556,7 @@ ClientBase::close()
 }
 
 nsapi_size_or_error_t
-ClientBase::send(const char *data, uint16_t size, enum wic_encoding encoding, bool fin)
+ClientBase::send(const char *data, size_t size, enum wic_encoding encoding, bool fin)
 {
     nsapi_size_or_error_t retval = NSAPI_ERROR_PARAMETER;
 
@@ -92,6 +92,10 @@ namespace WIC {
 
             struct wic_inst inst;
 
+            /* kept out of rx so that all of rx is left for the
+             * handshake response */
+            struct wic_handshake handshake;
+
             Callback<void()> on_open_cb;
             Callback<void(uint16_t, const char *, uint16_t)> on_close_cb;
             
@@ -102,7 +106,7 @@ namespace WIC {
             static uint32_t handle_rand(struct wic_inst *self);
             static void handle_handshake_failure(struct wic_inst *self, enum wic_handshake_failure reason);
             static void handle_open(struct wic_inst *self);
-            static bool handle_message(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
+            static bool handle_message(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, size_t size);
             static void handle_close(struct wic_inst *self, uint16_t code, const char *reason, uint16_t size);
             static void handle_close_transport(struct wic_inst *self);
             static void handle_ping(struct wic_inst *self);
@@ -111,7 +115,7 @@ namespace WIC {
             /* these are requested via public methods */
             void do_open();
             void do_close();
-            void do_send(enum wic_encoding encoding, bool fin, const char *value, uint16_t size);
+            void do_send(enum wic_encoding encoding, bool fin, const char *value, size_t size);
             void do_close_socket();
 
             void do_handshake_timeout();
@@ -229,7 +233,7 @@ namespace WIC {
              * @retval NSAPI_ERROR_PARAMETER        
              *
              * */
-            nsapi_size_or_error_t send(const char *data, uint16_t size, enum wic_encoding encoding = WIC_ENCODING_UTF8, bool fin = true);
+            nsapi_size_or_error_t send(const char *data, size_t size, enum wic_encoding encoding = WIC_ENCODING_UTF8, bool fin = true);
 
             /** send a null-terminated UTF8 string as a message
              *
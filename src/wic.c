@@ -20,15 +20,29 @@
  * */
 
 #include "wic.h"
+#include "wic_deflate.h"
 #include <string.h>
 #include <ctype.h>
 
+#if defined(__AVX2__)
+#   define USE_AVX2
+#   include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#   define USE_SSE2
+#   include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#   define USE_NEON
+#   include <arm_neon.h>
+#endif
+
 struct wic_tx_frame {
 
     bool fin;
-    bool rsv1;
-    bool rsv2;
-    bool rsv3;
+    uint8_t rsv;
 
     enum wic_opcode opcode;
     enum wic_buffer type;
@@ -38,10 +52,24 @@ struct wic_tx_frame {
     bool masked;
     uint8_t mask[4U];
 
-    uint16_t size;
+    size_t size;
     const void *payload;
 };
 
+/* permessage-deflate parameters (RFC7692 section 7.1) */
+struct pmd_param {
+
+    bool server_nct;
+    bool client_nct;
+
+    bool server_bits_set;
+    bool client_bits_set;
+
+    /* zero if given without a value */
+    uint8_t server_bits;
+    uint8_t client_bits;
+};
+
 typedef struct sha1_context
 {
     uint32_t total[2];          /* The number of Bytes processed.  */
@@ -71,53 +99,120 @@ static const enum wic_opcode opcodes[] = {
 
 /* static prototypes **************************************************/
 
-static size_t min_frame_size(enum wic_opcode opcode, bool masked, uint16_t payload_size);
+static size_t min_frame_size(enum wic_opcode opcode, bool masked, size_t payload_size);
 
 static enum wic_status send_pong_with_payload(struct wic_inst *self, const void *data, uint16_t size);
 static void close_with_reason(struct wic_inst *self, uint16_t code, const char *reason, uint16_t size, enum wic_buffer type);
 
 static bool allowed_to_send(struct wic_inst *self);
-
+static enum wic_status send_frame(struct wic_inst *self, const struct wic_tx_frame *f);
+static enum wic_status send_message(struct wic_inst *self, const struct wic_tx_frame *msg);
+static const struct wic_extension *tx_extension(struct wic_inst *self, enum wic_opcode opcode);
+static const struct wic_extension *rx_extension(const struct wic_inst *self);
+static enum wic_status send_transformed(struct wic_inst *self, const struct wic_tx_frame *msg);
+static size_t max_payload_size(bool masked, size_t frame_size);
+static bool reserve_held(const struct wic_inst *self);
+static void release_reserve(struct wic_inst *self);
+static enum wic_status cork_frame(struct wic_inst *self, const struct wic_tx_frame *f);
+static void flush_cork(struct wic_inst *self);
+
+static bool parse_header(struct wic_inst *self, struct wic_stream *s);
 static bool parse_opcode(struct wic_inst *self, struct wic_stream *s);
 static bool parse_size(struct wic_inst *self, struct wic_stream *s);
 static bool parse_extended_size(struct wic_inst *self, struct wic_stream *s);
 static bool parse_mask(struct wic_inst *self, struct wic_stream *s);
 static bool parse_data(struct wic_inst *self, struct wic_stream *s);
+static bool parse_data_direct(struct wic_inst *self, struct wic_stream *s, bool *blocked);
+static bool deliver_message(struct wic_inst *self, enum wic_opcode opcode, const char *data, size_t size);
+static bool transform_message(struct wic_inst *self, enum wic_opcode opcode, bool fin, const char *data, size_t size);
+
+static void decode_opcode(struct wic_inst *self, uint8_t b);
+static void decode_size(struct wic_inst *self, uint8_t b);
+
+static void mask_copy(void *dst, const void *src, size_t size, const uint8_t *mask, size_t offset);
 
 static enum wic_status start_client(struct wic_inst *self);
 static enum wic_status start_server(struct wic_inst *self);
+static void reject_request(struct wic_inst *self);
+static void set_open(struct wic_inst *self);
+
+static bool parse_url(const char *url, struct http_parser_url *u, enum wic_schema *schema, uint16_t *port);
+static void init_handshake(struct wic_inst *self, struct wic_handshake *hs);
+static bool attach_rx_header(struct wic_inst *self, void *buf, size_t max);
+static bool borrow_rx(struct wic_inst *self);
+static void release_rx(struct wic_inst *self);
 
 static struct wic_tx_frame *init_mask(struct wic_inst *self, struct wic_tx_frame *f);
+static uint32_t next_random(struct wic_inst *self);
+static uint32_t rotl(uint32_t x, unsigned k);
 static uint8_t opcode_to_byte(enum wic_opcode opcode);
 static enum wic_opcode byte_to_opcode(uint8_t b);
 
-static void stream_init(struct wic_stream *self, void *buf, uint32_t size);
-static void stream_init_ro(struct wic_stream *self, const void *buf, uint32_t size);
+static void stream_init(struct wic_stream *self, void *buf, size_t size);
+static void stream_init_ro(struct wic_stream *self, const void *buf, size_t size);
 static void stream_rewind(struct wic_stream *self);
 static bool stream_read(struct wic_stream *self, void *buf, size_t count);
 static bool stream_write(struct wic_stream *self, const void *buf, size_t count);
-static enum wic_status stream_put_frame(struct wic_inst *self, struct wic_stream *tx, const struct wic_tx_frame *f);
+static enum wic_status get_buffer(struct wic_inst *self, struct wic_stream *tx, size_t size, enum wic_buffer type);
+static bool stream_put_frame(struct wic_stream *self, const struct wic_tx_frame *f);
+static void stream_put_frame_header(struct wic_stream *self, const struct wic_tx_frame *f, size_t payload_size);
 static bool stream_put_u8(struct wic_stream *self, uint8_t value);
-static bool stream_put_u8_masked(struct wic_stream *self, uint8_t value, const uint8_t *mask, uint8_t *unmasked);
 static bool stream_put_u16(struct wic_stream *self, uint16_t value);
+static bool stream_put_u64(struct wic_stream *self, uint64_t value);
 static bool stream_get_u8(struct wic_stream *self, uint8_t *value);
 static bool stream_eof(const struct wic_stream *self);
 static bool stream_error(struct wic_stream *self);
 static bool stream_put_str(struct wic_stream *self, const char *str);
+static bool stream_put_dec(struct wic_stream *self, uint16_t value);
 static size_t stream_max(const struct wic_stream *self);
 static size_t stream_pos(const struct wic_stream *self);
 static bool stream_seek(struct wic_stream *self, size_t offset);
+static size_t stream_remaining(const struct wic_stream *self);
 
 static bool str_equal(const char *s1, const char *s2);
+static uint32_t str_hash(const char *s);
+
+static size_t extension_count(const struct wic_inst *self);
+static const struct wic_extension *get_extension(const struct wic_inst *self, size_t n);
+static const struct wic_extension *rsv_extension(const struct wic_inst *self, uint8_t rsv);
+static bool extension_is_valid(const struct wic_extension *ext);
+static bool transform_is_valid(const struct wic_ext_transform *transform);
+static void offer_extensions(struct wic_inst *self, struct wic_stream *tx);
+static bool accept_extensions(struct wic_inst *self, const char *value);
+static void respond_extensions(struct wic_inst *self, struct wic_stream *tx);
+static const char *ext_params_end(const char *in);
+
+static bool pmd_offer(struct wic_inst *self, char *params, size_t max, size_t *size);
+static bool pmd_accept(struct wic_inst *self, const char *params, size_t size);
+static bool pmd_respond(struct wic_inst *self, const char *offer, size_t offer_size, char *params, size_t max, size_t *size);
+static bool pmd_parse(const char *params, size_t size, struct pmd_param *param);
+static bool pmd_window_bits(const char *value, size_t size, uint8_t *bits);
+static enum wic_ext_status pmd_tx_write(struct wic_inst *self, const void *data, size_t size, size_t *used);
+static enum wic_ext_status pmd_tx_end(struct wic_inst *self, bool fin);
+static const void *pmd_tx_output(struct wic_inst *self, size_t *size, size_t *pending);
+static void pmd_tx_consume(struct wic_inst *self, size_t size);
+static enum wic_ext_status pmd_rx_write(struct wic_inst *self, const void *data, size_t size, size_t *used);
+static enum wic_ext_status pmd_rx_end(struct wic_inst *self, bool fin);
+static const void *pmd_rx_output(struct wic_inst *self, size_t *size, size_t *pending);
+static void pmd_rx_consume(struct wic_inst *self, size_t size);
+static const char *ext_token(const char *in, const char **token, size_t *size);
+static const char *ext_value(const char *in, const char **value, size_t *size);
+static const char *skip_space(const char *in);
+static bool token_equal(const char *token, size_t size, const char *str);
+
+static void index_headers(struct wic_inst *self);
+static const char *find_header(const struct wic_inst *self, const char *name);
+static bool header_available(const struct wic_inst *self);
 
 static char b64_encode_byte(uint8_t in);
 static size_t b64_encoded_size(size_t size);
 static size_t b64_encode(const void *in, size_t len, char *out, size_t max);
 
-static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size);
+static bool on_message(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, size_t size);
 
 static uint16_t utf8_parse(uint16_t state, char in);
-static uint16_t utf8_parse_string(uint16_t state, const char *in, uint16_t len);
+static uint16_t utf8_parse_string(uint16_t state, const char *in, size_t len);
+static size_t utf8_ascii_span(const char *in, size_t len);
 static bool utf8_is_complete(uint16_t state);
 static bool utf8_is_invalid(uint16_t state);
 
@@ -133,39 +228,58 @@ static int on_header_value(http_parser *http, const char *at, size_t length);
 static int on_response_complete(http_parser *http);
 static int on_request_complete(http_parser *http);
 
+/* permessage-deflate is always offered after wic_init_arg.ext */
+static const struct wic_ext_transform pmd_tx = {
+    .write = pmd_tx_write,
+    .end = pmd_tx_end,
+    .output = pmd_tx_output,
+    .consume = pmd_tx_consume
+};
+
+static const struct wic_ext_transform pmd_rx = {
+    .write = pmd_rx_write,
+    .end = pmd_rx_end,
+    .output = pmd_rx_output,
+    .consume = pmd_rx_consume
+};
+
+static const struct wic_extension pmd_extension = {
+    .name = "permessage-deflate",
+    .rsv = WIC_RSV1,
+    .offer = pmd_offer,
+    .accept = pmd_accept,
+    .respond = pmd_respond,
+    .select = NULL,
+    .tx = &pmd_tx,
+    .rx = &pmd_rx
+};
+
 /* functions **********************************************************/
 
 bool wic_init(struct wic_inst *self, const struct wic_init_arg *arg)
 {
     struct http_parser_url u;
+    struct wic_ext_state *ext = arg->ext_state;
+    const struct wic_callbacks *cb = arg->callbacks;
     size_t i;
-    uint16_t port = 0U;
-
-    static const char *supported_schema[] = {
-        "http",
-        "https",
-        "ws",
-        "wss"
-    };
+    uint16_t port;
+    enum wic_schema schema;
 
-    static const enum wic_schema schema_map[] = {
-        WIC_SCHEMA_HTTP,
-        WIC_SCHEMA_HTTPS,
-        WIC_SCHEMA_WS,
-        WIC_SCHEMA_WSS
-    };
+    (void)memset(self, 0, sizeof(*self));
 
-    enum wic_schema schema = WIC_SCHEMA_WS;
+    if(cb == NULL){
 
-    (void)memset(self, 0, sizeof(*self));
+        WIC_ERROR("callbacks are mandatory")
+        return false;
+    }
 
-    if(arg->on_send == NULL){
+    if(cb->on_send == NULL){
 
         WIC_ERROR("on_send interface is mandatory")
         return false;
     }
 
-    if(arg->on_buffer == NULL){
+    if(cb->on_buffer == NULL){
 
         WIC_ERROR("on_buffer interface is mandatory")
         return false;
@@ -177,95 +291,171 @@ bool wic_init(struct wic_inst *self, const struct wic_init_arg *arg)
         return false;
     }
 
-    if(arg->url != NULL){
+    if((arg->url != NULL) && !parse_url(arg->url, &u, &schema, &port)){
 
-        if(http_parser_parse_url(arg->url, strlen(arg->url), 0, &u) == 0){
+        WIC_ERROR("invalid URL")
+        return false;
+    }
 
-            for(i=0; i<sizeof(supported_schema)/sizeof(*supported_schema); i++){
+    if((arg->url != NULL) && (u.field_data[UF_HOST].len > (WIC_HOSTNAME_MAXLEN-1U))){
 
-                if(u.field_data[UF_SCHEMA].len == strlen(supported_schema[i])){
+        WIC_ERROR("hostname is too long for buffer")
+        return false;
+    }
 
-                    if(memcmp(&arg->url[u.field_data[UF_SCHEMA].off], supported_schema[i], u.field_data[UF_SCHEMA].len) == 0){
+    if((cb->on_rx_buffer != NULL) != (cb->on_rx_release != NULL)){
 
-                        schema = schema_map[i];
-                        break;
-                    }
-                }
-            }
+        WIC_ERROR("on_rx_buffer and on_rx_release must be set together")
+        return false;
+    }
 
-            if(i == (sizeof(supported_schema)/sizeof(*supported_schema))){
+    if((cb->on_rx_buffer != NULL) && (arg->rx_max == 0U)){
 
-                WIC_ERROR("unrecognised URL schema")
-                return false;
-            }
+        WIC_ERROR("rx_max is required with on_rx_buffer")
+        return false;
+    }
 
-            if((u.field_set & (1U << UF_PORT)) > 0U){
+    if(((arg->pmd != NULL) || (arg->ext_count > 0U)) && (ext == NULL)){
 
-                port = u.port;
-            }
-            else{
+        WIC_ERROR("ext_state is required for extensions")
+        return false;
+    }
 
-                switch(schema){
-                case WIC_SCHEMA_HTTP:
-                case WIC_SCHEMA_WS:
-                    port = 80U;
-                    break;
-                default:
-                    port = 443U;
-                    break;
-                }
-            }
+    /* borrowed buffers are attached when there is something to store,
+     * until then rx.s only remembers rx_max */
+    stream_init(&self->rx.s, (cb->on_rx_buffer == NULL) ? arg->rx : NULL, arg->rx_max);
 
-            if(u.field_data[UF_HOST].len > (sizeof(self->hostname)-1U)){
+    if(ext != NULL){
 
-                WIC_ERROR("hostname is too long for buffer")
-                return false;
-            }
+        (void)memset(ext, 0, sizeof(*ext));
+    }
+
+    if(arg->pmd != NULL){
 
-            (void)memcpy(self->hostname, &arg->url[u.field_data[UF_HOST].off], u.field_data[UF_HOST].len);
+        ext->pmd_rx_bits = (arg->pmd_rx_window_bits == 0U) ? 15U : arg->pmd_rx_window_bits;
+        ext->pmd_tx_bits = (arg->pmd_tx_window_bits == 0U) ? 15U : arg->pmd_tx_window_bits;
+
+        if((ext->pmd_rx_bits < 8U) || (ext->pmd_rx_bits > 15U) || (ext->pmd_tx_bits < 8U) || (ext->pmd_tx_bits > 15U)){
+
+            WIC_ERROR("permessage-deflate window bits must be in range 8..15")
+            return false;
+        }
+
+        /* inflater then deflater */
+        ext->inflate = wic_inflate_init(arg->pmd, arg->pmd_max, ext->pmd_rx_bits);
+
+        if(ext->inflate != NULL){
+
+            ext->deflate = wic_deflate_init(&((uint8_t *)arg->pmd)[wic_inflate_size(ext->pmd_rx_bits)], arg->pmd_max - wic_inflate_size(ext->pmd_rx_bits), ext->pmd_tx_bits);
         }
-        else{
 
-            WIC_ERROR("invalid URL")
+        if(ext->deflate == NULL){
+
+            WIC_ERROR("pmd is too small for these window bits (see WIC_PMD_SIZE)")
             return false;
         }
+
+        ext->pmd_rx_nct = arg->pmd_rx_no_context_takeover;
+        ext->pmd_tx_nct = arg->pmd_tx_no_context_takeover;
     }
 
-    if(arg->role != WIC_ROLE_CLIENT){
+    if(arg->ext_count > 0U){
 
-        WIC_ERROR("only supporting client roles")
-        return false;
+        if(arg->ext == NULL){
+
+            WIC_ERROR("ext is required when ext_count is set")
+            return false;
+        }
+
+        /* one bit each in ext_offered and active */
+        if((arg->ext_count + ((ext->inflate != NULL) ? 1U : 0U)) > (sizeof(ext->active) * 8U)){
+
+            WIC_ERROR("too many extensions")
+            return false;
+        }
+
+        for(i=0U; i < arg->ext_count; i++){
+
+            if(!extension_is_valid(&arg->ext[i])){
+
+                WIC_ERROR("extension is invalid")
+                return false;
+            }
+        }
+
+        ext->ext = arg->ext;
+        ext->count = arg->ext_count;
+    }
+
+    if(arg->fast_mask != NULL){
+
+        (void)memset(arg->fast_mask, 0, sizeof(*arg->fast_mask));
     }
 
-    stream_init(&self->rx.s, arg->rx, arg->rx_max);
+    if(arg->cork != NULL){
+
+        (void)memset(arg->cork, 0, sizeof(*arg->cork));
+    }
+
+    if(arg->reserve != NULL){
+
+        (void)memset(arg->reserve, 0, sizeof(*arg->reserve));
+    }
 
     self->url = arg->url;
-    self->schema = schema;
     self->app = arg->app;
     self->role = arg->role;
-    self->port = port;
+    self->cb = cb;
+    self->rx_direct = arg->rx_direct;
 
-    self->on_message = (arg->on_message != NULL) ? arg->on_message : on_message;
-    self->on_open = arg->on_open;
-    self->on_close = arg->on_close;
+    self->fast_mask = arg->fast_mask;
+    self->cork = arg->cork;
+    self->reserve = arg->reserve;
+    self->ext = ext;
 
-    self->on_send = arg->on_send;
-    self->on_buffer = arg->on_buffer;
-    self->rand = arg->rand;
-    self->on_close_transport = arg->on_close_transport;
-    self->on_handshake_failure = arg->on_handshake_failure;
+    self->state = (self->role == WIC_ROLE_CLIENT) ? WIC_STATE_INIT : WIC_STATE_PARSE_HANDSHAKE;
 
-    if(self->role == WIC_ROLE_CLIENT){
+    if(arg->handshake != NULL){
 
-        http_parser_init(&self->http, HTTP_RESPONSE);
+        init_handshake(self, arg->handshake);
     }
-    else{
 
-        self->state = WIC_STATE_PARSE_HANDSHAKE;
-        http_parser_init(&self->http, HTTP_REQUEST);
+    if(arg->rx_header != NULL){
+
+        self->hs_keep = true;
+
+        if(!attach_rx_header(self, arg->rx_header, arg->rx_header_max)){
+
+            WIC_ERROR("rx_header is too small for handshake state")
+            return false;
+        }
+    }
+    else if(cb->on_rx_buffer == NULL){
+
+        if(!attach_rx_header(self, arg->rx, arg->rx_max)){
+
+            WIC_ERROR("rx is too small for handshake state (see WIC_RX_HANDSHAKE_SIZE)")
+            return false;
+        }
+    }
+    else if((self->hs == NULL) && (arg->rx_max < WIC_RX_HANDSHAKE_SIZE)){
+
+        WIC_ERROR("rx_max is too small for handshake state (see WIC_RX_HANDSHAKE_SIZE)")
+        return false;
+    }
+    /* a client needs the handshake state to start */
+    else if((self->role == WIC_ROLE_CLIENT) && (self->hs == NULL)){
+
+        if(!borrow_rx(self)){
+
+            WIC_ERROR("no rx buffer for handshake")
+            return false;
+        }
     }
+    else{
 
-    self->http.data = self;
+        /* borrowed when the handshake arrives */
+    }
 
     return true;
 }
@@ -277,7 +467,7 @@ const char *wic_get_url(const struct wic_inst *self)
 
 const char *wic_get_url_hostname(const struct wic_inst *self)
 {
-    return (self->url != NULL) ? self->hostname : NULL;
+    return ((self->url != NULL) && (self->hs != NULL)) ? self->hs->hostname : NULL;
 }
 
 uint16_t wic_get_status_code(const struct wic_inst *self)
@@ -287,17 +477,25 @@ uint16_t wic_get_status_code(const struct wic_inst *self)
 
 uint16_t wic_get_url_port(const struct wic_inst *self)
 {
-    return self->port;
+    struct http_parser_url u;
+    enum wic_schema schema;
+    uint16_t port;
+
+    return parse_url(self->url, &u, &schema, &port) ? port : 0U;
 }
 
 enum wic_schema wic_get_url_schema(const struct wic_inst *self)
 {
-    return self->schema;
+    struct http_parser_url u;
+    enum wic_schema schema;
+    uint16_t port;
+
+    return parse_url(self->url, &u, &schema, &port) ? schema : WIC_SCHEMA_WS;
 }
 
 const char *wic_get_redirect_url(const struct wic_inst *self)
 {
-    return self->redirect_url;
+    return (self->hs != NULL) ? self->hs->redirect_url : NULL;
 }
 
 enum wic_status wic_start(struct wic_inst *self)
@@ -327,16 +525,13 @@ void wic_close_with_reason(struct wic_inst *self, uint16_t code, const char *rea
     close_with_reason(self, code, reason, size, WIC_BUFFER_CLOSE);
 }
 
-enum wic_status wic_send_binary(struct wic_inst *self, bool fin, const void *data, uint16_t size)
+enum wic_status wic_send_binary(struct wic_inst *self, bool fin, const void *data, size_t size)
 {
     enum wic_status retval;
-    struct wic_stream tx;
 
     struct wic_tx_frame f = {
         .fin = fin,
-        .rsv1 = false,
-        .rsv2 = false,
-        .rsv3 = false,
+        .rsv = 0U,
         .opcode = WIC_OPCODE_BINARY,
         .size = size,
         .payload = data,
@@ -349,15 +544,7 @@ enum wic_status wic_send_binary(struct wic_inst *self, bool fin, const void *dat
         case WIC_OPCODE_CONTINUE:
         case WIC_OPCODE_BINARY:
 
-            f.opcode = (self->frag == WIC_OPCODE_BINARY) ? WIC_OPCODE_CONTINUE : f.opcode;
-
-            retval = stream_put_frame(self, &tx, init_mask(self, &f));
-
-            if(retval == WIC_STATUS_SUCCESS){
-
-                self->frag = fin ? WIC_OPCODE_CONTINUE : WIC_OPCODE_BINARY;
-                self->on_send(self, tx.read, tx.pos, WIC_BUFFER_USER);
-            }
+            retval = (tx_extension(self, f.opcode) != NULL) ? send_transformed(self, &f) : send_message(self, &f);
             break;
 
         default:
@@ -376,17 +563,15 @@ enum wic_status wic_send_binary(struct wic_inst *self, bool fin, const void *dat
     return retval;
 }
 
-enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data, uint16_t size)
+enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data, size_t size)
 {
     enum wic_status retval;
+    uint16_t start;
     uint16_t state;
-    struct wic_stream tx;
 
     struct wic_tx_frame f = {
         .fin = fin,
-        .rsv1 = false,
-        .rsv2 = false,
-        .rsv3 = false,
+        .rsv = 0U,
         .opcode = WIC_OPCODE_TEXT,
         .size = size,
         .payload = data,
@@ -399,9 +584,9 @@ enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data,
         case WIC_OPCODE_CONTINUE:
         case WIC_OPCODE_TEXT:
 
-            f.opcode = (self->frag == WIC_OPCODE_TEXT) ? WIC_OPCODE_CONTINUE : f.opcode;
+            start = (self->frag == WIC_OPCODE_CONTINUE) ? 0U : self->utf8_tx;
 
-            state = utf8_parse_string((self->frag == WIC_OPCODE_CONTINUE) ? 0U : self->utf8_tx, data, size);
+            state = utf8_parse_string(start, data, size);
 
             if(utf8_is_invalid(state)){
 
@@ -410,14 +595,10 @@ enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data,
             }
             else if(!fin || utf8_is_complete(state)){
 
-                retval = stream_put_frame(self, &tx, init_mask(self, &f));
-
-                if(retval == WIC_STATUS_SUCCESS){
+                retval = (tx_extension(self, f.opcode) != NULL) ? send_transformed(self, &f) : send_message(self, &f);
 
-                    self->utf8_tx = state;
-                    self->frag = fin ? WIC_OPCODE_CONTINUE : WIC_OPCODE_TEXT;
-                    self->on_send(self, tx.read, tx.pos, WIC_BUFFER_USER);
-                }
+                /* part of the message may already be sent */
+                self->utf8_tx = (retval == WIC_STATUS_SUCCESS) ? state : start;
             }
             else{
 
@@ -442,7 +623,7 @@ enum wic_status wic_send_text(struct wic_inst *self, bool fin, const char *data,
     return retval;
 }
 
-enum wic_status wic_send(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, uint16_t size)
+enum wic_status wic_send(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
     enum wic_status retval;
 
@@ -458,305 +639,316 @@ enum wic_status wic_send(struct wic_inst *self, enum wic_encoding encoding, bool
     return retval;
 }
 
-enum wic_status wic_send_ping(struct wic_inst *self)
-{
-    return wic_send_ping_with_payload(self, NULL, 0U);
-}
-
-enum wic_status wic_send_ping_with_payload(struct wic_inst *self, const void *data, uint16_t size)
+void *wic_send_reserve(struct wic_inst *self, enum wic_encoding encoding, size_t max_size)
 {
-    enum wic_status retval;
+    void *retval = NULL;
+    enum wic_opcode opcode = (encoding == WIC_ENCODING_BINARY) ? WIC_OPCODE_BINARY : WIC_OPCODE_TEXT;
+    size_t header;
     struct wic_stream tx;
 
-    struct wic_tx_frame f = {
-        .fin = true,
-        .rsv1 = false,
-        .rsv2 = false,
-        .rsv3 = false,
-        .opcode = WIC_OPCODE_PING,
-        .size = size,
-        .payload = data,
-        .type = WIC_BUFFER_PING
-    };
+    if(!allowed_to_send(self)){
 
-    if(allowed_to_send(self)){
+        WIC_ERROR("websocket is not open")
+    }
+    else if(self->reserve == NULL){
 
-        retval = stream_put_frame(self, &tx, init_mask(self, &f));
+        WIC_ERROR("wic_init_arg.reserve not set")
+    }
+    else if(self->reserve->buf != NULL){
 
-        if(retval == WIC_STATUS_SUCCESS){
+        WIC_ERROR("reservation already in progress")
+    }
+    else if((self->frag != WIC_OPCODE_CONTINUE) && (self->frag != opcode)){
 
-            self->on_send(self, tx.read, tx.pos, WIC_BUFFER_PING);
-        }
+        WIC_ERROR("fragmentation of other encoding already in progress")
+    }
+    else if(max_size > (SIZE_MAX - 14U)){
+
+        WIC_ERROR("message too large for buffer")
     }
     else{
 
-        WIC_ERROR("websocket is not open")
-        retval = WIC_STATUS_NOT_OPEN;
+        /* corked frames must go out ahead of this one */
+        flush_cork(self);
+
+        header = min_frame_size(opcode, (self->role == WIC_ROLE_CLIENT), max_size) - max_size;
+
+        if(get_buffer(self, &tx, header + max_size, WIC_BUFFER_USER) == WIC_STATUS_SUCCESS){
+
+            self->reserve->buf = tx.write;
+            self->reserve->header = header;
+            self->reserve->max = max_size;
+            self->reserve->opcode = opcode;
+
+            retval = &tx.write[header];
+        }
     }
 
     return retval;
 }
 
-size_t wic_parse(struct wic_inst *self, const void *data, size_t size)
+enum wic_status wic_send_commit(struct wic_inst *self, size_t size, bool fin)
 {
-    size_t bytes;
-    http_parser_settings settings;
-    struct wic_stream s;
-    bool blocked = false;
+    enum wic_status retval;
+    uint16_t state = 0U;
+    size_t header;
+    char *buf;
+    struct wic_stream tx;
 
-    stream_init_ro(&s, data, size);
+    struct wic_tx_frame f = {
+        .fin = fin,
+        .rsv = 0U,
+        .opcode = (self->reserve != NULL) ? self->reserve->opcode : WIC_OPCODE_BINARY,
+        .size = size,
+        .type = WIC_BUFFER_USER
+    };
 
-    if(self->state == WIC_STATE_PARSE_HANDSHAKE){
+    if(!reserve_held(self)){
 
-        http_parser_settings_init(&settings);
+        WIC_ERROR("nothing reserved")
+        retval = WIC_STATUS_BAD_STATE;
+    }
+    else if(!allowed_to_send(self)){
 
-        settings.on_header_field = on_header_field;
-        settings.on_header_value = on_header_value;
-        settings.on_message_complete = (self->role == WIC_ROLE_CLIENT) ? on_response_complete : on_request_complete;
+        WIC_ERROR("websocket is not open")
+        release_reserve(self);
+        retval = WIC_STATUS_NOT_OPEN;
+    }
+    else if(size > self->reserve->max){
 
-        bytes = http_parser_execute(&self->http, &settings, (char *)data, size);
+        WIC_ERROR("message larger than reservation")
+        release_reserve(self);
+        retval = WIC_STATUS_TOO_LARGE;
+    }
+    else{
 
-        (void)stream_seek(&s, bytes);
+        buf = self->reserve->buf;
 
-        if(self->http.http_errno != 0U){
+        if(f.opcode == WIC_OPCODE_TEXT){
 
-            WIC_ERROR("http parser reports error: (%u %s) %s", self->http.http_errno, http_errno_name(self->http.http_errno), http_errno_description(self->http.http_errno))
+            state = utf8_parse_string((self->frag == WIC_OPCODE_CONTINUE) ? 0U : self->utf8_tx, &buf[self->reserve->header], size);
+        }
 
-            if(self->on_close_transport != NULL){
+        if(utf8_is_invalid(state) || (fin && !utf8_is_complete(state))){
 
-                self->on_close_transport(self);
-            }
+            WIC_ERROR("payload is not UTF8")
+            release_reserve(self);
+            retval = WIC_STATUS_BAD_INPUT;
+        }
+        else if(tx_extension(self, f.opcode) != NULL){
 
-            if(self->on_handshake_failure != NULL){
+            /* transformed into other buffers so the reservation is only
+             * kept if the caller needs to try again */
+            f.payload = &buf[self->reserve->header];
 
-                if(self->http.http_errno == HPE_CB_message_complete){
+            retval = send_transformed(self, &f);
 
-                    self->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_UPGRADE);
-                }
-                else{
+            if((retval == WIC_STATUS_SUCCESS) && (self->reserve->opcode == WIC_OPCODE_TEXT)){
 
-                    self->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_PROTOCOL);
-                }
+                self->utf8_tx = state;
             }
 
-            self->state = WIC_STATE_CLOSED;
-        }
-        else if(self->state == WIC_STATE_READY){
-
-            if(self->on_open != NULL){
+            if(retval != WIC_STATUS_WOULD_BLOCK){
 
-                self->on_open(self);
+                release_reserve(self);
             }
-
-            self->state = WIC_STATE_OPEN;
         }
         else{
 
-            /* still parsing... */
-        }
-    }
+            f.opcode = (self->frag == f.opcode) ? WIC_OPCODE_CONTINUE : f.opcode;
 
-    /* parse websocket */
-    if(self->state == WIC_STATE_OPEN){
+            (void)init_mask(self, &f);
 
-        do{
-            switch(self->rx.state){
-            case WIC_RX_STATE_OPCODE:
+            header = min_frame_size(f.opcode, f.masked, size) - size;
 
-                blocked = parse_opcode(self, &s);
-                break;
+            /* length encoding is shorter than reserved */
+            if(header < self->reserve->header){
 
-            case WIC_RX_STATE_SIZE:
+                (void)memmove(&buf[header], &buf[self->reserve->header], size);
+            }
 
-                blocked = parse_size(self, &s);
-                break;
+            stream_init(&tx, buf, header + size);
 
-            case WIC_RX_STATE_SIZE_0:
-            case WIC_RX_STATE_SIZE_1:
-            case WIC_RX_STATE_SIZE_2:
-            case WIC_RX_STATE_SIZE_3:
-            case WIC_RX_STATE_SIZE_4:
-            case WIC_RX_STATE_SIZE_5:
-            case WIC_RX_STATE_SIZE_6:
-            case WIC_RX_STATE_SIZE_7:
-            case WIC_RX_STATE_SIZE_8:
-            case WIC_RX_STATE_SIZE_9:
+            stream_put_frame_header(&tx, &f, size);
 
-                blocked = parse_extended_size(self, &s);
-                break;
+            if(f.masked){
 
-            case WIC_RX_STATE_MASK_0:
-            case WIC_RX_STATE_MASK_1:
-            case WIC_RX_STATE_MASK_2:
-            case WIC_RX_STATE_MASK_3:
+                mask_copy(&buf[header], &buf[header], size, f.mask, 0U);
+            }
 
-                blocked = parse_mask(self, &s);
-                break;
+            if(self->reserve->opcode == WIC_OPCODE_TEXT){
 
-            default:
-                break;
+                self->utf8_tx = state;
             }
 
-            switch(self->rx.state){
-            case WIC_RX_STATE_DATA:
-
-                blocked = parse_data(self, &s);
-                break;
+            self->frag = fin ? WIC_OPCODE_CONTINUE : self->reserve->opcode;
+            self->reserve->buf = NULL;
+            self->cb->on_send(self, buf, header + size, WIC_BUFFER_USER);
 
-            default:
-                break;
-            }
+            retval = WIC_STATUS_SUCCESS;
         }
-        while(!blocked && (self->state == WIC_STATE_OPEN));
     }
 
-    /* consume all bytes if not open
-     * to clear buffers and so on */
-    return (self->state == WIC_STATE_OPEN) ? stream_pos(&s) : size;
+    return retval;
 }
 
-void *wic_get_app(struct wic_inst *self)
+void wic_send_abort(struct wic_inst *self)
 {
-    return self->app;
+    if(reserve_held(self)){
+
+        release_reserve(self);
+    }
 }
 
-const char *wic_get_header(const struct wic_inst *self, const char *name)
+void wic_cork(struct wic_inst *self)
 {
-    const char *retval = NULL;
-    size_t pos = 0U;
+    if(self->cork != NULL){
 
-    if(self->state == WIC_STATE_READY){
-
-        while(pos < self->rx.s.pos){
-
-            if(str_equal(&self->rx.s.read[pos], name)){
-
-                pos += strlen(&self->rx.s.read[pos]);
-                pos++;
-                retval = &self->rx.s.read[pos];
-                break;
-            }
-            else{
-
-                pos += strlen(&self->rx.s.read[pos]);
-                pos++;
+        self->cork->corked = true;
+    }
+}
 
-                WIC_ASSERT((self->rx.s.pos-pos) > 0U)
+void wic_uncork(struct wic_inst *self)
+{
+    if(self->cork != NULL){
 
-                pos += strlen(&self->rx.s.read[pos]);
-                pos++;
-            }
-        }
+        self->cork->corked = false;
     }
-    else{
 
-        WIC_DEBUG("headers not available in this state")
-    }
+    flush_cork(self);
+}
 
-    return retval;
+void wic_flush(struct wic_inst *self)
+{
+    flush_cork(self);
 }
 
-void wic_rewind_get_next_header(struct wic_inst *self)
+size_t wic_frame_size(size_t size)
 {
-    self->pos = 0U;
+    return min_frame_size(WIC_OPCODE_BINARY, false, size);
 }
 
-const char *wic_get_next_header(struct wic_inst *self, const char **name)
+enum wic_status wic_frame_prepare(struct wic_frame *frame, void *buf, size_t max, enum wic_encoding encoding, const void *data, size_t size)
 {
-    const char *retval = NULL;
+    enum wic_status retval;
+    struct wic_stream tx;
 
-    *name = NULL;
+    struct wic_tx_frame f = {
+        .fin = true,
+        .rsv = 0U,
+        .opcode = (encoding == WIC_ENCODING_BINARY) ? WIC_OPCODE_BINARY : WIC_OPCODE_TEXT,
+        .masked = false,
+        .size = size,
+        .payload = data,
+        .type = WIC_BUFFER_USER
+    };
+
+    if((encoding != WIC_ENCODING_BINARY) && !utf8_is_complete(utf8_parse_string(0U, data, size))){
 
-    if(self->pos < self->rx.s.pos){
+        WIC_ERROR("payload is not UTF8")
+        retval = WIC_STATUS_BAD_INPUT;
+    }
+    else if((size > (SIZE_MAX - 14U)) || (max < wic_frame_size(size))){
 
-        *name = &self->rx.s.read[self->pos];
+        WIC_ERROR("frame too large for buffer")
+        retval = WIC_STATUS_TOO_LARGE;
+    }
+    else{
 
-        self->pos += strlen(&self->rx.s.read[self->pos]);
-        self->pos++;
+        stream_init(&tx, buf, max);
 
-        WIC_ASSERT((self->rx.s.pos-self->pos) > 0U)
+        (void)stream_put_frame(&tx, &f);
 
-        retval = &self->rx.s.read[self->pos];
+        frame->refs = 1U;
+        frame->data = buf;
+        frame->size = tx.pos;
 
-        self->pos += strlen(&self->rx.s.read[self->pos]);
-        self->pos++;
+        retval = WIC_STATUS_SUCCESS;
     }
 
     return retval;
 }
 
-bool wic_set_header(struct wic_inst *self, struct wic_header *header)
+void wic_frame_ref(struct wic_frame *frame)
 {
-    bool retval = false;
+    frame->refs++;
+}
+
+void wic_frame_unref(struct wic_frame *frame)
+{
+    frame->refs--;
 
-    if((header->name != NULL) && (header->value != NULL)){
+    if((frame->refs == 0U) && (frame->release != NULL)){
 
-        header->next = self->tx_header;
-        self->tx_header = header;
-        retval = true;
+        frame->release(frame);
     }
-
-    return retval;
 }
 
-enum wic_state wic_get_state(const struct wic_inst *self)
+enum wic_status wic_send_frame(struct wic_inst *self, struct wic_frame *frame)
 {
-    return self->state;
-}
+    enum wic_status retval;
+    struct wic_stream tx;
 
-/* static functions ***************************************************/
+    if(!allowed_to_send(self)){
 
-static size_t min_frame_size(enum wic_opcode opcode, bool masked, uint16_t payload_size)
-{
-    size_t retval = payload_size;
+        WIC_ERROR("websocket is not open")
+        retval = WIC_STATUS_NOT_OPEN;
+    }
+    else if(self->role != WIC_ROLE_SERVER){
 
-    if(opcode == WIC_OPCODE_CLOSE){
+        WIC_ERROR("only servers send unmasked frames")
+        retval = WIC_STATUS_BAD_STATE;
+    }
+    else if((self->frag != WIC_OPCODE_CONTINUE) || (self->tx_offset > 0U) || reserve_held(self) || ((self->ext != NULL) && self->ext->tx_busy)){
 
-        /* close includes 2 byte code */
-        retval += 2U;
+        WIC_ERROR("another message is part way through being sent")
+        retval = WIC_STATUS_BAD_STATE;
     }
+    else{
 
-    if(retval > 125U){
+        /* corked frames must go out ahead of this one */
+        flush_cork(self);
 
-        /* size encoding up to 65535 bytes */
-        retval += 2UL;
-    }
+        if(self->cb->on_send_frame != NULL){
 
-    /* header */
-    retval += 2UL;
+            retval = self->cb->on_send_frame(self, frame) ? WIC_STATUS_SUCCESS : WIC_STATUS_WOULD_BLOCK;
+        }
+        else{
 
-    if(masked){
+            retval = get_buffer(self, &tx, frame->size, WIC_BUFFER_USER);
 
-        retval += 4UL;
+            if(retval == WIC_STATUS_SUCCESS){
+
+                (void)stream_write(&tx, frame->data, frame->size);
+                self->cb->on_send(self, tx.read, tx.pos, WIC_BUFFER_USER);
+            }
+        }
     }
 
     return retval;
 }
 
-static enum wic_status send_pong_with_payload(struct wic_inst *self, const void *data, uint16_t size)
+enum wic_status wic_send_ping(struct wic_inst *self)
+{
+    return wic_send_ping_with_payload(self, NULL, 0U);
+}
+
+enum wic_status wic_send_ping_with_payload(struct wic_inst *self, const void *data, uint16_t size)
 {
     enum wic_status retval;
-    struct wic_stream tx;
 
     struct wic_tx_frame f = {
         .fin = true,
-        .rsv1 = false,
-        .rsv2 = false,
-        .rsv3 = false,
-        .opcode = WIC_OPCODE_PONG,
+        .rsv = 0U,
+        .opcode = WIC_OPCODE_PING,
         .size = size,
         .payload = data,
-        .type = WIC_BUFFER_PONG
+        .type = WIC_BUFFER_PING
     };
 
     if(allowed_to_send(self)){
 
-        retval = stream_put_frame(self, &tx, init_mask(self, &f));
-
-        if(retval == WIC_STATUS_SUCCESS){
-
-            self->on_send(self, tx.read, tx.pos, f.type);
-        }
+        retval = send_frame(self, init_mask(self, &f));
     }
     else{
 
@@ -767,1049 +959,3191 @@ static enum wic_status send_pong_with_payload(struct wic_inst *self, const void
     return retval;
 }
 
-static void close_with_reason(struct wic_inst *self, uint16_t code, const char *reason, uint16_t size, enum wic_buffer type)
+size_t wic_parse(struct wic_inst *self, const void *data, size_t size)
 {
-    struct wic_stream tx;
-
-    struct wic_tx_frame f = {
-        .fin = true,
-        .rsv1 = false,
-        .rsv2 = false,
-        .rsv3 = false,
-        .opcode = WIC_OPCODE_CLOSE,
-        .payload = reason,
-        .code = code,
-        .size = size,
-        .type = type
-    };
-
-    switch(self->state){
-    case WIC_STATE_INIT:
-        self->state = WIC_STATE_CLOSED;
-        break;
-    case WIC_STATE_CLOSED:
-        break;
-    case WIC_STATE_PARSE_HANDSHAKE:
+    size_t bytes;
+    http_parser_settings settings;
+    struct wic_stream s;
+    bool blocked = false;
+    bool waiting = false;
+    enum http_errno error;
 
-        self->state = WIC_STATE_CLOSED;
+    stream_init_ro(&s, data, size);
 
-        if(self->on_close_transport != NULL){
+    if(self->state == WIC_STATE_PARSE_HANDSHAKE){
 
-            self->on_close_transport(self);
-        }
+        /* nowhere to put the handshake yet */
+        waiting = ((self->hs == NULL) || (self->hs->rx_header.write == NULL)) && !borrow_rx(self);
+    }
 
-        if(self->on_handshake_failure != NULL){
+    if((self->state == WIC_STATE_PARSE_HANDSHAKE) && !waiting){
 
-            switch(code){
-            case WIC_CLOSE_ABNORMAL_1:
-                self->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_ABNORMAL_1);
-                break;
-            case WIC_CLOSE_ABNORMAL_2:
-                self->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_ABNORMAL_2);
-                break;
-            case WIC_CLOSE_TLS:
-                self->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_TLS);
-                break;
-            default:
-                self->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_IRRELEVANT);
-                break;
-            }
-        }
-        break;
+        http_parser_settings_init(&settings);
 
-    case WIC_STATE_OPEN:
-    case WIC_STATE_READY:
+        settings.on_header_field = on_header_field;
+        settings.on_header_value = on_header_value;
+        settings.on_message_complete = (self->role == WIC_ROLE_CLIENT) ? on_response_complete : on_request_complete;
 
-        self->state = WIC_STATE_CLOSED;
+        bytes = http_parser_execute(&self->hs->http, &settings, (char *)data, size);
 
-        if(!utf8_is_complete(utf8_parse_string(0U, reason, size))){
+        (void)stream_seek(&s, bytes);
 
-            WIC_ERROR("reason string must be UTF8 (discarding)")
-            f.size = 0U;
-            f.payload = NULL;
-        }
+        error = (enum http_errno)self->hs->http.http_errno;
 
-        switch(code){
-        /* these are not written */
-        case WIC_CLOSE_ABNORMAL_1:
-        case WIC_CLOSE_ABNORMAL_2:
-        case WIC_CLOSE_TLS:
-            break;
-        default:
+        if(error != HPE_OK){
 
-            if(stream_put_frame(self, &tx, init_mask(self, &f)) == WIC_STATUS_SUCCESS){
+            WIC_ERROR("http parser reports error: (%u %s) %s", error, http_errno_name(error), http_errno_description(error))
 
-                self->on_send(self, tx.read, tx.pos, type);
-            }
-            break;
-        }
+            if(self->role == WIC_ROLE_SERVER){
 
-        if(self->on_close_transport != NULL){
+                if(self->status_code == 0U){
 
-            self->on_close_transport(self);
-        }
+                    self->status_code = 400U;
+                }
 
-        if(self->on_close != NULL){
+                reject_request(self);
+            }
 
-            self->on_close(self, code, reason, size);
-        }
-    }
-}
+            if(self->cb->on_close_transport != NULL){
 
-static bool allowed_to_send(struct wic_inst *self)
-{
-    if((self->role == WIC_ROLE_CLIENT) && (self->state == WIC_STATE_READY)){
+                self->cb->on_close_transport(self);
+            }
 
-        self->state = WIC_STATE_OPEN;
-    }
+            if(self->cb->on_handshake_failure != NULL){
 
-    return (self->state == WIC_STATE_OPEN);
-}
+                if(error == HPE_CB_message_complete){
 
-static bool parse_opcode(struct wic_inst *self, struct wic_stream *s)
-{
-    uint8_t b;
-    bool blocked = false;
+                    self->cb->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_UPGRADE);
+                }
+                else{
 
-    if(stream_get_u8(s, &b)){
+                    self->cb->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_PROTOCOL);
+                }
+            }
 
-        stream_rewind(&self->rx.s);
+            self->state = WIC_STATE_CLOSED;
+        }
+        else if(self->state == WIC_STATE_READY){
 
-        self->rx.fin = ((b & 0x80U) != 0U);
-        self->rx.rsv1 = ((b & 0x40U) != 0U);
-        self->rx.rsv2 = ((b & 0x20U) != 0U);
-        self->rx.rsv3 = ((b & 0x10U) != 0U);
+            if(self->cb->on_open != NULL){
 
-        self->rx.utf8 = 0U;
+                self->cb->on_open(self);
+            }
 
-        /* no extensions atm so these must be 0 */
-        if(self->rx.rsv1 || self->rx.rsv2 || self->rx.rsv3){
+            /* a server opens once wic_start() has sent the response */
+            if((self->role == WIC_ROLE_CLIENT) && (self->state == WIC_STATE_READY)){
 
-            close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+                set_open(self);
+            }
         }
         else{
 
-            self->rx.opcode = byte_to_opcode(b);
+            /* still parsing... */
+        }
+    }
+
+    /* parse websocket */
+    if(self->state == WIC_STATE_OPEN){
 
-            /* filter opcodes */
-            switch(self->rx.opcode){
-            case WIC_OPCODE_CLOSE:
-            case WIC_OPCODE_PING:
-            case WIC_OPCODE_PONG:
+        do{
+            switch(self->rx.state){
+            case WIC_RX_STATE_OPCODE:
 
-                /* close, ping, and pong must be final */
-                if(!self->rx.fin){
+                /* decode the header in one go if it is all here,
+                 * otherwise fall back to one byte at a time */
+                if(!parse_header(self, &s)){
 
-                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+                    blocked = parse_opcode(self, &s);
                 }
                 break;
 
-            case WIC_OPCODE_CONTINUE:
+            case WIC_RX_STATE_SIZE:
 
-                /* continue must follow a non-final text/binary */
-                if(self->rx.frag == WIC_OPCODE_CONTINUE){
+                blocked = parse_size(self, &s);
+                break;
 
-                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
-                }
-                else{
+            case WIC_RX_STATE_SIZE_0:
+            case WIC_RX_STATE_SIZE_1:
+            case WIC_RX_STATE_SIZE_2:
+            case WIC_RX_STATE_SIZE_3:
+            case WIC_RX_STATE_SIZE_4:
+            case WIC_RX_STATE_SIZE_5:
+            case WIC_RX_STATE_SIZE_6:
+            case WIC_RX_STATE_SIZE_7:
+            case WIC_RX_STATE_SIZE_8:
+            case WIC_RX_STATE_SIZE_9:
 
-                    self->rx.utf8 = self->utf8_rx;
-                }
+                blocked = parse_extended_size(self, &s);
                 break;
 
-            case WIC_OPCODE_TEXT:
-            case WIC_OPCODE_BINARY:
-
-                /* interrupting fragmentation */
-                if(self->rx.frag != WIC_OPCODE_CONTINUE){
+            case WIC_RX_STATE_MASK_0:
+            case WIC_RX_STATE_MASK_1:
+            case WIC_RX_STATE_MASK_2:
+            case WIC_RX_STATE_MASK_3:
 
-                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
-                }
+                blocked = parse_mask(self, &s);
                 break;
 
             default:
-                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
                 break;
             }
 
-            self->rx.state = WIC_RX_STATE_SIZE;
+            switch(self->rx.state){
+            case WIC_RX_STATE_DATA:
+
+                blocked = parse_data(self, &s);
+                break;
+
+            default:
+                break;
+            }
         }
+        while(!blocked && (self->state == WIC_STATE_OPEN));
+    }
+
+    /* nothing is buffered between frames */
+    if((self->state == WIC_STATE_CLOSED) || ((self->state == WIC_STATE_OPEN) && (self->rx.state == WIC_RX_STATE_OPCODE))){
+
+        release_rx(self);
     }
+
+    if(waiting){
+
+        bytes = 0U;
+    }
+    /* consume all bytes if not open
+     * to clear buffers and so on */
     else{
 
-        blocked = true;
+        bytes = (self->state == WIC_STATE_OPEN) ? stream_pos(&s) : size;
     }
 
-    return blocked;
+    return bytes;
 }
 
-static bool parse_size(struct wic_inst *self, struct wic_stream *s)
+void *wic_get_app(struct wic_inst *self)
 {
-    bool blocked = false;
-    uint8_t b;
+    return self->app;
+}
 
-    if(stream_get_u8(s, &b)){
+const char *wic_get_header(const struct wic_inst *self, const char *name)
+{
+    const char *retval = NULL;
+    size_t pos = 0U;
 
-        self->rx.masked = ((b & 0x80U) != 0U);
-        self->rx.size = b & 0x7fU;
+    if(header_available(self)){
 
-        switch(self->rx.opcode){
-        case WIC_OPCODE_CLOSE:
+        if(!self->hs->header_index_full){
 
-            if((self->rx.size > 125U) || (self->rx.size == 1U)){
+            retval = find_header(self, name);
+        }
+        else{
 
-                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
-            }
-            else{
-
-                if(self->rx.size == 0U){
+            /* too many fields for the index */
+            while(pos < self->hs->rx_header.pos){
 
-                    close_with_reason(self, WIC_CLOSE_NORMAL, NULL, 0U, WIC_BUFFER_CLOSE);
-                }
-                else if(self->rx.size > stream_max(&self->rx.s)){
+                if(str_equal(&self->hs->rx_header.read[pos], name)){
 
-                    close_with_reason(self, WIC_CLOSE_TOO_BIG, NULL, 0U, WIC_BUFFER_CLOSE);
+                    pos += strlen(&self->hs->rx_header.read[pos]);
+                    pos++;
+                    retval = &self->hs->rx_header.read[pos];
+                    break;
                 }
                 else{
 
-                    /* nothing */
+                    pos += strlen(&self->hs->rx_header.read[pos]);
+                    pos++;
+
+                    WIC_ASSERT((self->hs->rx_header.pos-pos) > 0U)
+
+                    pos += strlen(&self->hs->rx_header.read[pos]);
+                    pos++;
                 }
             }
-            break;
+        }
+    }
+    else{
 
-        case WIC_OPCODE_PING:
-        case WIC_OPCODE_PONG:
+        WIC_DEBUG("headers not available in this state")
+    }
 
-            if(self->rx.size > 125U){
+    return retval;
+}
 
-                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
-            }
-            else if(self->rx.size > stream_max(&self->rx.s)){
+void wic_rewind_get_next_header(struct wic_inst *self)
+{
+    if(self->hs != NULL){
 
-                close_with_reason(self, WIC_CLOSE_TOO_BIG, NULL, 0U, WIC_BUFFER_CLOSE);
-            }
-            else{
+        self->hs->pos = 0U;
+    }
+}
 
-                /* nothing */
-            }
-            break;
+const char *wic_get_next_header(struct wic_inst *self, const char **name)
+{
+    const char *retval = NULL;
 
-        default:
-            break;
-        }
+    *name = NULL;
 
-        switch(self->rx.size){
-        case 127U:
-            self->rx.state = WIC_RX_STATE_SIZE_2;
-            self->rx.size = 0U;
-            break;
-        case 126U:
-            self->rx.state = WIC_RX_STATE_SIZE_0;
-            self->rx.size = 0U;
-            break;
-        default:
-            self->rx.state = self->rx.masked ? WIC_RX_STATE_MASK_0 : WIC_RX_STATE_DATA;
-            break;
-        }
+    if(header_available(self) && (self->hs->pos < self->hs->rx_header.pos)){
+
+        *name = &self->hs->rx_header.read[self->hs->pos];
+
+        self->hs->pos += strlen(&self->hs->rx_header.read[self->hs->pos]);
+        self->hs->pos++;
+
+        WIC_ASSERT((self->hs->rx_header.pos-self->hs->pos) > 0U)
+
+        retval = &self->hs->rx_header.read[self->hs->pos];
+
+        self->hs->pos += strlen(&self->hs->rx_header.read[self->hs->pos]);
+        self->hs->pos++;
     }
-    else{
 
-        blocked = true;
+    return retval;
+}
+
+bool wic_set_header(struct wic_inst *self, struct wic_header *header)
+{
+    bool retval = false;
+
+    if(self->hs == NULL){
+
+        WIC_ERROR("handshake is over")
     }
+    else if((header->name != NULL) && (header->value != NULL)){
 
-    return blocked;
+        header->next = self->hs->tx_header;
+        self->hs->tx_header = header;
+        retval = true;
+    }
+
+    return retval;
 }
 
-static bool parse_extended_size(struct wic_inst *self, struct wic_stream *s)
+enum wic_state wic_get_state(const struct wic_inst *self)
 {
-    uint8_t b;
-    bool blocked = false;
+    return self->state;
+}
 
-    if(stream_get_u8(s, &b)){
+/* static functions ***************************************************/
 
-        self->rx.size <<= 8;
-        self->rx.size |= b;
+static size_t min_frame_size(enum wic_opcode opcode, bool masked, size_t payload_size)
+{
+    size_t retval = payload_size;
 
-        switch(self->rx.state){
-        default:
-        case WIC_RX_STATE_SIZE_0:
-            self->rx.state = WIC_RX_STATE_SIZE_1;
-            break;
-        case WIC_RX_STATE_SIZE_2:
-            self->rx.state = WIC_RX_STATE_SIZE_3;
-            break;
-        case WIC_RX_STATE_SIZE_3:
-            self->rx.state = WIC_RX_STATE_SIZE_4;
-            break;
-        case WIC_RX_STATE_SIZE_4:
-            self->rx.state = WIC_RX_STATE_SIZE_5;
-            break;
-        case WIC_RX_STATE_SIZE_5:
-            self->rx.state = WIC_RX_STATE_SIZE_6;
-            break;
-        case WIC_RX_STATE_SIZE_6:
-            self->rx.state = WIC_RX_STATE_SIZE_7;
-            break;
-        case WIC_RX_STATE_SIZE_7:
-            self->rx.state = WIC_RX_STATE_SIZE_8;
-            break;
-        case WIC_RX_STATE_SIZE_8:
-            self->rx.state = WIC_RX_STATE_SIZE_9;
-            break;
-        case WIC_RX_STATE_SIZE_1:
-        case WIC_RX_STATE_SIZE_9:
-            self->rx.state = self->rx.masked ? WIC_RX_STATE_MASK_0 : WIC_RX_STATE_DATA;
-            break;
-        }
+    if(opcode == WIC_OPCODE_CLOSE){
+
+        /* close includes 2 byte code */
+        retval += 2U;
     }
-    else{
 
-        blocked = true;
+    if(retval > UINT16_MAX){
+
+        /* size encoding up to 2^63 bytes */
+        retval += 8UL;
     }
+    else if(retval > 125U){
 
-    return blocked;
+        /* size encoding up to 65535 bytes */
+        retval += 2UL;
+    }
+
+    /* header */
+    retval += 2UL;
+
+    if(masked){
+
+        retval += 4UL;
+    }
+
+    return retval;
 }
 
-static bool parse_mask(struct wic_inst *self, struct wic_stream *s)
+static enum wic_status send_pong_with_payload(struct wic_inst *self, const void *data, uint16_t size)
 {
-    bool blocked;
-    uint8_t b;
+    enum wic_status retval;
 
-    if(stream_get_u8(s, &b)){
+    struct wic_tx_frame f = {
+        .fin = true,
+        .rsv = 0U,
+        .opcode = WIC_OPCODE_PONG,
+        .size = size,
+        .payload = data,
+        .type = WIC_BUFFER_PONG
+    };
 
-        self->rx.mask[self->rx.state - WIC_RX_STATE_MASK_0] = b;
+    if(allowed_to_send(self)){
 
-        switch(self->rx.state){
-        default:
-        case WIC_RX_STATE_MASK_0:
-            self->rx.state = WIC_RX_STATE_MASK_1;
-            break;
-        case WIC_RX_STATE_MASK_1:
-            self->rx.state = WIC_RX_STATE_MASK_2;
-            break;
-        case WIC_RX_STATE_MASK_2:
-            self->rx.state = WIC_RX_STATE_MASK_3;
-            break;
-        case WIC_RX_STATE_MASK_3:
-            self->rx.state = WIC_RX_STATE_DATA;
-            break;
-        }
+        retval = send_frame(self, init_mask(self, &f));
     }
     else{
 
-        blocked = true;
+        WIC_ERROR("websocket is not open")
+        retval = WIC_STATUS_NOT_OPEN;
     }
 
-    return blocked;
+    return retval;
 }
 
-static bool parse_data(struct wic_inst *self, struct wic_stream *s)
+static void close_with_reason(struct wic_inst *self, uint16_t code, const char *reason, uint16_t size, enum wic_buffer type)
 {
-    uint16_t code;
-    uint8_t b;
-    bool blocked = false;
+    struct wic_tx_frame f = {
+        .fin = true,
+        .rsv = 0U,
+        .opcode = WIC_OPCODE_CLOSE,
+        .payload = reason,
+        .code = code,
+        .size = size,
+        .type = type
+    };
 
-    /* if still receiving data part */
-    if(self->rx.size > 0U){
+    /* a server that hasn't sent the handshake response can only refuse */
+    bool refuse = (self->role == WIC_ROLE_SERVER) && (self->state == WIC_STATE_READY);
 
-        /* no more space in rx buffer and so pass to the user as a fragment */
-        if(stream_eof(&self->rx.s)){
+    switch(self->state){
+    case WIC_STATE_INIT:
+        self->state = WIC_STATE_CLOSED;
+        break;
+    case WIC_STATE_CLOSED:
+        break;
+    case WIC_STATE_PARSE_HANDSHAKE:
 
-            switch((self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode){
-            case WIC_OPCODE_TEXT:
-                blocked = !self->on_message(self, WIC_ENCODING_UTF8, false, self->rx.s.read, self->rx.s.pos);
+        self->state = WIC_STATE_CLOSED;
+
+        if(self->cb->on_close_transport != NULL){
+
+            self->cb->on_close_transport(self);
+        }
+
+        if(self->cb->on_handshake_failure != NULL){
+
+            switch(code){
+            case WIC_CLOSE_ABNORMAL_1:
+                self->cb->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_ABNORMAL_1);
                 break;
-            case WIC_OPCODE_BINARY:
-                blocked = !self->on_message(self, WIC_ENCODING_BINARY, false, self->rx.s.read, self->rx.s.pos);
+            case WIC_CLOSE_ABNORMAL_2:
+                self->cb->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_ABNORMAL_2);
+                break;
+            case WIC_CLOSE_TLS:
+                self->cb->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_TLS);
                 break;
             default:
+                self->cb->on_handshake_failure(self, WIC_HANDSHAKE_FAILURE_IRRELEVANT);
                 break;
             }
+        }
+        break;
 
-            if(!blocked){
+    case WIC_STATE_OPEN:
+    case WIC_STATE_READY:
 
-                stream_rewind(&self->rx.s);
-            }
+        if(reserve_held(self)){
+
+            release_reserve(self);
         }
-        else{
 
-            if(stream_get_u8(s, &b)){
+        if(self->cork != NULL){
 
-                self->rx.size--;
+            self->cork->corked = false;
+        }
 
-                if(self->rx.masked){
+        flush_cork(self);
 
-                    stream_put_u8_masked(&self->rx.s, b, self->rx.mask, &b);
-                }
-                else{
+        self->state = WIC_STATE_CLOSED;
 
-                    stream_put_u8(&self->rx.s, b);
-                }
+        if(!utf8_is_complete(utf8_parse_string(0U, reason, size))){
 
-                switch((self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode){
-                case WIC_OPCODE_TEXT:
+            WIC_ERROR("reason string must be UTF8 (discarding)")
+            f.size = 0U;
+            f.payload = NULL;
+        }
 
-                    self->rx.utf8 = utf8_parse(self->rx.utf8, (char)b);
+        switch(code){
+        /* these are not written */
+        case WIC_CLOSE_ABNORMAL_1:
+        case WIC_CLOSE_ABNORMAL_2:
+        case WIC_CLOSE_TLS:
+            break;
+        default:
 
-                    if(utf8_is_invalid(self->rx.utf8)){
+            if(refuse){
 
-                        close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
-                    }
-                    break;
+                self->status_code = 403U;
+                reject_request(self);
+            }
+            else{
 
-                case WIC_OPCODE_CLOSE:
+                (void)send_frame(self, init_mask(self, &f));
+            }
+            break;
+        }
+
+        if(self->cb->on_close_transport != NULL){
 
-                    if(stream_pos(&self->rx.s) > 2U){
+            self->cb->on_close_transport(self);
+        }
 
-                        self->rx.utf8 = utf8_parse(self->rx.utf8, (char)b);
+        if(self->cb->on_close != NULL){
 
-                        if(utf8_is_invalid(self->rx.utf8)){
+            self->cb->on_close(self, code, reason, size);
+        }
+    }
+
+    /* nothing received is needed any more */
+    if(self->state == WIC_STATE_CLOSED){
+
+        release_rx(self);
+    }
+}
+
+static bool allowed_to_send(struct wic_inst *self)
+{
+    if((self->role == WIC_ROLE_CLIENT) && (self->state == WIC_STATE_READY)){
+
+        set_open(self);
+    }
+
+    return (self->state == WIC_STATE_OPEN);
+}
+
+static enum wic_status send_frame(struct wic_inst *self, const struct wic_tx_frame *f)
+{
+    enum wic_status retval;
+    struct wic_stream tx;
+    uint8_t header[14U];
+    struct wic_iovec iov[2U];
+
+    if((self->cork != NULL) && self->cork->corked && (f->type == WIC_BUFFER_USER)){
+
+        retval = cork_frame(self, f);
+    }
+    else if((self->cb->on_sendv != NULL) && !f->masked && (f->type == WIC_BUFFER_USER)){
+
+        /* header and payload go to transport as they are */
+        stream_init(&tx, header, sizeof(header));
+
+        stream_put_frame_header(&tx, f, f->size);
+
+        iov[0].data = tx.read;
+        iov[0].size = tx.pos;
+        iov[1].data = f->payload;
+        iov[1].size = f->size;
+
+        retval = self->cb->on_sendv(self, iov, (f->size > 0U) ? 2U : 1U, f->type) ? WIC_STATUS_SUCCESS : WIC_STATUS_WOULD_BLOCK;
+    }
+    else{
+
+        /* anything corked goes ahead of control frames */
+        flush_cork(self);
+
+        retval = get_buffer(self, &tx, min_frame_size(f->opcode, f->masked, f->size), f->type);
+
+        if(retval == WIC_STATUS_SUCCESS){
+
+            (void)stream_put_frame(&tx, f);
+            self->cb->on_send(self, tx.read, tx.pos, f->type);
+        }
+    }
+
+    return retval;
+}
+
+static enum wic_status send_message(struct wic_inst *self, const struct wic_tx_frame *msg)
+{
+    enum wic_status retval;
+    struct wic_tx_frame f = *msg;
+    const char *payload = msg->payload;
+    size_t size;
+
+    if(self->tx_offset > msg->size){
+
+        WIC_ERROR("message interrupted by WIC_STATUS_WOULD_BLOCK must be sent again")
+        return WIC_STATUS_BAD_STATE;
+    }
+
+    /* tx_offset is non-zero if this message was interrupted by
+     * WIC_STATUS_WOULD_BLOCK part way through */
+    do{
+
+        f.opcode = (self->frag == msg->opcode) ? WIC_OPCODE_CONTINUE : msg->opcode;
+        f.rsv = (f.opcode != WIC_OPCODE_CONTINUE) ? msg->rsv : 0U;
+        f.fin = msg->fin;
+        f.payload = &payload[self->tx_offset];
+        f.size = msg->size - self->tx_offset;
+
+        (void)init_mask(self, &f);
+
+        size = max_payload_size(f.masked, self->tx_max);
+
+        /* split to fit the largest buffer seen so far */
+        if((size > 0U) && (f.size > size)){
+
+            f.size = size;
+            f.fin = false;
+        }
+
+        retval = send_frame(self, &f);
+
+        /* try again if the buffer has shrunk */
+        if(retval == WIC_STATUS_TOO_LARGE){
+
+            size = max_payload_size(f.masked, self->tx_max);
+
+            if((size > 0U) && (f.size > size)){
+
+                f.size = size;
+                f.fin = false;
+
+                retval = send_frame(self, &f);
+            }
+        }
+
+        if(retval == WIC_STATUS_SUCCESS){
+
+            self->tx_offset += f.size;
+            self->frag = f.fin ? WIC_OPCODE_CONTINUE : msg->opcode;
+        }
+    }
+    while((retval == WIC_STATUS_SUCCESS) && (self->tx_offset < msg->size));
+
+    if(retval == WIC_STATUS_SUCCESS){
+
+        self->tx_offset = 0U;
+    }
+
+    return retval;
+}
+
+/* choose the extension (if any) to transform a message being sent
+ *
+ * The choice is made at the start of each message and kept until the
+ * final fragment has been sent.
+ *
+ * */
+static const struct wic_extension *tx_extension(struct wic_inst *self, enum wic_opcode opcode)
+{
+    const struct wic_extension *retval = NULL;
+    const struct wic_extension *ext;
+    enum wic_encoding encoding = (opcode == WIC_OPCODE_TEXT) ? WIC_ENCODING_UTF8 : WIC_ENCODING_BINARY;
+    size_t i;
+
+    if(self->ext != NULL){
+
+        if((self->frag == WIC_OPCODE_CONTINUE) && !self->ext->tx_busy){
+
+            self->ext->tx = NULL;
+
+            for(i=0U; i < extension_count(self); i++){
+
+                ext = get_extension(self, i);
+
+                if(((self->ext->active & (1U << i)) != 0U) && (ext->tx != NULL) && ((ext->select == NULL) || ext->select(self, encoding))){
+
+                    self->ext->tx = ext;
+                    break;
+                }
+            }
+        }
+
+        retval = self->ext->tx;
+    }
+
+    return retval;
+}
+
+/* extension transforming the message being received (if any) */
+static const struct wic_extension *rx_extension(const struct wic_inst *self)
+{
+    return (self->ext != NULL) ? self->ext->rx : NULL;
+}
+
+/* transform a message and send the output with send_message()
+ *
+ * Like send_message() this must be called again with the same arguments
+ * after WIC_STATUS_WOULD_BLOCK.
+ *
+ * */
+static enum wic_status send_transformed(struct wic_inst *self, const struct wic_tx_frame *msg)
+{
+    enum wic_status retval = WIC_STATUS_SUCCESS;
+    enum wic_ext_status status = WIC_EXT_OK;
+    const struct wic_ext_transform *tx = self->ext->tx->tx;
+    struct wic_tx_frame f = *msg;
+    const char *payload = msg->payload;
+    size_t size;
+    size_t pending;
+    size_t used;
+    bool sent_fin = false;
+
+    /* send_message() only sets RSV on the first frame */
+    f.rsv = self->ext->tx->rsv;
+
+    self->ext->tx_busy = true;
+
+    do{
+
+        if(self->ext->tx_in < msg->size){
+
+            status = tx->write(self, &payload[self->ext->tx_in], msg->size - self->ext->tx_in, &used);
+            self->ext->tx_in += used;
+        }
+        else if(!self->ext->tx_ended){
+
+            status = tx->end(self, msg->fin);
+            self->ext->tx_ended = (status == WIC_EXT_OK);
+        }
+        else{
+
+            /* only output left to send */
+        }
+
+        if(status == WIC_EXT_ERROR){
+
+            WIC_ERROR("extension could not transform message")
+            retval = WIC_STATUS_BAD_INPUT;
+            size = 0U;
+        }
+        else{
+
+            f.payload = tx->output(self, &size, &pending);
+            f.size = size;
+            f.fin = msg->fin && self->ext->tx_ended && (size == pending);
+
+            if(size > 0U){
+
+                retval = send_message(self, &f);
+
+                if(retval == WIC_STATUS_SUCCESS){
+
+                    tx->consume(self, size);
+                    sent_fin = f.fin;
+                }
+            }
+        }
+    }
+    while((retval == WIC_STATUS_SUCCESS) && ((size > 0U) || !self->ext->tx_ended));
+
+    /* the transform had nothing left to send at the end of the message */
+    if((retval == WIC_STATUS_SUCCESS) && msg->fin && !sent_fin){
+
+        f.payload = payload;
+        f.size = 0U;
+        f.fin = true;
+
+        retval = send_message(self, &f);
+    }
+
+    if(retval == WIC_STATUS_SUCCESS){
+
+        self->ext->tx_in = 0U;
+        self->ext->tx_ended = false;
+        self->ext->tx_busy = !msg->fin;
+    }
+
+    return retval;
+}
+
+static size_t max_payload_size(bool masked, size_t frame_size)
+{
+    size_t retval = 0U;
+    size_t header = masked ? 6U : 2U;
+
+    if(frame_size > header){
+
+        retval = frame_size - header;
+
+        /* longer payloads need a longer size encoding */
+        if(retval > 125U){
+
+            retval = ((retval - 2U) > 125U) ? (retval - 2U) : 125U;
+
+            if(retval > UINT16_MAX){
+
+                retval = ((retval - 6U) > UINT16_MAX) ? (retval - 6U) : UINT16_MAX;
+            }
+        }
+    }
+
+    return retval;
+}
+
+static bool reserve_held(const struct wic_inst *self)
+{
+    return (self->reserve != NULL) && (self->reserve->buf != NULL);
+}
+
+static void release_reserve(struct wic_inst *self)
+{
+    char *buf = self->reserve->buf;
+
+    self->reserve->buf = NULL;
+    self->cb->on_send(self, buf, 0U, WIC_BUFFER_USER);
+}
+
+static enum wic_status cork_frame(struct wic_inst *self, const struct wic_tx_frame *f)
+{
+    enum wic_status retval = WIC_STATUS_SUCCESS;
+    size_t frame_size = min_frame_size(f->opcode, f->masked, f->size);
+
+    if((self->cork->s.write != NULL) && (stream_remaining(&self->cork->s) < frame_size)){
+
+        flush_cork(self);
+    }
+
+    if(self->cork->s.write == NULL){
+
+        retval = get_buffer(self, &self->cork->s, frame_size, WIC_BUFFER_USER);
+    }
+
+    if(retval == WIC_STATUS_SUCCESS){
+
+        (void)stream_put_frame(&self->cork->s, f);
+    }
+
+    return retval;
+}
+
+static void flush_cork(struct wic_inst *self)
+{
+    struct wic_stream tx;
+
+    if((self->cork != NULL) && (self->cork->s.write != NULL)){
+
+        tx = self->cork->s;
+
+        stream_init(&self->cork->s, NULL, 0U);
+        self->cb->on_send(self, tx.read, tx.pos, WIC_BUFFER_USER);
+    }
+}
+
+static bool parse_header(struct wic_inst *self, struct wic_stream *s)
+{
+    const uint8_t *ptr = (const uint8_t *)&s->read[stream_pos(s)];
+    size_t size = stream_remaining(s);
+    size_t len = 2U;
+    size_t pos = 2U;
+    bool retval = false;
+
+    if(size >= len){
+
+        switch(ptr[1] & 0x7fU){
+        case 127U:
+            len += 8U;
+            break;
+        case 126U:
+            len += 2U;
+            break;
+        default:
+            break;
+        }
+
+        if((ptr[1] & 0x80U) != 0U){
+
+            len += sizeof(self->rx.mask);
+        }
+
+        if(size >= len){
+
+            (void)stream_seek(s, stream_pos(s) + len);
+
+            decode_opcode(self, ptr[0]);
+
+            if(self->state == WIC_STATE_OPEN){
+
+                decode_size(self, ptr[1]);
+            }
+
+            if(self->state == WIC_STATE_OPEN){
+
+                switch(self->rx.state){
+                case WIC_RX_STATE_SIZE_0:
+
+                    for(; pos < 4U; pos++){
+
+                        self->rx.size <<= 8;
+                        self->rx.size |= ptr[pos];
+                    }
+                    break;
+
+                case WIC_RX_STATE_SIZE_2:
+
+                    for(; pos < 10U; pos++){
+
+                        self->rx.size <<= 8;
+                        self->rx.size |= ptr[pos];
+                    }
+                    break;
+
+                default:
+                    break;
+                }
+
+                if(self->rx.masked){
+
+                    (void)memcpy(self->rx.mask, &ptr[pos], sizeof(self->rx.mask));
+                }
+
+                self->rx.state = WIC_RX_STATE_DATA;
+            }
+
+            retval = true;
+        }
+    }
+
+    return retval;
+}
+
+static bool parse_opcode(struct wic_inst *self, struct wic_stream *s)
+{
+    uint8_t b;
+    bool blocked = false;
+
+    if(stream_get_u8(s, &b)){
+
+        decode_opcode(self, b);
+    }
+    else{
+
+        blocked = true;
+    }
+
+    return blocked;
+}
+
+static bool parse_size(struct wic_inst *self, struct wic_stream *s)
+{
+    bool blocked = false;
+    uint8_t b;
+
+    if(stream_get_u8(s, &b)){
+
+        decode_size(self, b);
+    }
+    else{
+
+        blocked = true;
+    }
+
+    return blocked;
+}
+
+static void decode_opcode(struct wic_inst *self, uint8_t b)
+{
+    const struct wic_extension *ext = NULL;
+
+    stream_rewind(&self->rx.s);
+
+    self->rx.fin = ((b & 0x80U) != 0U);
+    self->rx.rsv = b & (WIC_RSV1 | WIC_RSV2 | WIC_RSV3);
+
+    self->rx.utf8 = 0U;
+    self->rx.pos = 0U;
+
+    self->rx.opcode = byte_to_opcode(b);
+
+    /* RSV bits mark the first frame of a message transformed by the
+     * extension that claimed them */
+    if((self->rx.rsv != 0U) && ((self->rx.opcode == WIC_OPCODE_TEXT) || (self->rx.opcode == WIC_OPCODE_BINARY))){
+
+        ext = rsv_extension(self, self->rx.rsv);
+    }
+
+    if((self->rx.rsv != 0U) && (ext == NULL)){
+
+        close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+    }
+    else{
+
+        /* filter opcodes */
+        switch(self->rx.opcode){
+        case WIC_OPCODE_CLOSE:
+        case WIC_OPCODE_PING:
+        case WIC_OPCODE_PONG:
+
+            /* close, ping, and pong must be final */
+            if(!self->rx.fin){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            break;
+
+        case WIC_OPCODE_CONTINUE:
+
+            /* continue must follow a non-final text/binary */
+            if(self->rx.frag == WIC_OPCODE_CONTINUE){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else{
+
+                self->rx.utf8 = self->utf8_rx;
+            }
+            break;
+
+        case WIC_OPCODE_TEXT:
+        case WIC_OPCODE_BINARY:
+
+            /* interrupting fragmentation */
+            if(self->rx.frag != WIC_OPCODE_CONTINUE){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else if(self->ext != NULL){
+
+                self->ext->rx = ((ext != NULL) && (ext->rx != NULL)) ? ext : NULL;
+            }
+            else{
+
+                /* no extensions */
+            }
+            break;
+
+        default:
+            close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            break;
+        }
+
+        self->rx.state = WIC_RX_STATE_SIZE;
+    }
+}
+
+static void decode_size(struct wic_inst *self, uint8_t b)
+{
+    self->rx.masked = ((b & 0x80U) != 0U);
+    self->rx.size = b & 0x7fU;
+
+    /* clients must mask and servers must not */
+    if(self->rx.masked != (self->role == WIC_ROLE_SERVER)){
+
+        close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+    }
+    else{
+
+        switch(self->rx.opcode){
+        case WIC_OPCODE_CLOSE:
+
+            if((self->rx.size > 125U) || (self->rx.size == 1U)){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else{
+
+                if(self->rx.size == 0U){
+
+                    close_with_reason(self, WIC_CLOSE_NORMAL, NULL, 0U, WIC_BUFFER_CLOSE);
+                }
+                else if(self->rx.size > stream_max(&self->rx.s)){
+
+                    close_with_reason(self, WIC_CLOSE_TOO_BIG, NULL, 0U, WIC_BUFFER_CLOSE);
+                }
+                else{
+
+                    /* nothing */
+                }
+            }
+            break;
+
+        case WIC_OPCODE_PING:
+        case WIC_OPCODE_PONG:
+
+            if(self->rx.size > 125U){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else if(self->rx.size > stream_max(&self->rx.s)){
+
+                close_with_reason(self, WIC_CLOSE_TOO_BIG, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else{
+
+                /* nothing */
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    switch(self->rx.size){
+    case 127U:
+        self->rx.state = WIC_RX_STATE_SIZE_2;
+        self->rx.size = 0U;
+        break;
+    case 126U:
+        self->rx.state = WIC_RX_STATE_SIZE_0;
+        self->rx.size = 0U;
+        break;
+    default:
+        self->rx.state = self->rx.masked ? WIC_RX_STATE_MASK_0 : WIC_RX_STATE_DATA;
+        break;
+    }
+}
+
+static bool parse_extended_size(struct wic_inst *self, struct wic_stream *s)
+{
+    uint8_t b;
+    bool blocked = false;
+
+    if(stream_get_u8(s, &b)){
+
+        self->rx.size <<= 8;
+        self->rx.size |= b;
+
+        switch(self->rx.state){
+        default:
+        case WIC_RX_STATE_SIZE_0:
+            self->rx.state = WIC_RX_STATE_SIZE_1;
+            break;
+        case WIC_RX_STATE_SIZE_2:
+            self->rx.state = WIC_RX_STATE_SIZE_3;
+            break;
+        case WIC_RX_STATE_SIZE_3:
+            self->rx.state = WIC_RX_STATE_SIZE_4;
+            break;
+        case WIC_RX_STATE_SIZE_4:
+            self->rx.state = WIC_RX_STATE_SIZE_5;
+            break;
+        case WIC_RX_STATE_SIZE_5:
+            self->rx.state = WIC_RX_STATE_SIZE_6;
+            break;
+        case WIC_RX_STATE_SIZE_6:
+            self->rx.state = WIC_RX_STATE_SIZE_7;
+            break;
+        case WIC_RX_STATE_SIZE_7:
+            self->rx.state = WIC_RX_STATE_SIZE_8;
+            break;
+        case WIC_RX_STATE_SIZE_8:
+            self->rx.state = WIC_RX_STATE_SIZE_9;
+            break;
+        case WIC_RX_STATE_SIZE_1:
+        case WIC_RX_STATE_SIZE_9:
+            self->rx.state = self->rx.masked ? WIC_RX_STATE_MASK_0 : WIC_RX_STATE_DATA;
+            break;
+        }
+    }
+    else{
+
+        blocked = true;
+    }
+
+    return blocked;
+}
+
+static bool parse_mask(struct wic_inst *self, struct wic_stream *s)
+{
+    bool blocked = false;
+    uint8_t b;
+
+    if(stream_get_u8(s, &b)){
+
+        self->rx.mask[self->rx.state - WIC_RX_STATE_MASK_0] = b;
+
+        switch(self->rx.state){
+        default:
+        case WIC_RX_STATE_MASK_0:
+            self->rx.state = WIC_RX_STATE_MASK_1;
+            break;
+        case WIC_RX_STATE_MASK_1:
+            self->rx.state = WIC_RX_STATE_MASK_2;
+            break;
+        case WIC_RX_STATE_MASK_2:
+            self->rx.state = WIC_RX_STATE_MASK_3;
+            break;
+        case WIC_RX_STATE_MASK_3:
+            self->rx.state = WIC_RX_STATE_DATA;
+            break;
+        }
+    }
+    else{
+
+        blocked = true;
+    }
+
+    return blocked;
+}
+
+static bool parse_data(struct wic_inst *self, struct wic_stream *s)
+{
+    uint16_t code;
+    size_t n, pos;
+    char *ptr;
+    bool blocked = false;
+
+    /* if still receiving data part */
+    if(self->rx.size > 0U){
+
+        /* pass the rest of the frame to the user without buffering */
+        if(parse_data_direct(self, s, &blocked)){
+
+            /* nothing */
+        }
+        /* wait for on_rx_buffer to lend a buffer */
+        else if(!borrow_rx(self)){
+
+            blocked = true;
+        }
+        /* no more space in rx buffer and so pass to the user as a fragment */
+        else if(stream_eof(&self->rx.s)){
+
+            switch((self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode){
+            case WIC_OPCODE_TEXT:
+                blocked = (rx_extension(self) != NULL) ?
+                    transform_message(self, WIC_OPCODE_TEXT, false, self->rx.s.read, self->rx.s.pos)
+                    :
+                    !on_message(self, WIC_ENCODING_UTF8, false, self->rx.s.read, self->rx.s.pos);
+                break;
+            case WIC_OPCODE_BINARY:
+                blocked = (rx_extension(self) != NULL) ?
+                    transform_message(self, WIC_OPCODE_BINARY, false, self->rx.s.read, self->rx.s.pos)
+                    :
+                    !on_message(self, WIC_ENCODING_BINARY, false, self->rx.s.read, self->rx.s.pos);
+                break;
+            default:
+                break;
+            }
+
+            if(!blocked){
+
+                stream_rewind(&self->rx.s);
+            }
+        }
+        else{
+
+            /* copy as much of the payload as the input and rx buffer allow */
+            n = stream_remaining(s);
+            n = (n > self->rx.size) ? (size_t)self->rx.size : n;
+            n = (n > (stream_max(&self->rx.s) - stream_pos(&self->rx.s))) ? (stream_max(&self->rx.s) - stream_pos(&self->rx.s)) : n;
+
+            if(n > 0U){
+
+                pos = stream_pos(&self->rx.s);
+                ptr = &self->rx.s.write[pos];
+
+                if(self->rx.masked){
+
+                    mask_copy(ptr, &s->read[stream_pos(s)], n, self->rx.mask, self->rx.pos);
+                }
+                else{
+
+                    (void)memcpy(ptr, &s->read[stream_pos(s)], n);
+                }
+
+                (void)stream_seek(s, stream_pos(s) + n);
+                (void)stream_seek(&self->rx.s, pos + n);
+
+                self->rx.size -= n;
+                self->rx.pos += n;
+
+                switch((self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode){
+                case WIC_OPCODE_TEXT:
+
+                    /* transformed text is checked on the way out */
+                    if(rx_extension(self) == NULL){
+
+                        self->rx.utf8 = utf8_parse_string(self->rx.utf8, ptr, n);
+
+                        if(utf8_is_invalid(self->rx.utf8)){
+
+                            close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
+                        }
+                    }
+                    break;
+
+                case WIC_OPCODE_CLOSE:
+
+                    /* reason follows the 2 byte code */
+                    if((pos + n) > 2U){
+
+                        self->rx.utf8 = (pos < 2U) ?
+                            utf8_parse_string(self->rx.utf8, &ptr[2U - pos], n - (2U - pos))
+                            :
+                            utf8_parse_string(self->rx.utf8, ptr, n);
+
+                        if(utf8_is_invalid(self->rx.utf8)){
+
+                            close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
+                        }
+                    }
+                    break;
+
+                default:
+                    break;
+                }
+            }
+            else{
+
+                blocked = true;
+            }
+        }
+    }
+
+    /* finished reading data part (unless already passed on directly) */
+    if((self->state == WIC_STATE_OPEN) && (self->rx.state == WIC_RX_STATE_DATA) && (self->rx.size == 0U)){
+
+        enum wic_opcode opcode = (self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode;
+
+        switch(opcode){
+        case WIC_OPCODE_TEXT:
+        case WIC_OPCODE_BINARY:
+
+            blocked = deliver_message(self, opcode, self->rx.s.read, stream_pos(&self->rx.s));
+            break;
+
+        case WIC_OPCODE_CLOSE:
+
+            code = (uint8_t)self->rx.s.read[0];
+            code <<= 8;
+            code |= (uint8_t)self->rx.s.read[1];
+
+            switch(code){
+            case WIC_CLOSE_NORMAL:
+            case WIC_CLOSE_GOING_AWAY:
+            case WIC_CLOSE_PROTOCOL_ERROR:
+            case WIC_CLOSE_UNSUPPORTED:
+            case WIC_CLOSE_INVALID_DATA:
+            case WIC_CLOSE_POLICY:
+            case WIC_CLOSE_TOO_BIG:
+            case WIC_CLOSE_EXTENSION_REQUIRED:
+            case WIC_CLOSE_UNEXPECTED_EXCEPTION:
+
+                if(utf8_is_complete(self->rx.utf8)){
+
+                    close_with_reason(self, code, &self->rx.s.read[sizeof(code)], self->rx.s.pos - sizeof(code), WIC_BUFFER_CLOSE_RESPONSE);
+                }
+                else{
+
+                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
+                }
+                break;
+
+            default:
+
+                if((code >= 3000U) && (code <= 3999)){
+
+                    close_with_reason(self, WIC_CLOSE_NORMAL, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
+                }
+                else if((code >= 4000U) && (code <= 4999)){
+
+                    close_with_reason(self, WIC_CLOSE_NORMAL, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
+                }
+                else{
+
+                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
+                }
+                break;
+            }
+
+            break;
+
+        case WIC_OPCODE_PING:
+
+            switch(send_pong_with_payload(self, self->rx.s.read, self->rx.s.pos)){
+            case WIC_STATUS_WOULD_BLOCK:
+                blocked = true;
+                break;
+            case WIC_STATUS_SUCCESS:
+            default:            
+                if(self->cb->on_ping != NULL){
+
+                    self->cb->on_ping(self);
+                }
+                break;
+            }
+            break;
+
+        case WIC_OPCODE_PONG:
+
+            if(self->cb->on_pong != NULL){
+
+                self->cb->on_pong(self);
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        if(!blocked){
+
+            self->rx.state = WIC_RX_STATE_OPCODE;
+        }
+    }
+
+    return blocked;
+}
+
+static bool parse_data_direct(struct wic_inst *self, struct wic_stream *s, bool *blocked)
+{
+    bool retval = false;
+    uint16_t utf8 = self->rx.utf8;
+    enum wic_opcode opcode = (self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode;
+    const char *data = &s->read[stream_pos(s)];
+    size_t size = (size_t)self->rx.size;
+
+    /* only possible if nothing from this frame is buffered and the rest
+     * of it is in the input (transformed frames are not since the
+     * transform keeps its own copy anyway) */
+    if(
+        self->rx_direct
+        &&
+        !self->rx.masked
+        &&
+        (rx_extension(self) == NULL)
+        &&
+        (stream_pos(&self->rx.s) == 0U)
+        &&
+        (stream_remaining(s) >= self->rx.size)
+    ){
+        switch(opcode){
+        case WIC_OPCODE_TEXT:
+
+            self->rx.utf8 = utf8_parse_string(self->rx.utf8, data, size);
+
+            if(utf8_is_invalid(self->rx.utf8)){
+
+                close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
+                retval = true;
+                break;
+            }
+
+            /* fall through */
+
+        case WIC_OPCODE_BINARY:
+
+            *blocked = deliver_message(self, opcode, data, size);
+
+            if(*blocked){
+
+                /* try again next time */
+                self->rx.utf8 = utf8;
+            }
+            else{
+
+                (void)stream_seek(s, stream_pos(s) + size);
+                self->rx.pos += size;
+                self->rx.size = 0U;
+                self->rx.state = WIC_RX_STATE_OPCODE;
+            }
+
+            retval = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return retval;
+}
+
+static bool deliver_message(struct wic_inst *self, enum wic_opcode opcode, const char *data, size_t size)
+{
+    static const char empty[] = "";
+
+    bool blocked = false;
+
+    /* nothing is borrowed for an empty frame but on_message still
+     * expects somewhere to point */
+    if(data == NULL){
+
+        data = empty;
+    }
+
+    if(rx_extension(self) != NULL){
+
+        blocked = transform_message(self, opcode, self->rx.fin, data, size);
+
+        if(!blocked){
+
+            self->rx.frag = self->rx.fin ? WIC_OPCODE_CONTINUE : opcode;
+            self->utf8_rx = self->rx.utf8;
+        }
+    }
+    else{
+
+        switch(opcode){
+        case WIC_OPCODE_TEXT:
+
+            if(!self->rx.fin){
+
+                if(on_message(self, WIC_ENCODING_UTF8, self->rx.fin, data, size)){
+
+                    self->rx.frag = opcode;
+                    self->utf8_rx = self->rx.utf8;
+                }
+                else{
+
+                    blocked = true;
+                }
+            }
+            else if(utf8_is_complete(self->rx.utf8)){
+
+                if(on_message(self, WIC_ENCODING_UTF8, self->rx.fin, data, size)){
+
+                    self->rx.frag = WIC_OPCODE_CONTINUE;
+                }
+                else{
+
+                    blocked = true;
+                }
+            }
+            else{
+
+                close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            break;
+
+        case WIC_OPCODE_BINARY:
+
+            if(on_message(self, WIC_ENCODING_BINARY, self->rx.fin, data, size)){
+
+                self->rx.frag = self->rx.fin ? WIC_OPCODE_CONTINUE : opcode;
+            }
+            else{
+
+                blocked = true;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return blocked;
+}
+
+/* pass payload through the receive transform and then to on_message
+ * in pieces
+ *
+ * A blocked call must be repeated with the same arguments, it resumes
+ * from rx.ext_pos.
+ *
+ * */
+static bool transform_message(struct wic_inst *self, enum wic_opcode opcode, bool fin, const char *data, size_t size)
+{
+    const struct wic_ext_transform *rx = self->ext->rx->rx;
+    enum wic_encoding encoding = (opcode == WIC_OPCODE_TEXT) ? WIC_ENCODING_UTF8 : WIC_ENCODING_BINARY;
+    enum wic_ext_status status;
+    const char *out;
+    size_t n;
+    size_t pending;
+    size_t used;
+    uint16_t utf8;
+    bool blocked = false;
+    bool done = false;
+    bool last;
+
+    while(!done && !blocked && (self->state == WIC_STATE_OPEN)){
+
+        out = rx->output(self, &n, &pending);
+
+        if(n > 0U){
+
+            last = self->ext->rx_ended && (n == pending);
+
+            utf8 = (opcode == WIC_OPCODE_TEXT) ? utf8_parse_string(self->rx.utf8, out, n) : 0U;
+
+            if(utf8_is_invalid(utf8) || (last && !utf8_is_complete(utf8))){
+
+                close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else if(on_message(self, encoding, last, out, n)){
+
+                self->rx.utf8 = utf8;
+                rx->consume(self, n);
+                done = last;
+            }
+            else{
+
+                blocked = true;
+            }
+        }
+        else if((self->ext->rx_pos < size) || (self->ext->rx_full && !fin)){
+
+            status = rx->write(self, &data[self->ext->rx_pos], size - self->ext->rx_pos, &used);
+
+            self->ext->rx_pos += used;
+            self->ext->rx_full = (status == WIC_EXT_FULL);
+
+            if(status == WIC_EXT_ERROR){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+        }
+        else if(fin && !self->ext->rx_ended){
+
+            status = rx->end(self, true);
+
+            self->ext->rx_full = (status == WIC_EXT_FULL);
+            self->ext->rx_ended = (status == WIC_EXT_OK);
+
+            if(status == WIC_EXT_ERROR){
+
+                close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+        }
+        /* the end of the message produced no output */
+        else if(fin){
+
+            if(!utf8_is_complete(self->rx.utf8)){
+
+                close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
+            }
+            else if(on_message(self, encoding, true, out, 0U)){
+
+                done = true;
+            }
+            else{
+
+                blocked = true;
+            }
+        }
+        else{
+
+            done = true;
+        }
+    }
+
+    if(done){
+
+        self->ext->rx_pos = 0U;
+        self->ext->rx_ended = false;
+    }
+
+    return blocked;
+}
+
+static enum wic_status start_server(struct wic_inst *self)
+{
+    void *buf;
+    size_t max;
+    struct wic_stream tx;
+    enum wic_status retval;
+    char b64_hash[28U];
+
+    if(self->state == WIC_STATE_READY){
+
+        buf = self->cb->on_buffer(self, 0U, WIC_BUFFER_HTTP, &max);
+
+        if(buf != NULL){
+
+            stream_init(&tx, buf, max);
+
+            stream_put_str(&tx, "HTTP/1.1 101 Switching Protocols\r\n");
+
+            stream_put_str(&tx, "Upgrade: websocket\r\n");
+            stream_put_str(&tx, "Connection: upgrade\r\n");
+
+            stream_put_str(&tx, "Sec-WebSocket-Accept: ");
+
+            b64_encode(self->hs->hash, sizeof(self->hs->hash), b64_hash, sizeof(b64_hash));
+            stream_write(&tx, b64_hash, sizeof(b64_hash));
+            stream_put_str(&tx, "\r\n");
+
+            if(self->ext != NULL){
+
+                respond_extensions(self, &tx);
+            }
+
+            for(struct wic_header *ptr = self->hs->tx_header; ptr != NULL; ptr = ptr->next){
+
+                stream_put_str(&tx, ptr->name);
+                stream_put_str(&tx, ": ");
+                stream_put_str(&tx, ptr->value);
+                stream_put_str(&tx, "\r\n");
+            }
+
+            stream_put_str(&tx, "\r\n");
+
+            if(!stream_error(&tx)){
+
+                set_open(self);
+                self->status_code = 101U;
+                self->cb->on_send(self, tx.read, tx.pos, WIC_BUFFER_HTTP);
+                retval = WIC_STATUS_SUCCESS;
+            }
+            else{
+
+                /* send with length zero to free */
+                self->cb->on_send(self, tx.read, 0U, WIC_BUFFER_HTTP);
+                WIC_DEBUG("handshake too large for buffer")
+                retval = WIC_STATUS_TOO_LARGE;
+            }
+        }
+        else{
+
+            WIC_DEBUG("buffer not available")
+            retval = WIC_STATUS_WOULD_BLOCK;
+        }
+    }
+    else{
+
+        WIC_DEBUG("server wic_inst.state must be WIC_STATE_READY to start")
+        retval = WIC_STATUS_BAD_STATE;
+    }
+
+    return retval;
+}
+
+static void set_open(struct wic_inst *self)
+{
+    self->state = WIC_STATE_OPEN;
+
+    /* the handshake buffer is about to be reused for frames */
+    if(!self->hs_keep){
+
+        self->hs = NULL;
+    }
+}
+
+/* the schema and port are found from the URL when they are needed
+ * rather than being kept in every instance */
+static bool parse_url(const char *url, struct http_parser_url *u, enum wic_schema *schema, uint16_t *port)
+{
+    static const char *supported_schema[] = {
+        "http",
+        "https",
+        "ws",
+        "wss"
+    };
+
+    static const enum wic_schema schema_map[] = {
+        WIC_SCHEMA_HTTP,
+        WIC_SCHEMA_HTTPS,
+        WIC_SCHEMA_WS,
+        WIC_SCHEMA_WSS
+    };
+
+    bool retval = false;
+    size_t i;
+
+    http_parser_url_init(u);
+
+    if((url != NULL) && (http_parser_parse_url(url, strlen(url), 0, u) == 0)){
+
+        for(i=0; i<sizeof(supported_schema)/sizeof(*supported_schema); i++){
+
+            if(u->field_data[UF_SCHEMA].len == strlen(supported_schema[i])){
+
+                if(memcmp(&url[u->field_data[UF_SCHEMA].off], supported_schema[i], u->field_data[UF_SCHEMA].len) == 0){
+
+                    *schema = schema_map[i];
+                    retval = true;
+                    break;
+                }
+            }
+        }
+
+        if(!retval){
+
+            WIC_ERROR("unrecognised URL schema")
+        }
+        else if((u->field_set & (1U << UF_PORT)) > 0U){
+
+            *port = u->port;
+        }
+        else{
+
+            switch(*schema){
+            case WIC_SCHEMA_HTTP:
+            case WIC_SCHEMA_WS:
+                *port = 80U;
+                break;
+            default:
+                *port = 443U;
+                break;
+            }
+        }
+    }
+
+    return retval;
+}
+
+static void init_handshake(struct wic_inst *self, struct wic_handshake *hs)
+{
+    struct http_parser_url u;
+
+    (void)memset(hs, 0, sizeof(*hs));
+
+    http_parser_init(&hs->http, (self->role == WIC_ROLE_CLIENT) ? HTTP_RESPONSE : HTTP_REQUEST);
+
+    hs->http.data = self;
+
+    /* URL was checked by wic_init() */
+    if((self->url != NULL) && (http_parser_parse_url(self->url, strlen(self->url), 0, &u) == 0)){
+
+        (void)memcpy(hs->hostname, &self->url[u.field_data[UF_HOST].off], u.field_data[UF_HOST].len);
+    }
+
+    self->hs = hs;
+}
+
+/* fields are stored from the start of buf and the handshake state (if
+ * it doesn't have memory already) is kept at the end */
+static bool attach_rx_header(struct wic_inst *self, void *buf, size_t max)
+{
+    bool retval = true;
+    size_t offset;
+
+    if(self->hs == NULL){
+
+        if(max < WIC_RX_HANDSHAKE_SIZE){
+
+            retval = false;
+        }
+        else{
+
+            offset = max - sizeof(struct wic_handshake);
+            offset -= ((uintptr_t)buf + offset) % sizeof(uint64_t);
+
+            init_handshake(self, (struct wic_handshake *)&((uint8_t *)buf)[offset]);
+
+            max = offset;
+        }
+    }
+
+    if(retval){
+
+        stream_init(&self->hs->rx_header, buf, max);
+    }
+
+    return retval;
+}
+
+/* attach a buffer from on_rx_buffer if nothing is attached */
+static bool borrow_rx(struct wic_inst *self)
+{
+    void *buf;
+
+    if((self->rx.s.write == NULL) && (self->cb->on_rx_buffer != NULL)){
+
+        buf = self->cb->on_rx_buffer(self);
+
+        if(buf != NULL){
+
+            stream_init(&self->rx.s, buf, stream_max(&self->rx.s));
+
+            /* handshake fields go here too */
+            if(((self->state == WIC_STATE_INIT) || (self->state == WIC_STATE_PARSE_HANDSHAKE)) && ((self->hs == NULL) || (self->hs->rx_header.write == NULL))){
+
+                (void)attach_rx_header(self, buf, stream_max(&self->rx.s));
+            }
+        }
+    }
+
+    return (self->rx.s.write != NULL);
+}
+
+/* give a borrowed buffer back */
+static void release_rx(struct wic_inst *self)
+{
+    char *buf = self->rx.s.write;
+
+    if((self->cb->on_rx_release != NULL) && (buf != NULL)){
+
+        /* handshake state refers to (or is in) this buffer */
+        if((self->hs != NULL) && (self->hs->rx_header.write == buf)){
+
+            self->hs = NULL;
+        }
+
+        /* size is kept for the next buffer */
+        stream_init(&self->rx.s, NULL, stream_max(&self->rx.s));
+
+        self->cb->on_rx_release(self, buf);
+    }
+}
+
+/* respond with self->status_code instead of upgrading */
+static void reject_request(struct wic_inst *self)
+{
+    void *buf;
+    size_t max;
+    struct wic_stream tx;
+
+    buf = self->cb->on_buffer(self, 0U, WIC_BUFFER_HTTP, &max);
+
+    if(buf != NULL){
+
+        stream_init(&tx, buf, max);
+
+        stream_put_str(&tx, "HTTP/1.1 ");
+        stream_put_dec(&tx, self->status_code);
+
+        switch(self->status_code){
+        case 403U:
+            stream_put_str(&tx, " Forbidden\r\n");
+            break;
+        case 426U:
+            stream_put_str(&tx, " Upgrade Required\r\n");
+            stream_put_str(&tx, "Sec-WebSocket-Version: 13\r\n");
+            break;
+        default:
+            stream_put_str(&tx, " Bad Request\r\n");
+            break;
+        }
+
+        stream_put_str(&tx, "Connection: close\r\n");
+        stream_put_str(&tx, "Content-Length: 0\r\n");
+        stream_put_str(&tx, "\r\n");
+
+        /* send with length zero to free if it didn't fit */
+        self->cb->on_send(self, tx.read, stream_error(&tx) ? 0U : tx.pos, WIC_BUFFER_HTTP);
+    }
+    else{
+
+        WIC_DEBUG("buffer not available")
+    }
+}
+
+static enum wic_status start_client(struct wic_inst *self)
+{
+    void *buf;
+    size_t max;
+    struct wic_stream tx;
+    struct http_parser_url u;
+    enum wic_status retval;
+    uint32_t nonce[4U];
+    char nonce_b64[24U];
+
+    WIC_ASSERT(sizeof(nonce_b64) == b64_encoded_size(sizeof(nonce)))
+
+    if(self->state == WIC_STATE_INIT){
+
+        http_parser_url_init(&u);
+
+        if(http_parser_parse_url(self->url, strlen(self->url), 0, &u) == 0){
+
+            buf = self->cb->on_buffer(self, 0U, WIC_BUFFER_HTTP, &max);
+
+            if(buf != NULL){
+
+                stream_init(&tx, buf, max);
+
+                stream_put_str(&tx, "GET ");
+                stream_write(&tx, &self->url[u.field_data[UF_PATH].off], u.field_data[UF_PATH].len);
+                if(u.field_data[UF_QUERY].len > 0){
+                    stream_put_str(&tx, "?");
+                    stream_write(&tx, &self->url[u.field_data[UF_QUERY].off], u.field_data[UF_QUERY].len);
+                }
+                if(u.field_data[UF_FRAGMENT].len > 0){
+                    stream_put_str(&tx, "#");
+                    stream_write(&tx, &self->url[u.field_data[UF_FRAGMENT].off], u.field_data[UF_FRAGMENT].len);
+                }
+                stream_put_str(&tx, " HTTP/1.1\r\n");
+
+                stream_put_str(&tx, "Host: ");
+                stream_write(&tx, &self->url[u.field_data[UF_HOST].off], u.field_data[UF_HOST].len);
+                if(u.port != 0U){
+
+                    stream_put_str(&tx, ":");
+                    stream_write(&tx, &self->url[u.field_data[UF_PORT].off], u.field_data[UF_PORT].len);
+                }
+                stream_put_str(&tx, "\r\n");
+
+                stream_put_str(&tx, "Upgrade: websocket\r\n");
+                stream_put_str(&tx, "Connection: upgrade\r\n");
+                stream_put_str(&tx, "Sec-WebSocket-Version: 13\r\n");
+
+                nonce[0] = next_random(self);
+                nonce[1] = next_random(self);
+                nonce[2] = next_random(self);
+                nonce[3] = next_random(self);
+
+                (void)b64_encode(nonce, sizeof(nonce), nonce_b64, sizeof(nonce_b64));
+
+                server_hash(nonce_b64, sizeof(nonce_b64), self->hs->hash);
+
+                stream_put_str(&tx, "Sec-WebSocket-Key: ");
+                stream_write(&tx, nonce_b64, sizeof(nonce_b64));
+                stream_put_str(&tx, "\r\n");
+
+                if(self->ext != NULL){
+
+                    offer_extensions(self, &tx);
+                }
+
+                for(struct wic_header *ptr = self->hs->tx_header; ptr != NULL; ptr = ptr->next){
+
+                    stream_put_str(&tx, ptr->name);
+                    stream_put_str(&tx, ": ");
+                    stream_put_str(&tx, ptr->value);
+                    stream_put_str(&tx, "\r\n");
+                }
+
+                stream_put_str(&tx, "\r\n");
+
+                if(!stream_error(&tx)){
+
+                    self->state = WIC_STATE_PARSE_HANDSHAKE;
+                    self->cb->on_send(self, tx.read, tx.pos, WIC_BUFFER_HTTP);
+
+                    retval = WIC_STATUS_SUCCESS;
+                }
+                else{
+
+                    /* send with length zero to free */
+                    self->cb->on_send(self, tx.read, 0U, WIC_BUFFER_HTTP);
+
+                    WIC_ERROR("handshake too large for buffer")
+                    retval = WIC_STATUS_TOO_LARGE;
+                }
+            }
+            else{
+
+                WIC_ERROR("no buffer available")
+                retval = WIC_STATUS_WOULD_BLOCK;
+            }
+        }
+        else{
+
+            WIC_ERROR("URL is invalid")
+            retval = WIC_STATUS_BAD_INPUT;
+        }
+    }
+    else{
+
+        WIC_ERROR("client wic_inst.state must be WIC_STATE_INIT to start")
+        retval = WIC_STATUS_BAD_STATE;
+    }
+
+    return retval;
+}
+
+static struct wic_tx_frame *init_mask(struct wic_inst *self, struct wic_tx_frame *f)
+{
+    uint32_t mask;
+
+    /* so, I feel the mask should be left out if there is no data but
+     * this causes autobahn suite to fail */
+    f->masked = (self->role == WIC_ROLE_CLIENT);
+
+    if(f->masked){
+
+        mask = next_random(self);
+        (void)memcpy(f->mask, &mask, sizeof(f->mask));
+    }
+
+    return f;
+}
+
+static uint32_t next_random(struct wic_inst *self)
+{
+    uint32_t retval;
+    uint32_t t;
+    uint32_t *s;
+    size_t i;
+
+    if(self->fast_mask != NULL){
+
+        s = self->fast_mask->state;
+
+        /* xoshiro128** seeded once from rand */
+        if(!self->fast_mask->seeded){
+
+            for(i=0U; i < 4U; i++){
+
+                s[i] = (self->cb->rand != NULL) ? self->cb->rand(self) : 0xaaaaaaaaUL;
+            }
+
+            /* all zero is the one state that never leaves zero */
+            if((s[0] | s[1] | s[2] | s[3]) == 0U){
+
+                s[0] = 1U;
+            }
+
+            self->fast_mask->seeded = true;
+        }
+
+        retval = rotl(s[1] * 5U, 7U) * 9U;
+
+        t = s[1] << 9;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+
+        s[2] ^= t;
+
+        s[3] = rotl(s[3], 11U);
+    }
+    else{
+
+        retval = (self->cb->rand != NULL) ? self->cb->rand(self) : 0xaaaaaaaaUL;
+    }
+
+    return retval;
+}
+
+static uint32_t rotl(uint32_t x, unsigned k)
+{
+    return (x << k) | (x >> (32U - k));
+}
+
+static uint8_t opcode_to_byte(enum wic_opcode opcode)
+{
+    return (uint8_t)opcode;
+}
+
+static enum wic_opcode byte_to_opcode(uint8_t b)
+{
+    return opcodes[b & 0xfU];
+}
+
+static void stream_init(struct wic_stream *self, void *buf, size_t size)
+{
+    self->write = buf;
+    self->read = buf;
+    self->size = size;
+    self->pos = 0U;
+    self->error = false;
+}
+
+static void stream_init_ro(struct wic_stream *self, const void *buf, size_t size)
+{
+    self->write = NULL;
+    self->read = buf;
+    self->size = size;
+    self->pos = 0U;
+    self->error = false;
+}
+
+static void stream_rewind(struct wic_stream *self)
+{
+    self->pos = 0U;
+    self->error = false;
+}
+
+static bool stream_read(struct wic_stream *self, void *buf, size_t count)
+{
+    bool retval = false;
+
+    if(!self->error){
+
+        if((self->size - self->pos) >= count){
+
+            (void)memcpy(buf, &self->read[self->pos], count);
+            self->pos += count;
+            retval = true;
+        }
+        else{
+
+            self->error = true;
+        }
+    }
+
+    return retval;
+}
+
+static bool stream_write(struct wic_stream *self, const void *buf, size_t count)
+{
+    bool retval = false;
+
+    if(self->write != NULL){
+
+        if(!self->error){
+
+            if((self->size - self->pos) >= count){
+
+                if(count > 0U){
+
+                    (void)memcpy(&self->write[self->pos], buf, count);
+                }
+
+                self->pos += count;
+                retval = true;
+            }
+            else{
+
+                self->error = true;
+            }
+        }
+    }
+
+    return retval;
+}
+
+static enum wic_status get_buffer(struct wic_inst *self, struct wic_stream *tx, size_t size, enum wic_buffer type)
+{
+    enum wic_status retval;
+    void *buf;
+    size_t max;
+
+    buf = self->cb->on_buffer(self, size, type, &max);
+
+    if(type == WIC_BUFFER_USER){
+
+        self->tx_max = max;
+    }
+
+    /* the max arguemnt will always be returned to indicate the maximum
+     * possible size of this buffer type if the call succeeded.
+     *
+     * This is necessary because we don't want to block expecting a
+     * buffer that will never be allocated.
+     *
+     * */
+    if(max >= size){
+
+        if(buf != NULL){
+
+            stream_init(tx, buf, max);
+            retval = WIC_STATUS_SUCCESS;
+        }
+        else{
+
+            WIC_ERROR("no buffer available")
+            retval = WIC_STATUS_WOULD_BLOCK;
+        }
+    }
+    else{
+
+        WIC_ERROR("message too large for buffer")
+
+        if(buf != NULL){
+
+            self->cb->on_send(self, buf, 0U, type);
+        }
+
+        retval = WIC_STATUS_TOO_LARGE;
+    }
+
+    return retval;
+}
+
+static bool stream_put_frame(struct wic_stream *self, const struct wic_tx_frame *f)
+{
+    size_t offset = 0U;
+
+    stream_put_frame_header(self, f, f->size + ((f->opcode == WIC_OPCODE_CLOSE) ? 2U : 0U));
+
+    if(f->opcode == WIC_OPCODE_CLOSE){
+
+        stream_put_u8(self, (f->code >> 8) ^ (f->masked ? f->mask[0] : 0U));
+        stream_put_u8(self, f->code ^ (f->masked ? f->mask[1] : 0U));
+
+        /* reason follows the code */
+        offset = 2U;
+    }
+
+    if(f->masked){
+
+        /* fails the same way as stream_write() if the payload won't fit */
+        if((self->write != NULL) && !stream_error(self)){
+
+            if(stream_remaining(self) < f->size){
+
+                self->error = true;
+            }
+            else if(f->size > 0U){
+
+                mask_copy(&self->write[stream_pos(self)], f->payload, f->size, f->mask, offset);
+                (void)stream_seek(self, stream_pos(self) + f->size);
+            }
+        }
+    }
+    else{
+
+        stream_write(self, f->payload, f->size);
+    }
+
+    return !stream_error(self);
+}
+
+static void stream_put_frame_header(struct wic_stream *self, const struct wic_tx_frame *f, size_t payload_size)
+{
+    stream_put_u8(self, (f->fin ? 0x80U : 0U )
+        | (f->rsv & (WIC_RSV1 | WIC_RSV2 | WIC_RSV3))
+        | opcode_to_byte(f->opcode)
+    );
+
+    if(payload_size <= 125U){
+
+        stream_put_u8(self, (f->masked ? 0x80U : 0U) | payload_size);
+    }
+    else if(payload_size <= UINT16_MAX){
+
+        stream_put_u8(self, (f->masked ? 0x80U : 0U) | 126U);
+        stream_put_u16(self, payload_size);
+    }
+    else{
+
+        stream_put_u8(self, (f->masked ? 0x80U : 0U) | 127U);
+        stream_put_u64(self, payload_size);
+    }
+
+    if(f->masked){
+
+        stream_write(self, f->mask, sizeof(f->mask));
+    }
+}
+
+static size_t stream_max(const struct wic_stream *self)
+{
+    return self->size;
+}
+
+static size_t stream_pos(const struct wic_stream *self)
+{
+    return self->pos;
+}
+
+static bool stream_seek(struct wic_stream *self, size_t offset)
+{
+    bool retval = false;
+
+    if(self->size >= offset){
+
+        self->pos = offset;
+        retval = true;
+    }
+
+    return retval;
+}
+
+static size_t stream_remaining(const struct wic_stream *self)
+{
+    return self->size - self->pos;
+}
+
+static bool stream_eof(const struct wic_stream *self)
+{
+    return self->pos == self->size;
+}
+
+static bool stream_put_u8(struct wic_stream *self, uint8_t value)
+{
+    return stream_write(self, &value, sizeof(value));
+}
+
+static bool stream_put_u16(struct wic_stream *self, uint16_t value)
+{
+    uint8_t out[] = {
+        value >> 8,
+        value
+    };
+
+    return stream_write(self, out, sizeof(out));
+}
+
+static bool stream_put_u64(struct wic_stream *self, uint64_t value)
+{
+    uint8_t out[] = {
+        value >> 56,
+        value >> 48,
+        value >> 40,
+        value >> 32,
+        value >> 24,
+        value >> 16,
+        value >> 8,
+        value
+    };
+
+    return stream_write(self, out, sizeof(out));
+}
+
+static bool stream_get_u8(struct wic_stream *self, uint8_t *value)
+{
+    return stream_read(self, value, sizeof(*value));
+}
+
+static bool stream_error(struct wic_stream *self)
+{
+    return self->error;
+}
+
+static bool stream_put_str(struct wic_stream *self, const char *str)
+{
+    return stream_write(self, str, strlen(str));
+}
+
+static bool stream_put_dec(struct wic_stream *self, uint16_t value)
+{
+    char buf[5U];
+    size_t pos = sizeof(buf);
+    uint16_t v = value;
+
+    do{
+
+        pos--;
+        buf[pos] = (char)('0' + (v % 10U));
+        v /= 10U;
+    }
+    while(v > 0U);
+
+    return stream_write(self, &buf[pos], sizeof(buf) - pos);
+}
+
+static void mask_copy(void *dst, const void *src, size_t size, const uint8_t *mask, size_t offset)
+{
+    uint8_t *out = dst;
+    const uint8_t *in = src;
+    uint8_t key[32U];
+    uint64_t word;
+    uint64_t key_word;
+    size_t pos;
+
+    /* rotate the mask so that it lines up with the first byte (every
+     * block below is a multiple of 4 bytes so it stays lined up) */
+    for(pos=0U; pos < sizeof(key); pos++){
+
+        key[pos] = mask[(offset + pos) % 4U];
+    }
+
+    (void)memcpy(&key_word, key, sizeof(key_word));
+
+    pos = 0U;
+
+#ifdef USE_AVX2
+    {
+        __m256i key_vec = _mm256_loadu_si256((const __m256i *)key);
+
+        for(; (size - pos) >= sizeof(__m256i); pos += sizeof(__m256i)){
+
+            _mm256_storeu_si256((__m256i *)&out[pos], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&in[pos]), key_vec));
+        }
+    }
+#endif
+
+#ifdef USE_SSE2
+    {
+        __m128i key_vec = _mm_loadu_si128((const __m128i *)key);
+
+        for(; (size - pos) >= sizeof(__m128i); pos += sizeof(__m128i)){
+
+            _mm_storeu_si128((__m128i *)&out[pos], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&in[pos]), key_vec));
+        }
+    }
+#endif
+
+#ifdef USE_NEON
+    {
+        uint8x16_t key_vec = vld1q_u8(key);
+
+        for(; (size - pos) >= sizeof(uint8x16_t); pos += sizeof(uint8x16_t)){
+
+            vst1q_u8(&out[pos], veorq_u8(vld1q_u8(&in[pos]), key_vec));
+        }
+    }
+#endif
+
+    for(; (size - pos) >= sizeof(word); pos += sizeof(word)){
+
+        (void)memcpy(&word, &in[pos], sizeof(word));
+        word ^= key_word;
+        (void)memcpy(&out[pos], &word, sizeof(word));
+    }
+
+    for(; pos < size; pos++){
+
+        out[pos] = in[pos] ^ key[pos % 4U];
+    }
+}
+
+static char b64_encode_byte(uint8_t in)
+{
+     static const char map[] = {
+        'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+        'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+        'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+        'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+        'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+        'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+        'w', 'x', 'y', 'z', '0', '1', '2', '3',
+        '4', '5', '6', '7', '8', '9', '+', '/'
+    };
+
+    return map[in & 0x3fU];
+}
+
+static size_t b64_encode(const void *in, size_t len, char *out, size_t max)
+{
+    uint8_t c;
+    uint8_t acc = 0U;
+    size_t i;
+    size_t retval = 0;
+
+    if((max >= b64_encoded_size(len)) && (b64_encoded_size(len) >= len)){
+
+        for(i=0U; i < len; i++){
+
+            c = ((const uint8_t *)in)[i];
+
+            switch(i%3U){
+            default:
+            case 0U:
+                out[retval] = b64_encode_byte(c >> 2);
+                retval++;
+                acc = (c << 4);
+                break;
+            case 1U:
+                out[retval] = b64_encode_byte(acc | (c >> 4));
+                retval++;
+                acc = (c << 2);
+                break;
+            case 2U:
+                out[retval] = b64_encode_byte(acc | (c >> 6));
+                out[retval+1U] = b64_encode_byte(c);
+                retval += 2U;
+            }
+        }
+
+        if((len % 3U) > 0U){
 
-                            close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
-                        }
-                    }
-                    break;
+            out[retval] = b64_encode_byte(acc);
+            out[retval+1U] = '=';
+            retval += 2U;
 
-                default:
-                    break;
-                }
-            }
-            else{
+            if((len % 3U) == 1U){
 
-                blocked = true;
+                out[retval] = '=';
+                retval++;
             }
         }
     }
 
-    /* finished reading data part */
-    if((self->state == WIC_STATE_OPEN) && (self->rx.size == 0U)){
-
-        enum wic_opcode opcode = (self->rx.opcode == WIC_OPCODE_CONTINUE) ? self->rx.frag : self->rx.opcode;
-
-        switch(opcode){
-        case WIC_OPCODE_TEXT:
+    return retval;
+}
 
-            if(!self->rx.fin){
+static size_t b64_encoded_size(size_t size)
+{
+    return (4 * ((size / 3) + ((size % 3) ? 1 : 0)));
+}
 
-                if(self->on_message(self, WIC_ENCODING_UTF8, self->rx.fin, self->rx.s.read, self->rx.s.pos)){
+static int on_header_field(http_parser *http, const char *at, size_t length)
+{
+    struct wic_inst *self = http->data;
 
-                    self->rx.frag = opcode;
-                    self->utf8_rx = self->rx.utf8;
-                }
-                else{
+    switch(self->hs->header_state){
+    default:
+        return -1;
+    case WIC_HEADER_STATE_IDLE:
+    case WIC_HEADER_STATE_FIELD:
+        stream_write(&self->hs->rx_header, at, length);
+        break;
+    case WIC_HEADER_STATE_VALUE:
+        stream_put_u8(&self->hs->rx_header, 0U);
+        stream_write(&self->hs->rx_header, at, length);
+        break;
+    }
 
-                    blocked = true;
-                }
-            }
-            else if(utf8_is_complete(self->rx.utf8)){
+    if(stream_error(&self->hs->rx_header)){
 
-                if(self->on_message(self, WIC_ENCODING_UTF8, self->rx.fin, self->rx.s.read, self->rx.s.pos)){
+        WIC_DEBUG("handshake too large for buffer")
+        return -1;
+    }
 
-                    self->rx.frag = WIC_OPCODE_CONTINUE;
-                }
-                else{
+    self->hs->header_state = WIC_HEADER_STATE_FIELD;
 
-                    blocked = true;
-                }
-            }
-            else{
+    return 0;
+}
 
-                close_with_reason(self, WIC_CLOSE_INVALID_DATA, NULL, 0U, WIC_BUFFER_CLOSE);
-            }
-            break;
+static int on_header_value(http_parser *http, const char *at, size_t length)
+{
+    struct wic_inst *self = http->data;
 
-        case WIC_OPCODE_BINARY:
+    switch(self->hs->header_state){
+    default:
+    case WIC_HEADER_STATE_IDLE:
+        return -1;
+    case WIC_HEADER_STATE_FIELD:
+        stream_put_u8(&self->hs->rx_header, 0U);
+        stream_write(&self->hs->rx_header, at, length);
+        break;
+    case WIC_HEADER_STATE_VALUE:
+        stream_write(&self->hs->rx_header, at, length);
+        break;
+    }
 
-            if(self->on_message(self, WIC_ENCODING_BINARY, self->rx.fin, self->rx.s.read, self->rx.s.pos)){
+    if(stream_error(&self->hs->rx_header)){
 
-                self->rx.frag = self->rx.fin ? WIC_OPCODE_CONTINUE : opcode;
-            }
-            else{
+        WIC_DEBUG("handshake too large for buffer")
+        return -1;
+    }
 
-                blocked = true;
-            }
-            break;
+    self->hs->header_state = WIC_HEADER_STATE_VALUE;
 
-        case WIC_OPCODE_CLOSE:
+    return 0;
+}
 
-            code = (uint8_t)self->rx.s.read[0];
-            code <<= 8;
-            code |= (uint8_t)self->rx.s.read[1];
+static void server_hash(const char *nonce, size_t len, uint8_t *hash)
+{
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    sha1_context ctx;
 
-            switch(code){
-            case WIC_CLOSE_NORMAL:
-            case WIC_CLOSE_GOING_AWAY:
-            case WIC_CLOSE_PROTOCOL_ERROR:
-            case WIC_CLOSE_UNSUPPORTED:
-            case WIC_CLOSE_INVALID_DATA:
-            case WIC_CLOSE_POLICY:
-            case WIC_CLOSE_TOO_BIG:
-            case WIC_CLOSE_EXTENSION_REQUIRED:
-            case WIC_CLOSE_UNEXPECTED_EXCEPTION:
+    sha1_init(&ctx);
+    (void)sha1_starts_ret(&ctx);
+    (void)sha1_update_ret(&ctx, (const uint8_t *)nonce, len);
+    (void)sha1_update_ret(&ctx, (const uint8_t *)guid, sizeof(guid)-1U);
+    (void)sha1_finish_ret(&ctx, hash);
+}
 
-                if(utf8_is_complete(self->rx.utf8)){
+static bool str_equal(const char *s1, const char *s2)
+{
+    bool retval = false;
+    size_t pos = 0U;
 
-                    close_with_reason(self, code, &self->rx.s.read[sizeof(code)], self->rx.s.pos - sizeof(code), WIC_BUFFER_CLOSE_RESPONSE);
-                }
-                else{
+    if((s1 != NULL) && (s2 != NULL)){
 
-                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
-                }
-                break;
+        retval = true;
 
-            default:
+        for(;;){
 
-                if((code >= 3000U) && (code <= 3999)){
+            if(tolower(s1[pos]) != tolower(s2[pos])){
 
-                    close_with_reason(self, WIC_CLOSE_NORMAL, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
-                }
-                else if((code >= 4000U) && (code <= 4999)){
+                retval = false;
+                break;
+            }
 
-                    close_with_reason(self, WIC_CLOSE_NORMAL, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
-                }
-                else{
+            if(s1[pos] == 0){
 
-                    close_with_reason(self, WIC_CLOSE_PROTOCOL_ERROR, NULL, 0U, WIC_BUFFER_CLOSE_RESPONSE);
-                }
                 break;
             }
 
-            break;
+            pos++;
+        }
+    }
 
-        case WIC_OPCODE_PING:
+    return retval;
+}
 
-            switch(send_pong_with_payload(self, self->rx.s.read, self->rx.s.pos)){
-            case WIC_STATUS_WOULD_BLOCK:
-                blocked = true;
-                break;
-            case WIC_STATUS_SUCCESS:
-            default:            
-                if(self->on_ping != NULL){
+static uint32_t str_hash(const char *s)
+{
+    /* FNV-1a of the lower case string */
+    uint32_t retval = 2166136261UL;
+    size_t pos;
 
-                    self->on_ping(self);
-                }
-                break;
-            }
-            break;
+    for(pos=0U; s[pos] != 0; pos++){
 
-        case WIC_OPCODE_PONG:
+        retval ^= (uint32_t)tolower((uint8_t)s[pos]);
+        retval *= 16777619UL;
+    }
 
-            if(self->on_pong != NULL){
+    return retval;
+}
 
-                self->on_pong(self);
-            }
-            break;
+static size_t extension_count(const struct wic_inst *self)
+{
+    return (self->ext != NULL) ? (self->ext->count + ((self->ext->inflate != NULL) ? 1U : 0U)) : 0U;
+}
 
-        default:
-            break;
-        }
+static const struct wic_extension *get_extension(const struct wic_inst *self, size_t n)
+{
+    return (n < self->ext->count) ? &self->ext->ext[n] : &pmd_extension;
+}
 
-        if(!blocked){
+/* active extension which claimed exactly these RSV bits */
+static const struct wic_extension *rsv_extension(const struct wic_inst *self, uint8_t rsv)
+{
+    const struct wic_extension *retval = NULL;
+    size_t i;
 
-            self->rx.state = WIC_RX_STATE_OPCODE;
+    for(i=0U; i < extension_count(self); i++){
+
+        if(((self->ext->active & (1U << i)) != 0U) && (get_extension(self, i)->rsv == rsv)){
+
+            retval = get_extension(self, i);
+            break;
         }
     }
 
-    return blocked;
+    return retval;
 }
 
-static enum wic_status start_server(struct wic_inst *self)
+static bool extension_is_valid(const struct wic_extension *ext)
 {
-    void *buf;
-    size_t max;
-    struct wic_stream tx;
-    enum wic_status retval;
-    char b64_hash[28U];
-
-    if(self->state == WIC_STATE_READY){
-
-        buf = self->on_buffer(self, 0U, WIC_BUFFER_HTTP, &max);
+    return (ext->name != NULL)
+        &&
+        ((ext->rsv & ~(WIC_RSV1 | WIC_RSV2 | WIC_RSV3)) == 0U)
+        &&
+        /* the peer can only tell a transformed message by its RSV bits */
+        (((ext->tx == NULL) && (ext->rx == NULL)) || (ext->rsv != 0U))
+        &&
+        transform_is_valid(ext->tx)
+        &&
+        transform_is_valid(ext->rx);
+}
 
-        if(buf != NULL){
+static bool transform_is_valid(const struct wic_ext_transform *transform)
+{
+    return (transform == NULL)
+        ||
+        (
+            (transform->write != NULL)
+            &&
+            (transform->end != NULL)
+            &&
+            (transform->output != NULL)
+            &&
+            (transform->consume != NULL)
+        );
+}
 
-            stream_init(&tx, buf, max);
+/* write Sec-WebSocket-Extensions (if anything is offered) */
+static void offer_extensions(struct wic_inst *self, struct wic_stream *tx)
+{
+    const struct wic_extension *ext;
+    size_t i;
+    size_t pos;
+    size_t size;
 
-            stream_put_str(&tx, "HTTP/1.1 101 Switching Protocols\r\n");
+    self->hs->ext_offered = 0U;
+    self->ext->active = 0U;
 
-            stream_put_str(&tx, "Upgrade: websocket\r\n");
-            stream_put_str(&tx, "Connection: upgrade\r\n");
+    for(i=0U; i < extension_count(self); i++){
 
-            stream_put_str(&tx, "Sec-WebSocket-Accept: ");
+        ext = get_extension(self, i);
+        pos = stream_pos(tx);
 
-            b64_encode(self->hash, sizeof(self->hash), b64_hash, sizeof(b64_hash));
-            stream_write(&tx, b64_hash, sizeof(b64_hash));
-            stream_put_str(&tx, "\r\n");
+        stream_put_str(tx, (self->hs->ext_offered == 0U) ? "Sec-WebSocket-Extensions: " : ", ");
+        stream_put_str(tx, ext->name);
 
-            for(struct wic_header *ptr = self->tx_header; ptr != NULL; ptr = ptr->next){
+        size = 0U;
 
-                stream_put_str(&tx, ptr->name);
-                stream_put_str(&tx, ": ");
-                stream_put_str(&tx, ptr->value);
-                stream_put_str(&tx, "\r\n");
-            }
+        if(stream_error(tx)){
 
-            stream_put_str(&tx, "\r\n");
+            /* handshake will fail anyway */
+        }
+        else if((ext->offer == NULL) || ext->offer(self, &tx->write[stream_pos(tx)], stream_remaining(tx), &size)){
 
-            if(!stream_error(&tx)){
+            if(!stream_seek(tx, stream_pos(tx) + size)){
 
-                self->state = WIC_STATE_OPEN;
-                self->on_send(self, tx.read, tx.pos, WIC_BUFFER_HTTP);
-                retval = WIC_STATUS_SUCCESS;
+                tx->error = true;
             }
-            else{
 
-                /* send with length zero to free */
-                self->on_send(self, tx.read, 0U, WIC_BUFFER_HTTP);
-                WIC_DEBUG("handshake too large for buffer")
-                retval = WIC_STATUS_TOO_LARGE;
-            }
+            self->hs->ext_offered |= (uint8_t)(1U << i);
         }
         else{
 
-            WIC_DEBUG("buffer not available")
-            retval = WIC_STATUS_WOULD_BLOCK;
+            (void)stream_seek(tx, pos);
         }
     }
-    else{
 
-        WIC_DEBUG("server wic_inst.state must be WIC_STATE_READY to start")
-        retval = WIC_STATUS_BAD_STATE;
-    }
+    if(self->hs->ext_offered != 0U){
 
-    return retval;
+        stream_put_str(tx, "\r\n");
+    }
 }
 
-static enum wic_status start_client(struct wic_inst *self)
+/* activate the extensions listed in a server response
+ *
+ * e.g. "permessage-deflate; server_no_context_takeover, x-delta"
+ *
+ * */
+static bool accept_extensions(struct wic_inst *self, const char *value)
 {
-    void *buf;
-    size_t max;
-    struct wic_stream tx;
-    struct http_parser_url u;
-    enum wic_status retval;
-    uint32_t nonce[4U];
-    char nonce_b64[24U];
+    const struct wic_extension *ext;
+    const char *ptr = value;
+    const char *name;
+    const char *end;
+    size_t name_size;
+    size_t i;
+    uint8_t rsv = 0U;
+    bool retval = true;
 
-    WIC_ASSERT(sizeof(nonce_b64) == b64_encoded_size(sizeof(nonce)))
+    do{
 
-    if(self->state == WIC_STATE_INIT){
+        ptr = ext_token(ptr, &name, &name_size);
+        end = ext_params_end(ptr);
 
-        http_parser_url_init(&u);
+        ext = NULL;
 
-        if(http_parser_parse_url(self->url, strlen(self->url), 0, &u) == 0){
+        for(i=0U; i < extension_count(self); i++){
 
-            buf = self->on_buffer(self, 0U, WIC_BUFFER_HTTP, &max);
+            if(((self->hs->ext_offered & (1U << i)) != 0U) && ((self->ext->active & (1U << i)) == 0U) && token_equal(name, name_size, get_extension(self, i)->name)){
 
-            if(buf != NULL){
+                ext = get_extension(self, i);
+                break;
+            }
+        }
+
+        /* must have been offered and not share RSV bits with another */
+        if((ext == NULL) || ((ext->rsv & rsv) != 0U)){
+
+            retval = false;
+        }
+        else if(ext->accept != NULL){
+
+            retval = ext->accept(self, ptr, (size_t)(end - ptr));
+        }
+        else{
+
+            retval = (ptr == end);
+        }
+
+        if(retval){
+
+            self->ext->active |= (uint8_t)(1U << i);
+            rsv |= ext->rsv;
+        }
+
+        ptr = (*end == ',') ? &end[1] : end;
+    }
+    while(retval && (*end != '\0'));
+
+    return retval;
+}
 
-                stream_init(&tx, buf, max);
+/* answer the extensions offered in Sec-WebSocket-Extensions (if any)
+ *
+ * Offers are taken in the order the client prefers them. An extension is
+ * answered at most once and never shares RSV bits with another.
+ *
+ * */
+static void respond_extensions(struct wic_inst *self, struct wic_stream *tx)
+{
+    const struct wic_extension *ext;
+    const char *ptr = wic_get_header(self, "Sec-WebSocket-Extensions");
+    const char *name;
+    const char *end;
+    size_t name_size;
+    size_t i;
+    size_t pos;
+    size_t size;
+    uint8_t rsv = 0U;
 
-                stream_put_str(&tx, "GET ");
-                stream_write(&tx, &self->url[u.field_data[UF_PATH].off], u.field_data[UF_PATH].len);
-                if(u.field_data[UF_QUERY].len > 0){
-                    stream_put_str(&tx, "?");
-                    stream_write(&tx, &self->url[u.field_data[UF_QUERY].off], u.field_data[UF_QUERY].len);
-                }
-                if(u.field_data[UF_FRAGMENT].len > 0){
-                    stream_put_str(&tx, "#");
-                    stream_write(&tx, &self->url[u.field_data[UF_FRAGMENT].off], u.field_data[UF_FRAGMENT].len);
-                }
-                stream_put_str(&tx, " HTTP/1.1\r\n");
+    self->hs->ext_offered = 0U;
+    self->ext->active = 0U;
 
-                stream_put_str(&tx, "Host: ");
-                stream_write(&tx, &self->url[u.field_data[UF_HOST].off], u.field_data[UF_HOST].len);
-                if(u.port != 0U){
+    while(ptr != NULL){
 
-                    stream_put_str(&tx, ":");
-                    stream_write(&tx, &self->url[u.field_data[UF_PORT].off], u.field_data[UF_PORT].len);
-                }
-                stream_put_str(&tx, "\r\n");
+        ptr = ext_token(ptr, &name, &name_size);
+        end = ext_params_end(ptr);
 
-                stream_put_str(&tx, "Upgrade: websocket\r\n");
-                stream_put_str(&tx, "Connection: upgrade\r\n");
-                stream_put_str(&tx, "Sec-WebSocket-Version: 13\r\n");
+        ext = NULL;
 
-                if(self->rand != NULL){
+        for(i=0U; i < extension_count(self); i++){
 
-                    nonce[0] = self->rand(self);
-                    nonce[1] = self->rand(self);
-                    nonce[2] = self->rand(self);
-                    nonce[3] = self->rand(self);
-                }
-                else{
+            if(((self->ext->active & (1U << i)) == 0U) && token_equal(name, name_size, get_extension(self, i)->name)){
 
-                    (void)memset(nonce, 0xaa, sizeof(nonce));
-                }
+                ext = get_extension(self, i);
+                break;
+            }
+        }
 
-                (void)b64_encode(nonce, sizeof(nonce), nonce_b64, sizeof(nonce_b64));
+        if((ext != NULL) && ((ext->rsv & rsv) == 0U)){
 
-                server_hash(nonce_b64, sizeof(nonce_b64), self->hash);
+            self->hs->ext_offered |= (uint8_t)(1U << i);
 
-                stream_put_str(&tx, "Sec-WebSocket-Key: ");
-                stream_write(&tx, nonce_b64, sizeof(nonce_b64));
-                stream_put_str(&tx, "\r\n");
+            pos = stream_pos(tx);
 
-                for(struct wic_header *ptr = self->tx_header; ptr != NULL; ptr = ptr->next){
+            stream_put_str(tx, (self->ext->active == 0U) ? "Sec-WebSocket-Extensions: " : ", ");
+            stream_put_str(tx, ext->name);
 
-                    stream_put_str(&tx, ptr->name);
-                    stream_put_str(&tx, ": ");
-                    stream_put_str(&tx, ptr->value);
-                    stream_put_str(&tx, "\r\n");
-                }
+            size = 0U;
 
-                stream_put_str(&tx, "\r\n");
+            if(stream_error(tx)){
 
-                if(!stream_error(&tx)){
+                /* handshake will fail anyway */
+            }
+            else if((ext->respond != NULL) ? ext->respond(self, ptr, (size_t)(end - ptr), &tx->write[stream_pos(tx)], stream_remaining(tx), &size) : (ptr == end)){
 
-                    self->state = WIC_STATE_PARSE_HANDSHAKE;
-                    self->on_send(self, tx.read, tx.pos, WIC_BUFFER_HTTP);
+                if(!stream_seek(tx, stream_pos(tx) + size)){
 
-                    retval = WIC_STATUS_SUCCESS;
+                    tx->error = true;
                 }
-                else{
 
-                    /* send with length zero to free */
-                    self->on_send(self, tx.read, 0U, WIC_BUFFER_HTTP);
-
-                    WIC_ERROR("handshake too large for buffer")
-                    retval = WIC_STATUS_TOO_LARGE;
-                }
+                self->ext->active |= (uint8_t)(1U << i);
+                rsv |= ext->rsv;
             }
             else{
 
-                WIC_ERROR("no buffer available")
-                retval = WIC_STATUS_WOULD_BLOCK;
+                (void)stream_seek(tx, pos);
             }
         }
-        else{
 
-            WIC_ERROR("URL is invalid")
-            retval = WIC_STATUS_BAD_INPUT;
-        }
+        ptr = (*end == ',') ? &end[1] : NULL;
     }
-    else{
 
-        WIC_ERROR("client wic_inst.state must be WIC_STATE_INIT to start")
-        retval = WIC_STATUS_BAD_STATE;
-    }
+    if(self->ext->active != 0U){
 
-    return retval;
+        stream_put_str(tx, "\r\n");
+    }
 }
 
-static struct wic_tx_frame *init_mask(struct wic_inst *self, struct wic_tx_frame *f)
+/* parameters run to the next extension (commas may be quoted) */
+static const char *ext_params_end(const char *in)
 {
-    uint32_t mask = (self->rand != NULL) ? self->rand(self) : 0xaaaaaaaaUL;
+    const char *ptr;
+    bool quoted = false;
 
-    /* so, I feel the mask should be left out if there is no data but
-     * this causes autobahn suite to fail */
-    f->masked = (self->role == WIC_ROLE_CLIENT);
+    for(ptr = in; (*ptr != '\0') && (quoted || (*ptr != ',')); ptr++){
 
-    (void)memcpy(f->mask, &mask, sizeof(f->mask));
+        quoted = (*ptr == '"') ? !quoted : quoted;
+    }
 
-    return f;
+    return ptr;
 }
 
-static uint8_t opcode_to_byte(enum wic_opcode opcode)
+/* write the permessage-deflate offer
+ *
+ * A valueless client_max_window_bits lets the server choose a smaller
+ * window for us.
+ *
+ * */
+static bool pmd_offer(struct wic_inst *self, char *params, size_t max, size_t *size)
 {
-    return (uint8_t)opcode;
-}
+    struct wic_stream s;
 
-static enum wic_opcode byte_to_opcode(uint8_t b)
-{
-    return opcodes[b & 0xfU];
-}
+    stream_init(&s, params, max);
 
-static void stream_init(struct wic_stream *self, void *buf, uint32_t size)
-{
-    self->write = buf;
-    self->read = buf;
-    self->size = size;
-    self->pos = 0U;
-    self->error = false;
-}
+    stream_put_str(&s, "; client_max_window_bits");
 
-static void stream_init_ro(struct wic_stream *self, const void *buf, uint32_t size)
-{
-    self->write = NULL;
-    self->read = buf;
-    self->size = size;
-    self->pos = 0U;
-    self->error = false;
-}
+    if(self->ext->pmd_tx_bits < 15U){
 
-static void stream_rewind(struct wic_stream *self)
-{
-    self->pos = 0U;
-    self->error = false;
+        stream_put_str(&s, "=");
+        stream_put_dec(&s, self->ext->pmd_tx_bits);
+    }
+
+    if(self->ext->pmd_rx_bits < 15U){
+
+        stream_put_str(&s, "; server_max_window_bits=");
+        stream_put_dec(&s, self->ext->pmd_rx_bits);
+    }
+
+    if(self->ext->pmd_rx_nct){
+
+        stream_put_str(&s, "; server_no_context_takeover");
+    }
+
+    if(self->ext->pmd_tx_nct){
+
+        stream_put_str(&s, "; client_no_context_takeover");
+    }
+
+    *size = stream_error(&s) ? (max + 1U) : stream_pos(&s);
+
+    return true;
 }
 
-static bool stream_read(struct wic_stream *self, void *buf, size_t count)
+/* check the permessage-deflate parameters in a server response and
+ * apply them
+ *
+ * e.g. "; server_no_context_takeover"
+ *
+ * */
+static bool pmd_accept(struct wic_inst *self, const char *params, size_t size)
 {
-    bool retval = false;
+    struct pmd_param param;
+    bool retval = pmd_parse(params, size, &param);
 
-    if(!self->error){
+    /* server may use a smaller window than we asked for */
+    if(param.server_bits_set){
 
-        if((self->size - self->pos) >= count){
+        if(param.server_bits > self->ext->pmd_rx_bits){
 
-            (void)memcpy(buf, &self->read[self->pos], count);
-            self->pos += count;
-            retval = true;
+            retval = false;
         }
-        else{
+    }
+    /* server must accept a limit on its window */
+    else if(self->ext->pmd_rx_bits < 15U){
 
-            self->error = true;
+        retval = false;
+    }
+    else{
+
+        /* nothing */
+    }
+
+    /* server may ask us to use a smaller window */
+    if(param.client_bits_set && ((param.client_bits == 0U) || (param.client_bits > self->ext->pmd_tx_bits))){
+
+        retval = false;
+    }
+
+    if(retval){
+
+        if(param.server_bits_set){
+
+            self->ext->pmd_rx_bits = param.server_bits;
         }
+
+        if(param.client_bits_set){
+
+            self->ext->pmd_tx_bits = param.client_bits;
+        }
+
+        self->ext->pmd_rx_nct = param.server_nct;
+        self->ext->pmd_tx_nct = self->ext->pmd_tx_nct || param.client_nct;
+
+        wic_deflate_window(self->ext->deflate, self->ext->pmd_tx_bits);
     }
 
     return retval;
 }
 
-static bool stream_write(struct wic_stream *self, const void *buf, size_t count)
+/* answer a permessage-deflate offer from a client and apply it
+ *
+ * e.g. "; client_max_window_bits; server_max_window_bits=10"
+ *
+ * */
+static bool pmd_respond(struct wic_inst *self, const char *offer, size_t offer_size, char *params, size_t max, size_t *size)
 {
-    bool retval = false;
+    struct pmd_param param;
+    struct wic_stream s;
+    uint8_t rx_bits = self->ext->pmd_rx_bits;
+    uint8_t tx_bits = self->ext->pmd_tx_bits;
+    bool tx_nct;
+    bool retval = pmd_parse(offer, offer_size, &param);
 
-    if(self->write != NULL){
+    /* client may ask us to use a smaller window */
+    if(param.server_bits_set && (param.server_bits < tx_bits)){
 
-        if(!self->error){
+        tx_bits = param.server_bits;
+    }
 
-            if((self->size - self->pos) >= count){
+    /* client must accept a limit on its window */
+    if(rx_bits < 15U){
 
-                if(count > 0U){
+        if(!param.client_bits_set){
 
-                    (void)memcpy(&self->write[self->pos], buf, count);
-                }
+            retval = false;
+        }
+        else if((param.client_bits != 0U) && (param.client_bits < rx_bits)){
 
-                self->pos += count;
-                retval = true;
-            }
-            else{
+            rx_bits = param.client_bits;
+        }
+        else{
 
-                self->error = true;
-            }
+            /* nothing */
         }
     }
 
-    return retval;
-}
+    tx_nct = self->ext->pmd_tx_nct || param.server_nct;
 
-static enum wic_status stream_put_frame(struct wic_inst *self, struct wic_stream *tx, const struct wic_tx_frame *f)
-{
-    enum wic_status retval;
-    void *buf;
-    size_t payload_size;
-    size_t frame_size;
-    size_t max;
+    if(retval){
 
-    payload_size = f->size + ((f->opcode == WIC_OPCODE_CLOSE) ? 2U : 0U);
-    frame_size = min_frame_size(f->opcode, f->masked, f->size);
+        stream_init(&s, params, max);
 
-    buf = self->on_buffer(self, frame_size, f->type, &max);
+        if(tx_nct){
 
-    /* the max arguemnt will always be returned to indicate the maximum
-     * possible size of this buffer type if the call succeeded.
-     *
-     * This is necessary because we don't want to block expecting a
-     * buffer that will never be allocated.
-     *
-     * */
-    if(max >= frame_size){
+            stream_put_str(&s, "; server_no_context_takeover");
+        }
 
-        if(buf != NULL){
+        if(self->ext->pmd_rx_nct){
 
-            stream_init(tx, buf, frame_size);
+            stream_put_str(&s, "; client_no_context_takeover");
+        }
 
-            stream_put_u8(tx, (f->fin ? 0x80U : 0U )
-                | (f->rsv1 ? 0x40U : 0U )
-                | (f->rsv2 ? 0x20U : 0U )
-                | (f->rsv3 ? 0x10U : 0U )
-                | opcode_to_byte(f->opcode)
-            );
+        /* must be answered if offered */
+        if(param.server_bits_set || (tx_bits < 15U)){
 
-            if(payload_size <= 125U){
+            stream_put_str(&s, "; server_max_window_bits=");
+            stream_put_dec(&s, tx_bits);
+        }
 
-                stream_put_u8(tx, (f->masked ? 0x80U : 0U) | payload_size);
-            }
-            else{
+        if(rx_bits < 15U){
 
-                stream_put_u8(tx, (f->masked ? 0x80U : 0U) | 126U);
-                stream_put_u16(tx, payload_size);
-            }
+            stream_put_str(&s, "; client_max_window_bits=");
+            stream_put_dec(&s, rx_bits);
+        }
 
-            if(f->masked){
+        *size = stream_error(&s) ? (max + 1U) : stream_pos(&s);
 
-                stream_write(tx, f->mask, sizeof(f->mask));
+        self->ext->pmd_rx_bits = rx_bits;
+        self->ext->pmd_tx_bits = tx_bits;
+        self->ext->pmd_tx_nct = tx_nct;
 
-                size_t pos;
-                const uint8_t *ptr = f->payload;
+        wic_deflate_window(self->ext->deflate, tx_bits);
+    }
 
-                if(f->opcode == WIC_OPCODE_CLOSE){
+    return retval;
+}
 
-                    stream_put_u8(tx, (f->code >> 8) ^ f->mask[0]);
-                    stream_put_u8(tx, f->code ^ f->mask[1]);
+/* parameters are the same in offers and responses
+ *
+ * Only client_max_window_bits may be given without a value.
+ *
+ * */
+static bool pmd_parse(const char *params, size_t size, struct pmd_param *param)
+{
+    const char *ptr = skip_space(params);
+    const char *end = &params[size];
+    const char *name;
+    const char *value;
+    size_t name_size;
+    size_t value_size;
+    unsigned seen = 0U;
+    unsigned flag;
+    bool has_value;
+    bool retval = true;
 
-                    for(pos=0U; pos < f->size; pos++){
+    (void)memset(param, 0, sizeof(*param));
 
-                        stream_put_u8(tx, ptr[pos] ^ f->mask[(pos+2U) % 4]);
-                    }
-                }
-                else{
+    while(retval && (ptr < end) && (*ptr == ';')){
 
-                    for(pos=0U; pos < payload_size; pos++){
+        ptr = ext_token(&ptr[1], &name, &name_size);
 
-                        stream_put_u8(tx, ptr[pos] ^ f->mask[pos % 4]);
-                    }
-                }
-            }
-            else{
+        has_value = (*ptr == '=');
+        value = NULL;
+        value_size = 0U;
 
-                if(f->opcode == WIC_OPCODE_CLOSE){
+        if(has_value){
 
-                    stream_put_u8(tx, f->code >> 8);
-                    stream_put_u8(tx, f->code);
-                }
+            ptr = ext_value(&ptr[1], &value, &value_size);
+        }
 
-                stream_write(tx, f->payload, payload_size);
-            }
+        if(token_equal(name, name_size, "server_no_context_takeover")){
+
+            flag = 1U;
+            param->server_nct = true;
+            retval = !has_value;
+        }
+        else if(token_equal(name, name_size, "client_no_context_takeover")){
+
+            flag = 2U;
+            param->client_nct = true;
+            retval = !has_value;
+        }
+        else if(token_equal(name, name_size, "server_max_window_bits")){
+
+            flag = 4U;
+            param->server_bits_set = true;
+            retval = pmd_window_bits(value, value_size, &param->server_bits);
+        }
+        else if(token_equal(name, name_size, "client_max_window_bits")){
 
-            retval = stream_error(tx) ? WIC_STATUS_WOULD_BLOCK : WIC_STATUS_SUCCESS;
+            flag = 8U;
+            param->client_bits_set = true;
+            retval = !has_value || pmd_window_bits(value, value_size, &param->client_bits);
         }
         else{
 
-            WIC_ERROR("no buffer available")
-            retval = WIC_STATUS_WOULD_BLOCK;
+            flag = 0U;
+            retval = false;
         }
-    }
-    else{
 
-        WIC_ERROR("message too large for buffer")
-        retval = WIC_STATUS_TOO_LARGE;
+        if((seen & flag) != 0U){
+
+            retval = false;
+        }
+
+        seen |= flag;
     }
 
-    return retval;
-}
+    /* anything left over is not a parameter */
+    if(ptr != end){
 
-static size_t stream_max(const struct wic_stream *self)
-{
-    return self->size;
-}
+        retval = false;
+    }
 
-static size_t stream_pos(const struct wic_stream *self)
-{
-    return self->pos;
+    return retval;
 }
 
-static bool stream_seek(struct wic_stream *self, size_t offset)
+static bool pmd_window_bits(const char *value, size_t size, uint8_t *bits)
 {
     bool retval = false;
+    size_t i;
+    unsigned n = 0U;
 
-    if(self->size >= offset){
+    if((value != NULL) && (size > 0U) && (size <= 2U)){
 
-        self->pos = offset;
         retval = true;
-    }
 
-    return retval;
-}
+        for(i=0U; i < size; i++){
 
-static bool stream_eof(const struct wic_stream *self)
-{
-    return self->pos == self->size;
-}
+            if(isdigit((uint8_t)value[i]) == 0){
 
-static bool stream_put_u8(struct wic_stream *self, uint8_t value)
-{
-    return stream_write(self, &value, sizeof(value));
-}
+                retval = false;
+                break;
+            }
 
-static bool stream_put_u16(struct wic_stream *self, uint16_t value)
-{
-    uint8_t out[] = {
-        value >> 8,
-        value
-    };
+            n = (n * 10U) + (unsigned)(value[i] - '0');
+        }
+
+        if((n < 8U) || (n > 15U)){
+
+            retval = false;
+        }
+
+        *bits = (uint8_t)n;
+    }
 
-    return stream_write(self, out, sizeof(out));
+    return retval;
 }
 
-static bool stream_get_u8(struct wic_stream *self, uint8_t *value)
+static enum wic_ext_status pmd_tx_write(struct wic_inst *self, const void *data, size_t size, size_t *used)
 {
-    return stream_read(self, value, sizeof(*value));
+    *used = wic_deflate(self->ext->deflate, data, size);
+
+    return (*used < size) ? WIC_EXT_FULL : WIC_EXT_OK;
 }
 
-static bool stream_error(struct wic_stream *self)
+/* flush each fragment so the peer can inflate all of it */
+static enum wic_ext_status pmd_tx_end(struct wic_inst *self, bool fin)
 {
-    return self->error;
+    enum wic_ext_status retval = WIC_EXT_FULL;
+
+    if(wic_deflate_flush(self->ext->deflate, fin)){
+
+        retval = WIC_EXT_OK;
+
+        if(fin && self->ext->pmd_tx_nct){
+
+            wic_deflate_reset(self->ext->deflate);
+        }
+    }
+
+    return retval;
 }
 
-static bool stream_put_str(struct wic_stream *self, const char *str)
+static const void *pmd_tx_output(struct wic_inst *self, size_t *size, size_t *pending)
 {
-    return stream_write(self, str, strlen(str));
+    const void *retval = wic_deflate_output(self->ext->deflate, size);
+
+    *pending = *size;
+
+    return retval;
 }
 
-static bool stream_put_u8_masked(struct wic_stream *self, uint8_t value, const uint8_t *mask, uint8_t *unmasked)
+static void pmd_tx_consume(struct wic_inst *self, size_t size)
 {
-    *unmasked = value ^ mask[self->pos % 4];
-
-    return stream_put_u8(self, *unmasked);
+    wic_deflate_consume(self->ext->deflate, size);
 }
 
-static char b64_encode_byte(uint8_t in)
+static enum wic_ext_status pmd_rx_write(struct wic_inst *self, const void *data, size_t size, size_t *used)
 {
-     static const char map[] = {
-        'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-        'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-        'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-        'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-        'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-        'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-        'w', 'x', 'y', 'z', '0', '1', '2', '3',
-        '4', '5', '6', '7', '8', '9', '+', '/'
-    };
+    enum wic_ext_status retval;
 
-    return map[in & 0x3fU];
+    switch(wic_inflate(self->ext->inflate, data, size, used)){
+    case WIC_INFLATE_OK:
+        retval = WIC_EXT_OK;
+        break;
+    case WIC_INFLATE_FULL:
+        retval = WIC_EXT_FULL;
+        break;
+    default:
+        retval = WIC_EXT_ERROR;
+        break;
+    }
+
+    return retval;
 }
 
-static size_t b64_encode(const void *in, size_t len, char *out, size_t max)
+/* put back the tail the sender removed from the end of the message */
+static enum wic_ext_status pmd_rx_end(struct wic_inst *self, bool fin)
 {
-    uint8_t c;
-    uint8_t acc = 0U;
-    size_t i;
-    size_t retval = 0;
+    static const uint8_t tail[] = {0x00U, 0x00U, 0xffU, 0xffU};
 
-    if((max >= b64_encoded_size(len)) && (b64_encoded_size(len) >= len)){
+    enum wic_ext_status retval = WIC_EXT_OK;
+    size_t used;
 
-        for(i=0U; i < len; i++){
+    if(fin){
 
-            c = ((const uint8_t *)in)[i];
+        retval = pmd_rx_write(self, &tail[self->ext->pmd_rx_tail], sizeof(tail) - self->ext->pmd_rx_tail, &used);
 
-            switch(i%3U){
-            default:
-            case 0U:
-                out[retval] = b64_encode_byte(c >> 2);
-                retval++;
-                acc = (c << 4);
-                break;
-            case 1U:
-                out[retval] = b64_encode_byte(acc | (c >> 4));
-                retval++;
-                acc = (c << 2);
-                break;
-            case 2U:
-                out[retval] = b64_encode_byte(acc | (c >> 6));
-                out[retval+1U] = b64_encode_byte(c);
-                retval += 2U;
-            }
-        }
+        self->ext->pmd_rx_tail += (uint8_t)used;
 
-        if((len % 3U) > 0U){
+        if(retval != WIC_EXT_FULL){
 
-            out[retval] = b64_encode_byte(acc);
-            out[retval+1U] = '=';
-            retval += 2U;
+            self->ext->pmd_rx_tail = 0U;
 
-            if((len % 3U) == 1U){
+            if((retval == WIC_EXT_OK) && !wic_inflate_end(self->ext->inflate, self->ext->pmd_rx_nct)){
 
-                out[retval] = '=';
-                retval++;
+                retval = WIC_EXT_ERROR;
             }
         }
     }
@@ -1817,116 +4151,214 @@ static size_t b64_encode(const void *in, size_t len, char *out, size_t max)
     return retval;
 }
 
-static size_t b64_encoded_size(size_t size)
+static const void *pmd_rx_output(struct wic_inst *self, size_t *size, size_t *pending)
 {
-    return (4 * ((size / 3) + ((size % 3) ? 1 : 0)));
+    return wic_inflate_output(self->ext->inflate, size, pending);
 }
 
-static int on_header_field(http_parser *http, const char *at, size_t length)
+static void pmd_rx_consume(struct wic_inst *self, size_t size)
 {
-    struct wic_inst *self = http->data;
+    wic_inflate_consume(self->ext->inflate, size);
+}
 
-    switch(self->header_state){
-    default:
-        return -1;
-    case WIC_HEADER_STATE_IDLE:
-    case WIC_HEADER_STATE_FIELD:
-        stream_write(&self->rx.s, at, length);
-        break;
-    case WIC_HEADER_STATE_VALUE:
-        stream_put_u8(&self->rx.s, 0U);
-        stream_write(&self->rx.s, at, length);
-        break;
+/* token (RFC7230) with any whitespace around it */
+static const char *ext_token(const char *in, const char **token, size_t *size)
+{
+    const char *ptr = skip_space(in);
+
+    *token = ptr;
+
+    while((*ptr != '\0') && ((isalnum((uint8_t)*ptr) != 0) || (strchr("!#$%&'*+-.^_`|~", *ptr) != NULL))){
+
+        ptr++;
     }
 
-    self->header_state = WIC_HEADER_STATE_FIELD;
+    *size = (size_t)(ptr - *token);
 
-    return 0;
+    return skip_space(ptr);
 }
 
-static int on_header_value(http_parser *http, const char *at, size_t length)
+/* token or quoted token, size is zero if there is no closing quote */
+static const char *ext_value(const char *in, const char **value, size_t *size)
 {
-    struct wic_inst *self = http->data;
+    const char *ptr = skip_space(in);
 
-    switch(self->header_state){
-    default:
-    case WIC_HEADER_STATE_IDLE:
-        return -1;
-    case WIC_HEADER_STATE_FIELD:
-        stream_put_u8(&self->rx.s, 0U);
-        stream_write(&self->rx.s, at, length);
-        break;
-    case WIC_HEADER_STATE_VALUE:
-        stream_write(&self->rx.s, at, length);
-        break;
+    if(*ptr == '"'){
+
+        ptr = ext_token(&ptr[1], value, size);
+
+        if(*ptr == '"'){
+
+            ptr = skip_space(&ptr[1]);
+        }
+        else{
+
+            *size = 0U;
+        }
     }
+    else{
 
-    self->header_state = WIC_HEADER_STATE_VALUE;
+        ptr = ext_token(ptr, value, size);
+    }
 
-    return 0;
+    return ptr;
 }
 
-static void server_hash(const char *nonce, size_t len, uint8_t *hash)
+static const char *skip_space(const char *in)
 {
-    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    sha1_context ctx;
+    const char *ptr = in;
 
-    sha1_init(&ctx);
-    (void)sha1_starts_ret(&ctx);
-    (void)sha1_update_ret(&ctx, (const uint8_t *)nonce, len);
-    (void)sha1_update_ret(&ctx, (const uint8_t *)guid, sizeof(guid)-1U);
-    (void)sha1_finish_ret(&ctx, hash);
+    while((*ptr == ' ') || (*ptr == '\t')){
+
+        ptr++;
+    }
+
+    return ptr;
 }
 
-static bool str_equal(const char *s1, const char *s2)
+static bool token_equal(const char *token, size_t size, const char *str)
+{
+    bool retval = (strlen(str) == size);
+    size_t i;
+
+    for(i=0U; retval && (i < size); i++){
+
+        retval = (tolower((uint8_t)token[i]) == tolower((uint8_t)str[i]));
+    }
+
+    return retval;
+}
+
+static void index_headers(struct wic_inst *self)
 {
-    bool retval = false;
     size_t pos = 0U;
+    size_t slot;
+    size_t i;
 
-    if((s1 != NULL) && (s2 != NULL)){
+    (void)memset(self->hs->header_index, 0, sizeof(self->hs->header_index));
+    self->hs->header_index_full = false;
 
-        retval = true;
+    while(pos < self->hs->rx_header.pos){
 
-        for(;;){
+        if(pos >= UINT16_MAX){
 
-            if(tolower(s1[pos]) != tolower(s2[pos])){
+            self->hs->header_index_full = true;
+            break;
+        }
 
-                retval = false;
-                break;
-            }
+        slot = str_hash(&self->hs->rx_header.read[pos]);
 
-            if(s1[pos] == 0){
+        for(i=0U; i < WIC_HEADER_INDEX_SIZE; i++){
+
+            slot &= (WIC_HEADER_INDEX_SIZE - 1U);
 
+            if(self->hs->header_index[slot] == 0U){
+
+                self->hs->header_index[slot] = pos + 1U;
                 break;
             }
 
-            pos++;
+            slot++;
+        }
+
+        if(i == WIC_HEADER_INDEX_SIZE){
+
+            self->hs->header_index_full = true;
+            break;
+        }
+
+        /* skip name and value */
+        pos += strlen(&self->hs->rx_header.read[pos]);
+        pos++;
+
+        WIC_ASSERT((self->hs->rx_header.pos-pos) > 0U)
+
+        pos += strlen(&self->hs->rx_header.read[pos]);
+        pos++;
+    }
+}
+
+static const char *find_header(const struct wic_inst *self, const char *name)
+{
+    const char *retval = NULL;
+    const char *ptr;
+    size_t slot = str_hash(name);
+    size_t i;
+
+    for(i=0U; i < WIC_HEADER_INDEX_SIZE; i++){
+
+        slot &= (WIC_HEADER_INDEX_SIZE - 1U);
+
+        if(self->hs->header_index[slot] == 0U){
+
+            break;
+        }
+
+        ptr = &self->hs->rx_header.read[self->hs->header_index[slot] - 1U];
+
+        if(str_equal(ptr, name)){
+
+            retval = &ptr[strlen(ptr) + 1U];
+            break;
         }
+
+        slot++;
     }
 
     return retval;
 }
 
+static bool header_available(const struct wic_inst *self)
+{
+    /* without a dedicated buffer the fields are overwritten by the first frame */
+    return (self->hs != NULL) && ((self->state == WIC_STATE_READY) || (self->hs->rx_header.read != self->rx.s.read));
+}
+
 static int on_request_complete(http_parser *http)
 {
     struct wic_inst *self = http->data;
     const char *header;
 
-    switch(self->header_state){
+    switch(self->hs->header_state){
     case WIC_HEADER_STATE_IDLE:
         break;
     case WIC_HEADER_STATE_FIELD:
         WIC_DEBUG("unexpected state")
         return -1;
     case WIC_HEADER_STATE_VALUE:
-        stream_put_u8(&self->rx.s, 0U);
+        stream_put_u8(&self->hs->rx_header, 0U);
         break;
     }
 
-    //check OK
+    if(stream_error(&self->hs->rx_header)){
+
+        WIC_DEBUG("handshake too large for buffer")
+        return -1;
+    }
+
+    index_headers(self);
 
+    /* fields can be read from here */
     self->state = WIC_STATE_READY;
 
+    if(http->method != HTTP_GET){
+
+        WIC_DEBUG("expecting GET method")
+        return -1;
+    }
+
+    if((http->http_major < 1U) || ((http->http_major == 1U) && (http->http_minor < 1U))){
+
+        WIC_DEBUG("expecting HTTP/1.1 or later")
+        return -1;
+    }
+
+    if(wic_get_header(self, "host") == NULL){
+
+        WIC_DEBUG("expecting a host field")
+        return -1;
+    }
+
     /* expecting to have recevieved Connection: Upgrade */
     if(http->upgrade != 1){
 
@@ -1949,7 +4381,14 @@ static int on_request_complete(http_parser *http)
         return -1;
     }
 
-    /* check the mandatory Sec-WebSocket-Accept */
+    if(!str_equal(wic_get_header(self, "Sec-WebSocket-Version"), "13")){
+
+        WIC_DEBUG("unsupported Sec-WebSocket-Version")
+        self->status_code = 426U;
+        return -1;
+    }
+
+    /* check the mandatory Sec-WebSocket-Key (16 bytes base64 encoded) */
     header = wic_get_header(self, "Sec-WebSocket-Key");
 
     if(header == NULL){
@@ -1958,9 +4397,13 @@ static int on_request_complete(http_parser *http)
         return -1;
     }
 
-    server_hash(header, strlen(header), self->hash);
+    if(strlen(header) != b64_encoded_size(16U)){
 
-    self->state = WIC_STATE_READY;
+        WIC_DEBUG("unexpected Sec-WebSocket-Key length")
+        return -1;
+    }
+
+    server_hash(header, strlen(header), self->hs->hash);
 
     return 0;
 }
@@ -1971,17 +4414,26 @@ static int on_response_complete(http_parser *http)
     const char *header;
     char b64_hash[29U];
 
-    WIC_ASSERT((b64_encoded_size(sizeof(self->hash))+1U) == sizeof(b64_hash))
+    WIC_ASSERT((b64_encoded_size(sizeof(self->hs->hash))+1U) == sizeof(b64_hash))
 
-    switch(self->header_state){
+    switch(self->hs->header_state){
     default:
         break;
     case WIC_HEADER_STATE_VALUE:
-        stream_put_u8(&self->rx.s, 0U);
+        stream_put_u8(&self->hs->rx_header, 0U);
         break;
     }
 
+    if(stream_error(&self->hs->rx_header)){
+
+        WIC_DEBUG("handshake too large for buffer")
+        return -1;
+    }
+
+    index_headers(self);
+
     self->state = WIC_STATE_READY;
+    self->status_code = (uint16_t)http->status_code;
 
     if(http->status_code != 101){
 
@@ -1992,7 +4444,7 @@ static int on_response_complete(http_parser *http)
         case 303U:
         case 304U:
         case 307U:
-            self->redirect_url = wic_get_header(self, "location");
+            self->hs->redirect_url = wic_get_header(self, "location");
             break;
         default:
             break;
@@ -2033,7 +4485,7 @@ static int on_response_complete(http_parser *http)
         return -1;
     }
 
-    b64_encode(self->hash, sizeof(self->hash), b64_hash, sizeof(b64_hash));
+    b64_encode(self->hs->hash, sizeof(self->hs->hash), b64_hash, sizeof(b64_hash));
     b64_hash[sizeof(b64_hash)-1U] = 0;
 
     if(strcmp(header, b64_hash) != 0){
@@ -2042,18 +4494,22 @@ static int on_response_complete(http_parser *http)
         return -1;
     }
 
+    /* extensions must have been offered */
+    header = wic_get_header(self, "Sec-WebSocket-Extensions");
+
+    if((header != NULL) && !accept_extensions(self, header)){
+
+        WIC_DEBUG("unexpected Sec-WebSocket-Extensions field value")
+        return -1;
+    }
+
     return 0;
 }
 
-static bool on_message(struct wic_inst *inst, enum wic_encoding encoding, bool fin, const char *data, uint16_t size)
+static bool on_message(struct wic_inst *self, enum wic_encoding encoding, bool fin, const char *data, size_t size)
 {
-    (void)inst;
-    (void)encoding;
-    (void)fin;
-    (void)data;
-    (void)size;
-
-    return true;
+    /* messages are dropped if there is no handler */
+    return (self->cb->on_message != NULL) ? self->cb->on_message(self, encoding, fin, data, size) : true;
 }
 
 #define UTF8
@@ -2107,19 +4563,89 @@ static uint16_t utf8_parse(uint16_t state, char in)
     return utf8d[256U + state*16U + type];
 }
 
-static uint16_t utf8_parse_string(uint16_t state, const char *in, uint16_t len)
+static uint16_t utf8_parse_string(uint16_t state, const char *in, size_t len)
 {
-    uint16_t i;
+    size_t i = 0U;
     uint16_t s = state;
 
-    for(i=0U; i < len; i++){
+    while(i < len){
+
+        /* runs of ASCII cannot change the state between codepoints */
+        if(utf8_is_complete(s)){
+
+            i += utf8_ascii_span(&in[i], len - i);
+
+            if(i == len){
+
+                break;
+            }
+        }
 
         s = utf8_parse(s, in[i]);
+        i++;
+
+        /* invalid is a sink state */
+        if(utf8_is_invalid(s)){
+
+            break;
+        }
     }
 
     return s;
 }
 
+static size_t utf8_ascii_span(const char *in, size_t len)
+{
+    size_t pos = 0U;
+    uint64_t word;
+
+    /* the vector loops only find the block containing the first non-ASCII
+     * byte, the word and byte loops find the exact position */
+#ifdef USE_AVX2
+    for(; (len - pos) >= sizeof(__m256i); pos += sizeof(__m256i)){
+
+        if(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)&in[pos])) != 0){
+
+            break;
+        }
+    }
+#endif
+
+#ifdef USE_SSE2
+    for(; (len - pos) >= sizeof(__m128i); pos += sizeof(__m128i)){
+
+        if(_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&in[pos])) != 0){
+
+            break;
+        }
+    }
+#endif
+
+#ifdef USE_NEON
+    for(; (len - pos) >= sizeof(uint8x16_t); pos += sizeof(uint8x16_t)){
+
+        if(vmaxvq_u8(vld1q_u8((const uint8_t *)&in[pos])) >= 0x80U){
+
+            break;
+        }
+    }
+#endif
+
+    for(; (len - pos) >= sizeof(word); pos += sizeof(word)){
+
+        (void)memcpy(&word, &in[pos], sizeof(word));
+
+        if((word & 0x8080808080808080ULL) != 0U){
+
+            break;
+        }
+    }
+
+    for(; (pos < len) && (((uint8_t)in[pos]) < 0x80U); pos++);
+
+    return pos;
+}
+
 static bool utf8_is_complete(uint16_t state)
 {
     return state == 0U;
@@ -0,0 +1,1761 @@
+/* Copyright (c) 2020 Cameron Harper
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#include "wic_deflate.h"
+#include <string.h>
+
+#define MAX_BITS        15U     /* longest code */
+#define TABLE_BITS      9U      /* codes up to this long are decoded by lookup */
+#define LITLEN_CODES    288U
+#define DIST_CODES      30U
+#define CLEN_CODES      19U
+
+#define MIN_MATCH       3U
+#define MAX_MATCH       258U
+#define MIN_LOOKAHEAD   (MAX_MATCH + MIN_MATCH + 1U)
+#define MIN_SLIDE       1024U   /* must be more than MIN_LOOKAHEAD */
+#define MAX_CHAIN       64U     /* hash chain entries searched per match */
+#define NICE_MATCH      128U    /* stop searching at a match this long */
+
+#define BLOCK_OVERHEAD  72U     /* worst case block header and flush */
+
+enum inflate_state {
+
+    INFLATE_HEADER,
+    INFLATE_STORED_LEN,
+    INFLATE_STORED,
+    INFLATE_DYN_HEADER,
+    INFLATE_DYN_CLEN,
+    INFLATE_DYN_LENS,
+    INFLATE_CODES,
+    INFLATE_COPY,
+    INFLATE_DONE
+};
+
+struct huffman {
+
+    uint16_t count[MAX_BITS + 1U];
+    uint16_t symbol[LITLEN_CODES];
+
+    /* (length << TABLE_BITS) | symbol, 0 if the code is longer */
+    uint16_t table[1U << TABLE_BITS];
+};
+
+struct wic_inflate {
+
+    /* history and output share a circular buffer */
+    uint8_t *window;
+    size_t size;
+    size_t next;
+    size_t have;
+    size_t pending;
+
+    uint64_t bits;
+    unsigned count;
+
+    enum inflate_state state;
+    bool last;
+
+    size_t copy_len;
+    size_t copy_dist;
+
+    unsigned hlit;
+    unsigned hdist;
+    unsigned hclen;
+    unsigned index;
+
+    uint16_t lens[LITLEN_CODES + DIST_CODES + 2U];
+
+    struct huffman lencode;
+    struct huffman distcode;
+};
+
+struct wic_deflate {
+
+    /* input is appended at strstart + lookahead and slid down by
+     * slide bytes when it reaches the end */
+    uint8_t *window;
+    size_t slide;
+    size_t strstart;
+    size_t lookahead;
+
+    /* hash chains (0 is the end of a chain) */
+    uint16_t *head;
+    uint16_t *prev;
+    size_t wmask;
+    size_t dist_max;
+    unsigned hash_shift;
+    size_t hash_size;
+
+    /* symbols waiting to be written as a block
+     *
+     * (distance << 16) | literal, or (distance << 16) | (256 + length)
+     *
+     * */
+    uint32_t *syms;
+    size_t nsyms;
+    size_t max_syms;
+
+    uint8_t *out;
+    size_t out_size;
+    size_t out_len;
+    size_t out_read;
+
+    uint64_t bitbuf;
+    unsigned bitcount;
+
+    uint32_t lit_freq[LITLEN_CODES];
+    uint32_t dist_freq[DIST_CODES];
+
+    uint8_t lit_len[LITLEN_CODES];
+    uint16_t lit_code[LITLEN_CODES];
+    uint8_t dist_len[DIST_CODES];
+    uint16_t dist_code[DIST_CODES];
+
+    uint32_t clen_freq[CLEN_CODES];
+    uint8_t clen_len[CLEN_CODES];
+    uint16_t clen_code[CLEN_CODES];
+
+    /* run length encoded code lengths, (extra << 5) | symbol */
+    uint16_t rle[LITLEN_CODES + DIST_CODES];
+    size_t nrle;
+    unsigned hlit;
+    unsigned hdist;
+    unsigned hclen;
+
+    /* scratch for building code lengths */
+    uint32_t weight[2U * LITLEN_CODES];
+    uint16_t parent[2U * LITLEN_CODES];
+    uint16_t sorted[LITLEN_CODES];
+
+    uint8_t length_code[MAX_MATCH - MIN_MATCH + 1U];
+    uint8_t distance_code[512U];
+};
+
+static const uint16_t len_base[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t len_extra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const uint8_t clen_order[] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* static prototypes **************************************************/
+
+static size_t align_size(size_t size);
+static void *align_ptr(void *ptr);
+static uint16_t reverse_bits(uint16_t code, unsigned len);
+
+static int huffman_build(struct huffman *h, const uint16_t *lens, size_t n);
+static int huffman_decode(const struct huffman *h, uint64_t bits, unsigned count, unsigned *symbol);
+static void inflate_fixed(struct wic_inflate *self);
+static void inflate_drop(struct wic_inflate *self, unsigned n);
+static void inflate_put(struct wic_inflate *self, uint8_t c);
+static void inflate_copy(struct wic_inflate *self);
+static bool inflate_dyn_lens(struct wic_inflate *self);
+static enum wic_inflate_status inflate_codes(struct wic_inflate *self, const uint8_t *in, size_t size, size_t *pos);
+
+static void deflate_slide(struct wic_deflate *self);
+static size_t deflate_hash(const struct wic_deflate *self, size_t pos);
+static void deflate_insert(struct wic_deflate *self, size_t pos);
+static size_t deflate_match(const struct wic_deflate *self, size_t cur, size_t *dist);
+static size_t match_length(const uint8_t *a, const uint8_t *b, size_t max);
+static bool deflate_compress(struct wic_deflate *self, bool flush);
+static unsigned deflate_dist_code(const struct wic_deflate *self, size_t dist);
+static bool deflate_block(struct wic_deflate *self);
+static size_t deflate_dynamic(struct wic_deflate *self);
+static size_t deflate_fixed(const struct wic_deflate *self);
+static void set_fixed(uint8_t *lit_len, uint8_t *dist_len);
+static void deflate_rle(struct wic_deflate *self);
+static void build_lengths(struct wic_deflate *self, const uint32_t *freq, size_t n, unsigned limit, uint8_t *lens);
+static void build_codes(const uint8_t *lens, size_t n, uint16_t *codes);
+static void put_bits(struct wic_deflate *self, uint32_t value, unsigned n);
+static void put_align(struct wic_deflate *self);
+
+/* functions **********************************************************/
+
+size_t wic_inflate_size(uint8_t window_bits)
+{
+    return align_size(sizeof(struct wic_inflate)) + sizeof(uint64_t) + (1UL << window_bits);
+}
+
+struct wic_inflate *wic_inflate_init(void *buf, size_t max, uint8_t window_bits)
+{
+    struct wic_inflate *self = NULL;
+
+    if(max >= wic_inflate_size(window_bits)){
+
+        self = align_ptr(buf);
+
+        (void)memset(self, 0, sizeof(*self));
+
+        self->window = (uint8_t *)self + align_size(sizeof(*self));
+        self->size = 1UL << window_bits;
+        self->state = INFLATE_HEADER;
+    }
+
+    return self;
+}
+
+enum wic_inflate_status wic_inflate(struct wic_inflate *self, const void *in, size_t size, size_t *used)
+{
+    enum wic_inflate_status retval = WIC_INFLATE_OK;
+    const uint8_t *ptr = in;
+    size_t pos = 0U;
+    size_t n;
+    size_t before;
+    int err;
+    bool more = false;
+
+    while(retval == WIC_INFLATE_OK){
+
+        before = pos;
+
+        while((self->count <= 56U) && (pos < size)){
+
+            self->bits |= ((uint64_t)ptr[pos]) << self->count;
+            self->count += 8U;
+            pos++;
+        }
+
+        /* more is set when a state needs bits which aren't here */
+        if(more){
+
+            if(pos == before){
+
+                break;
+            }
+
+            more = false;
+        }
+
+        switch(self->state){
+        default:
+        case INFLATE_HEADER:
+
+            if(self->count < 3U){
+
+                more = true;
+            }
+            else{
+
+                self->last = ((self->bits & 1U) != 0U);
+
+                switch((self->bits >> 1) & 3U){
+                case 0U:
+                    inflate_drop(self, 3U);
+                    inflate_drop(self, self->count & 7U);
+                    self->state = INFLATE_STORED_LEN;
+                    break;
+                case 1U:
+                    inflate_drop(self, 3U);
+                    inflate_fixed(self);
+                    self->state = INFLATE_CODES;
+                    break;
+                case 2U:
+                    inflate_drop(self, 3U);
+                    self->state = INFLATE_DYN_HEADER;
+                    break;
+                default:
+                    retval = WIC_INFLATE_ERROR;
+                    break;
+                }
+            }
+            break;
+
+        case INFLATE_STORED_LEN:
+
+            if(self->count < 32U){
+
+                more = true;
+            }
+            else if((self->bits & 0xffffU) != ((~self->bits >> 16) & 0xffffU)){
+
+                retval = WIC_INFLATE_ERROR;
+            }
+            else{
+
+                self->copy_len = self->bits & 0xffffU;
+                inflate_drop(self, 32U);
+                self->state = INFLATE_STORED;
+            }
+            break;
+
+        case INFLATE_STORED:
+
+            /* whatever is in the bit buffer goes first */
+            while((self->copy_len > 0U) && (self->count >= 8U) && (self->pending < self->size)){
+
+                inflate_put(self, self->bits);
+                inflate_drop(self, 8U);
+                self->copy_len--;
+            }
+
+            while((self->copy_len > 0U) && (self->count == 0U) && (pos < size) && (self->pending < self->size)){
+
+                n = self->size - self->next;
+                n = (n > (self->size - self->pending)) ? (self->size - self->pending) : n;
+                n = (n > (size - pos)) ? (size - pos) : n;
+                n = (n > self->copy_len) ? self->copy_len : n;
+
+                (void)memcpy(&self->window[self->next], &ptr[pos], n);
+
+                self->next = (self->next + n) & (self->size - 1U);
+                self->pending += n;
+                self->have = ((self->have + n) > self->size) ? self->size : (self->have + n);
+                self->copy_len -= n;
+                pos += n;
+            }
+
+            if(self->copy_len == 0U){
+
+                self->state = self->last ? INFLATE_DONE : INFLATE_HEADER;
+            }
+            else if(self->pending == self->size){
+
+                retval = WIC_INFLATE_FULL;
+            }
+            else{
+
+                more = true;
+            }
+            break;
+
+        case INFLATE_DYN_HEADER:
+
+            if(self->count < 14U){
+
+                more = true;
+            }
+            else{
+
+                self->hlit = (self->bits & 0x1fU) + 257U;
+                self->hdist = ((self->bits >> 5) & 0x1fU) + 1U;
+                self->hclen = ((self->bits >> 10) & 0xfU) + 4U;
+                self->index = 0U;
+
+                inflate_drop(self, 14U);
+
+                (void)memset(self->lens, 0, sizeof(self->lens));
+
+                if((self->hlit > 286U) || (self->hdist > DIST_CODES)){
+
+                    retval = WIC_INFLATE_ERROR;
+                }
+                else{
+
+                    self->state = INFLATE_DYN_CLEN;
+                }
+            }
+            break;
+
+        case INFLATE_DYN_CLEN:
+
+            while((self->index < self->hclen) && (self->count >= 3U)){
+
+                self->lens[clen_order[self->index]] = self->bits & 7U;
+                inflate_drop(self, 3U);
+                self->index++;
+            }
+
+            if(self->index < self->hclen){
+
+                more = true;
+            }
+            /* code length code must be complete */
+            else if(huffman_build(&self->lencode, self->lens, CLEN_CODES) != 0){
+
+                retval = WIC_INFLATE_ERROR;
+            }
+            else{
+
+                self->index = 0U;
+                (void)memset(self->lens, 0, sizeof(self->lens));
+                self->state = INFLATE_DYN_LENS;
+            }
+            break;
+
+        case INFLATE_DYN_LENS:
+
+            if(!inflate_dyn_lens(self)){
+
+                retval = WIC_INFLATE_ERROR;
+            }
+            else if(self->index < (self->hlit + self->hdist)){
+
+                more = true;
+            }
+            else{
+
+                /* incomplete codes are only allowed if there is a
+                 * single code */
+                err = huffman_build(&self->lencode, self->lens, self->hlit);
+
+                if((self->lens[256] == 0U) || (err < 0) || ((err > 0) && (self->hlit != (self->lencode.count[0] + self->lencode.count[1])))){
+
+                    retval = WIC_INFLATE_ERROR;
+                }
+                else{
+
+                    err = huffman_build(&self->distcode, &self->lens[self->hlit], self->hdist);
+
+                    if((err < 0) || ((err > 0) && (self->hdist != (self->distcode.count[0] + self->distcode.count[1])))){
+
+                        retval = WIC_INFLATE_ERROR;
+                    }
+                    else{
+
+                        self->state = INFLATE_CODES;
+                    }
+                }
+            }
+            break;
+
+        case INFLATE_CODES:
+
+            retval = inflate_codes(self, ptr, size, &pos);
+
+            if((retval == WIC_INFLATE_OK) && (self->state == INFLATE_CODES)){
+
+                more = true;
+            }
+            break;
+
+        case INFLATE_COPY:
+
+            inflate_copy(self);
+
+            if(self->copy_len > 0U){
+
+                retval = WIC_INFLATE_FULL;
+            }
+            else{
+
+                self->state = INFLATE_CODES;
+            }
+            break;
+
+        case INFLATE_DONE:
+
+            /* anything after the final block is ignored */
+            pos = size;
+            self->bits = 0U;
+            self->count = 0U;
+            more = true;
+            break;
+        }
+    }
+
+    *used = pos;
+
+    return retval;
+}
+
+const char *wic_inflate_output(const struct wic_inflate *self, size_t *size, size_t *pending)
+{
+    size_t start = (self->next - self->pending) & (self->size - 1U);
+
+    *pending = self->pending;
+    *size = ((start + self->pending) > self->size) ? (self->size - start) : self->pending;
+
+    return (const char *)&self->window[start];
+}
+
+void wic_inflate_consume(struct wic_inflate *self, size_t size)
+{
+    self->pending -= (size > self->pending) ? self->pending : size;
+}
+
+bool wic_inflate_end(struct wic_inflate *self, bool no_context_takeover)
+{
+    bool retval = (self->state == INFLATE_DONE) || ((self->state == INFLATE_HEADER) && (self->count == 0U));
+
+    self->state = INFLATE_HEADER;
+    self->bits = 0U;
+    self->count = 0U;
+    self->last = false;
+
+    if(no_context_takeover){
+
+        self->have = 0U;
+    }
+
+    return retval;
+}
+
+size_t wic_deflate_size(uint8_t window_bits)
+{
+    size_t wsize = 1UL << window_bits;
+    size_t slide = (wsize > MIN_SLIDE) ? wsize : MIN_SLIDE;
+    size_t hash_size = 1UL << ((window_bits > 9U) ? (window_bits - 1U) : 8U);
+    size_t max_syms = ((wsize / 4U) > 128U) ? (wsize / 4U) : 128U;
+
+    return sizeof(uint64_t)
+        + align_size(sizeof(struct wic_deflate))
+        + align_size(2U * slide)
+        + align_size(hash_size * sizeof(uint16_t))
+        + align_size(wsize * sizeof(uint16_t))
+        + align_size(max_syms * sizeof(uint32_t))
+        + align_size((4U * max_syms) + BLOCK_OVERHEAD);
+}
+
+struct wic_deflate *wic_deflate_init(void *buf, size_t max, uint8_t window_bits)
+{
+    struct wic_deflate *self = NULL;
+    uint8_t *ptr;
+    size_t wsize = 1UL << window_bits;
+    size_t hash_bits = (window_bits > 9U) ? (window_bits - 1U) : 8U;
+    size_t code;
+    size_t i;
+
+    if(max >= wic_deflate_size(window_bits)){
+
+        self = align_ptr(buf);
+
+        (void)memset(self, 0, sizeof(*self));
+
+        self->slide = (wsize > MIN_SLIDE) ? wsize : MIN_SLIDE;
+        self->wmask = wsize - 1U;
+        self->dist_max = wsize - 1U;
+        self->hash_size = 1UL << hash_bits;
+        self->hash_shift = 32U - hash_bits;
+        self->max_syms = ((wsize / 4U) > 128U) ? (wsize / 4U) : 128U;
+        self->out_size = (4U * self->max_syms) + BLOCK_OVERHEAD;
+
+        ptr = (uint8_t *)self + align_size(sizeof(*self));
+
+        self->window = ptr;
+        ptr += align_size(2U * self->slide);
+
+        self->head = (uint16_t *)ptr;
+        ptr += align_size(self->hash_size * sizeof(uint16_t));
+
+        self->prev = (uint16_t *)ptr;
+        ptr += align_size(wsize * sizeof(uint16_t));
+
+        self->syms = (uint32_t *)ptr;
+        ptr += align_size(self->max_syms * sizeof(uint32_t));
+
+        self->out = ptr;
+
+        (void)memset(self->head, 0, self->hash_size * sizeof(uint16_t));
+
+        for(code=0U; code < sizeof(len_base)/sizeof(*len_base); code++){
+
+            for(i=0U; i < (1UL << len_extra[code]); i++){
+
+                if((len_base[code] + i) <= MAX_MATCH){
+
+                    self->length_code[len_base[code] + i - MIN_MATCH] = code;
+                }
+            }
+        }
+
+        /* distances up to 256 are looked up directly, the rest
+         * by (distance - 1) >> 7 */
+        for(code=0U; code < DIST_CODES; code++){
+
+            for(i=0U; i < (1UL << dist_extra[code]); i++){
+
+                if((dist_base[code] + i - 1U) < 256U){
+
+                    self->distance_code[dist_base[code] + i - 1U] = code;
+                }
+                else{
+
+                    self->distance_code[256U + ((dist_base[code] + i - 1U) >> 7)] = code;
+                }
+            }
+        }
+    }
+
+    return self;
+}
+
+void wic_deflate_window(struct wic_deflate *self, uint8_t window_bits)
+{
+    size_t dist_max = (1UL << window_bits) - 1U;
+
+    self->dist_max = (dist_max < self->wmask) ? dist_max : self->wmask;
+}
+
+size_t wic_deflate(struct wic_deflate *self, const void *in, size_t size)
+{
+    size_t retval = 0U;
+    size_t end;
+    size_t n;
+
+    while(deflate_compress(self, false)){
+
+        end = self->strstart + self->lookahead;
+
+        if((end == (2U * self->slide)) && (self->strstart >= self->slide)){
+
+            deflate_slide(self);
+            end -= self->slide;
+        }
+
+        n = (2U * self->slide) - end;
+        n = (n > (size - retval)) ? (size - retval) : n;
+
+        if(n == 0U){
+
+            break;
+        }
+
+        (void)memcpy(&self->window[end], &((const uint8_t *)in)[retval], n);
+
+        self->lookahead += n;
+        retval += n;
+    }
+
+    return retval;
+}
+
+bool wic_deflate_flush(struct wic_deflate *self, bool end)
+{
+    bool retval = false;
+
+    if(deflate_compress(self, true) && deflate_block(self)){
+
+        if((self->out_size - self->out_len) >= 8U){
+
+            /* empty stored block */
+            put_bits(self, 0U, 3U);
+            put_align(self);
+
+            if(!end){
+
+                self->out[self->out_len] = 0x00U;
+                self->out[self->out_len+1U] = 0x00U;
+                self->out[self->out_len+2U] = 0xffU;
+                self->out[self->out_len+3U] = 0xffU;
+                self->out_len += 4U;
+            }
+
+            retval = true;
+        }
+    }
+
+    return retval;
+}
+
+const void *wic_deflate_output(const struct wic_deflate *self, size_t *size)
+{
+    *size = self->out_len - self->out_read;
+
+    return &self->out[self->out_read];
+}
+
+void wic_deflate_consume(struct wic_deflate *self, size_t size)
+{
+    self->out_read += ((self->out_len - self->out_read) < size) ? (self->out_len - self->out_read) : size;
+
+    if(self->out_read == self->out_len){
+
+        self->out_read = 0U;
+        self->out_len = 0U;
+    }
+}
+
+void wic_deflate_reset(struct wic_deflate *self)
+{
+    (void)memset(self->head, 0, self->hash_size * sizeof(uint16_t));
+
+    self->strstart = 0U;
+    self->lookahead = 0U;
+}
+
+/* static functions ***************************************************/
+
+static size_t align_size(size_t size)
+{
+    return (size + (sizeof(uint64_t) - 1U)) & ~(sizeof(uint64_t) - 1U);
+}
+
+static void *align_ptr(void *ptr)
+{
+    return (void *)(((uintptr_t)ptr + (sizeof(uint64_t) - 1U)) & ~(uintptr_t)(sizeof(uint64_t) - 1U));
+}
+
+static uint16_t reverse_bits(uint16_t code, unsigned len)
+{
+    uint16_t retval = 0U;
+    unsigned i;
+
+    for(i=0U; i < len; i++){
+
+        retval = (retval << 1) | (code & 1U);
+        code >>= 1;
+    }
+
+    return retval;
+}
+
+/* based on puff.c by Mark Adler
+ *
+ * returns 0 for a complete code, < 0 if over-subscribed and > 0
+ * if incomplete */
+static int huffman_build(struct huffman *h, const uint16_t *lens, size_t n)
+{
+    uint16_t offs[MAX_BITS + 1U];
+    int left = 1;
+    unsigned len;
+    unsigned code = 0U;
+    unsigned index = 0U;
+    unsigned fill;
+    size_t symbol;
+
+    (void)memset(h->count, 0, sizeof(h->count));
+    (void)memset(h->table, 0, sizeof(h->table));
+
+    for(symbol=0U; symbol < n; symbol++){
+
+        h->count[lens[symbol]]++;
+    }
+
+    if(h->count[0] != n){
+
+        for(len=1U; len <= MAX_BITS; len++){
+
+            left <<= 1;
+            left -= h->count[len];
+
+            if(left < 0){
+
+                break;
+            }
+        }
+
+        if(left >= 0){
+
+            offs[1] = 0U;
+
+            for(len=1U; len < MAX_BITS; len++){
+
+                offs[len + 1U] = offs[len] + h->count[len];
+            }
+
+            for(symbol=0U; symbol < n; symbol++){
+
+                if(lens[symbol] != 0U){
+
+                    h->symbol[offs[lens[symbol]]] = symbol;
+                    offs[lens[symbol]]++;
+                }
+            }
+
+            /* canonical codes in symbol order fill the lookup table */
+            for(len=1U; len <= TABLE_BITS; len++){
+
+                for(symbol=0U; symbol < h->count[len]; symbol++){
+
+                    for(fill = reverse_bits(code, len); fill < (1U << TABLE_BITS); fill += (1U << len)){
+
+                        h->table[fill] = (len << TABLE_BITS) | h->symbol[index];
+                    }
+
+                    code++;
+                    index++;
+                }
+
+                code <<= 1;
+            }
+        }
+    }
+    else{
+
+        left = 0;
+    }
+
+    return left;
+}
+
+/* returns length of the code at the bottom of bits, 0 if more bits are
+ * needed, or -1 if there is no such code */
+static int huffman_decode(const struct huffman *h, uint64_t bits, unsigned count, unsigned *symbol)
+{
+    int retval = -1;
+    uint16_t entry = h->table[bits & ((1U << TABLE_BITS) - 1U)];
+    unsigned len;
+    int code = 0;
+    int first = 0;
+    int index = 0;
+
+    if(entry != 0U){
+
+        retval = ((entry >> TABLE_BITS) <= count) ? (int)(entry >> TABLE_BITS) : 0;
+        *symbol = entry & ((1U << TABLE_BITS) - 1U);
+    }
+    else{
+
+        for(len=1U; len <= MAX_BITS; len++){
+
+            if(len > count){
+
+                retval = 0;
+                break;
+            }
+
+            code |= (int)(bits & 1U);
+            bits >>= 1;
+
+            if(code < (first + h->count[len])){
+
+                *symbol = h->symbol[index + (code - first)];
+                retval = len;
+                break;
+            }
+
+            index += h->count[len];
+            first += h->count[len];
+            first <<= 1;
+            code <<= 1;
+        }
+    }
+
+    return retval;
+}
+
+static void inflate_fixed(struct wic_inflate *self)
+{
+    uint8_t lit_len[LITLEN_CODES];
+    uint8_t dist_len[DIST_CODES];
+    size_t symbol;
+
+    set_fixed(lit_len, dist_len);
+
+    for(symbol=0U; symbol < LITLEN_CODES; symbol++){
+
+        self->lens[symbol] = lit_len[symbol];
+    }
+
+    (void)huffman_build(&self->lencode, self->lens, LITLEN_CODES);
+
+    for(symbol=0U; symbol < DIST_CODES; symbol++){
+
+        self->lens[symbol] = dist_len[symbol];
+    }
+
+    (void)huffman_build(&self->distcode, self->lens, DIST_CODES);
+}
+
+static void inflate_drop(struct wic_inflate *self, unsigned n)
+{
+    self->bits >>= n;
+    self->count -= n;
+}
+
+static void inflate_put(struct wic_inflate *self, uint8_t c)
+{
+    self->window[self->next] = c;
+    self->next = (self->next + 1U) & (self->size - 1U);
+    self->pending++;
+
+    if(self->have < self->size){
+
+        self->have++;
+    }
+}
+
+static void inflate_copy(struct wic_inflate *self)
+{
+    size_t from = (self->next - self->copy_dist) & (self->size - 1U);
+    size_t n = self->size - self->pending;
+
+    n = (n > self->copy_len) ? self->copy_len : n;
+
+    self->copy_len -= n;
+
+    /* non-overlapping without wrapping (the source can be ahead of
+     * next when it has wrapped) */
+    if(((from + n) <= self->size) && ((self->next + n) <= self->size) && (((from + n) <= self->next) || ((self->next + n) <= from))){
+
+        (void)memcpy(&self->window[self->next], &self->window[from], n);
+
+        self->next = (self->next + n) & (self->size - 1U);
+        self->pending += n;
+        self->have = ((self->have + n) > self->size) ? self->size : (self->have + n);
+    }
+    else{
+
+        while(n > 0U){
+
+            inflate_put(self, self->window[from]);
+            from = (from + 1U) & (self->size - 1U);
+            n--;
+        }
+    }
+}
+
+static bool inflate_dyn_lens(struct wic_inflate *self)
+{
+    bool retval = true;
+    unsigned symbol;
+    unsigned extra;
+    unsigned repeat;
+    uint16_t len;
+    int n;
+
+    while(retval && (self->index < (self->hlit + self->hdist))){
+
+        n = huffman_decode(&self->lencode, self->bits, self->count, &symbol);
+
+        if(n < 0){
+
+            retval = false;
+        }
+        else if(n == 0){
+
+            break;
+        }
+        else if(symbol < 16U){
+
+            inflate_drop(self, n);
+            self->lens[self->index] = symbol;
+            self->index++;
+        }
+        else{
+
+            switch(symbol){
+            case 16U:
+                extra = 2U;
+                repeat = 3U;
+                break;
+            case 17U:
+                extra = 3U;
+                repeat = 3U;
+                break;
+            default:
+                extra = 7U;
+                repeat = 11U;
+                break;
+            }
+
+            if(self->count < (n + extra)){
+
+                break;
+            }
+
+            repeat += (self->bits >> n) & ((1U << extra) - 1U);
+
+            if((symbol == 16U) && (self->index == 0U)){
+
+                retval = false;
+            }
+            else if((self->index + repeat) > (self->hlit + self->hdist)){
+
+                retval = false;
+            }
+            else{
+
+                len = (symbol == 16U) ? self->lens[self->index - 1U] : 0U;
+
+                inflate_drop(self, n + extra);
+
+                while(repeat > 0U){
+
+                    self->lens[self->index] = len;
+                    self->index++;
+                    repeat--;
+                }
+            }
+        }
+    }
+
+    return retval;
+}
+
+static enum wic_inflate_status inflate_codes(struct wic_inflate *self, const uint8_t *in, size_t size, size_t *pos)
+{
+    enum wic_inflate_status retval = WIC_INFLATE_OK;
+    unsigned symbol;
+    unsigned dsymbol;
+    unsigned need;
+    int n;
+    int dn;
+
+    for(;;){
+
+        while((self->count <= 56U) && (*pos < size)){
+
+            self->bits |= ((uint64_t)in[*pos]) << self->count;
+            self->count += 8U;
+            (*pos)++;
+        }
+
+        n = huffman_decode(&self->lencode, self->bits, self->count, &symbol);
+
+        if(n <= 0){
+
+            retval = (n < 0) ? WIC_INFLATE_ERROR : WIC_INFLATE_OK;
+            break;
+        }
+
+        if(symbol < 256U){
+
+            if(self->pending == self->size){
+
+                retval = WIC_INFLATE_FULL;
+                break;
+            }
+
+            inflate_drop(self, n);
+            inflate_put(self, symbol);
+        }
+        else if(symbol == 256U){
+
+            inflate_drop(self, n);
+            self->state = self->last ? INFLATE_DONE : INFLATE_HEADER;
+            break;
+        }
+        else{
+
+            symbol -= 257U;
+
+            if(symbol >= (sizeof(len_base)/sizeof(*len_base))){
+
+                retval = WIC_INFLATE_ERROR;
+                break;
+            }
+
+            /* the whole length/distance pair must be here before any
+             * of it is consumed */
+            need = n + len_extra[symbol];
+
+            if(self->count < need){
+
+                break;
+            }
+
+            dn = huffman_decode(&self->distcode, self->bits >> need, self->count - need, &dsymbol);
+
+            if(dn <= 0){
+
+                retval = (dn < 0) ? WIC_INFLATE_ERROR : WIC_INFLATE_OK;
+                break;
+            }
+
+            if(dsymbol >= DIST_CODES){
+
+                retval = WIC_INFLATE_ERROR;
+                break;
+            }
+
+            if(self->count < (need + dn + dist_extra[dsymbol])){
+
+                break;
+            }
+
+            self->copy_len = len_base[symbol] + ((self->bits >> n) & ((1U << len_extra[symbol]) - 1U));
+            self->copy_dist = dist_base[dsymbol] + ((self->bits >> (need + dn)) & ((1U << dist_extra[dsymbol]) - 1U));
+
+            if(self->copy_dist > self->have){
+
+                retval = WIC_INFLATE_ERROR;
+                break;
+            }
+
+            inflate_drop(self, need + dn + dist_extra[dsymbol]);
+
+            inflate_copy(self);
+
+            if(self->copy_len > 0U){
+
+                self->state = INFLATE_COPY;
+                retval = WIC_INFLATE_FULL;
+                break;
+            }
+        }
+    }
+
+    return retval;
+}
+
+static void deflate_slide(struct wic_deflate *self)
+{
+    size_t i;
+
+    (void)memcpy(self->window, &self->window[self->slide], self->slide);
+
+    self->strstart -= self->slide;
+
+    for(i=0U; i < self->hash_size; i++){
+
+        self->head[i] = (self->head[i] > self->slide) ? (self->head[i] - self->slide) : 0U;
+    }
+
+    for(i=0U; i <= self->wmask; i++){
+
+        self->prev[i] = (self->prev[i] > self->slide) ? (self->prev[i] - self->slide) : 0U;
+    }
+}
+
+static size_t deflate_hash(const struct wic_deflate *self, size_t pos)
+{
+    uint32_t v = self->window[pos]
+        | ((uint32_t)self->window[pos + 1U] << 8)
+        | ((uint32_t)self->window[pos + 2U] << 16);
+
+    return (uint32_t)(v * 2654435761UL) >> self->hash_shift;
+}
+
+static void deflate_insert(struct wic_deflate *self, size_t pos)
+{
+    size_t h = deflate_hash(self, pos);
+
+    self->prev[pos & self->wmask] = self->head[h];
+    self->head[h] = pos;
+}
+
+static size_t deflate_match(const struct wic_deflate *self, size_t cur, size_t *dist)
+{
+    const uint8_t *scan = &self->window[cur];
+    size_t best = MIN_MATCH - 1U;
+    size_t max = (self->lookahead < MAX_MATCH) ? self->lookahead : MAX_MATCH;
+    size_t limit = (cur > self->dist_max) ? (cur - self->dist_max) : 0U;
+    size_t p = self->head[deflate_hash(self, cur)];
+    size_t chain = MAX_CHAIN;
+    size_t len;
+
+    while((p >= limit) && (p > 0U) && (p < cur) && (chain > 0U)){
+
+        if((self->window[p + best] == scan[best]) && (self->window[p] == scan[0])){
+
+            len = match_length(&self->window[p], scan, max);
+
+            if(len > best){
+
+                best = len;
+                *dist = cur - p;
+
+                if(len >= NICE_MATCH){
+
+                    break;
+                }
+            }
+        }
+
+        p = self->prev[p & self->wmask];
+        chain--;
+    }
+
+    return (best >= MIN_MATCH) ? best : 0U;
+}
+
+static size_t match_length(const uint8_t *a, const uint8_t *b, size_t max)
+{
+    size_t len = 0U;
+    uint64_t x;
+    uint64_t y;
+
+    while((max - len) >= sizeof(x)){
+
+        (void)memcpy(&x, &a[len], sizeof(x));
+        (void)memcpy(&y, &b[len], sizeof(y));
+
+        if(x != y){
+
+            break;
+        }
+
+        len += sizeof(x);
+    }
+
+    while((len < max) && (a[len] == b[len])){
+
+        len++;
+    }
+
+    return len;
+}
+
+/* returns false if a block is waiting for space in the output */
+static bool deflate_compress(struct wic_deflate *self, bool flush)
+{
+    bool retval = true;
+    size_t len;
+    size_t dist = 0U;
+    size_t i;
+
+    while((self->lookahead >= MIN_LOOKAHEAD) || (flush && (self->lookahead > 0U))){
+
+        if((self->nsyms == self->max_syms) && !deflate_block(self)){
+
+            retval = false;
+            break;
+        }
+
+        len = (self->lookahead >= MIN_MATCH) ? deflate_match(self, self->strstart, &dist) : 0U;
+
+        if(len > 0U){
+
+            self->syms[self->nsyms] = (dist << 16) | (256U + len);
+            self->lit_freq[257U + self->length_code[len - MIN_MATCH]]++;
+            self->dist_freq[deflate_dist_code(self, dist)]++;
+
+            for(i=0U; i < len; i++){
+
+                if((self->lookahead - i) >= MIN_MATCH){
+
+                    deflate_insert(self, self->strstart + i);
+                }
+            }
+        }
+        else{
+
+            len = 1U;
+
+            self->syms[self->nsyms] = self->window[self->strstart];
+            self->lit_freq[self->window[self->strstart]]++;
+
+            if(self->lookahead >= MIN_MATCH){
+
+                deflate_insert(self, self->strstart);
+            }
+        }
+
+        self->nsyms++;
+        self->strstart += len;
+        self->lookahead -= len;
+    }
+
+    return retval;
+}
+
+static unsigned deflate_dist_code(const struct wic_deflate *self, size_t dist)
+{
+    return ((dist - 1U) < 256U) ? self->distance_code[dist - 1U] : self->distance_code[256U + ((dist - 1U) >> 7)];
+}
+
+/* write symbols as a fixed or dynamic block, whichever is smaller
+ *
+ * returns false if there isn't enough output space
+ *
+ * */
+static bool deflate_block(struct wic_deflate *self)
+{
+    bool retval = true;
+    bool dynamic;
+    size_t i;
+    size_t len;
+    size_t dist;
+    unsigned code;
+    uint32_t sym;
+
+    if(self->nsyms > 0U){
+
+        if((self->out_size - self->out_len) < ((4U * self->nsyms) + BLOCK_OVERHEAD)){
+
+            (void)memmove(self->out, &self->out[self->out_read], self->out_len - self->out_read);
+            self->out_len -= self->out_read;
+            self->out_read = 0U;
+        }
+
+        if((self->out_size - self->out_len) < ((4U * self->nsyms) + BLOCK_OVERHEAD)){
+
+            retval = false;
+        }
+        else{
+
+            self->lit_freq[256]++;
+
+            dynamic = (deflate_dynamic(self) < deflate_fixed(self));
+
+            if(dynamic){
+
+                put_bits(self, 4U, 3U);
+                put_bits(self, self->hlit - 257U, 5U);
+                put_bits(self, self->hdist - 1U, 5U);
+                put_bits(self, self->hclen - 4U, 4U);
+
+                for(i=0U; i < self->hclen; i++){
+
+                    put_bits(self, self->clen_len[clen_order[i]], 3U);
+                }
+
+                for(i=0U; i < self->nrle; i++){
+
+                    code = self->rle[i] & 0x1fU;
+
+                    put_bits(self, self->clen_code[code], self->clen_len[code]);
+
+                    switch(code){
+                    case 16U:
+                        put_bits(self, self->rle[i] >> 5, 2U);
+                        break;
+                    case 17U:
+                        put_bits(self, self->rle[i] >> 5, 3U);
+                        break;
+                    case 18U:
+                        put_bits(self, self->rle[i] >> 5, 7U);
+                        break;
+                    default:
+                        break;
+                    }
+                }
+            }
+            else{
+
+                set_fixed(self->lit_len, self->dist_len);
+
+                build_codes(self->lit_len, LITLEN_CODES, self->lit_code);
+                build_codes(self->dist_len, DIST_CODES, self->dist_code);
+
+                put_bits(self, 2U, 3U);
+            }
+
+            for(i=0U; i < self->nsyms; i++){
+
+                sym = self->syms[i];
+
+                if((sym >> 16) == 0U){
+
+                    put_bits(self, self->lit_code[sym], self->lit_len[sym]);
+                }
+                else{
+
+                    len = (sym & 0xffffU) - 256U;
+                    dist = sym >> 16;
+
+                    code = self->length_code[len - MIN_MATCH];
+
+                    put_bits(self, self->lit_code[257U + code], self->lit_len[257U + code]);
+                    put_bits(self, len - len_base[code], len_extra[code]);
+
+                    code = deflate_dist_code(self, dist);
+
+                    put_bits(self, self->dist_code[code], self->dist_len[code]);
+                    put_bits(self, dist - dist_base[code], dist_extra[code]);
+                }
+            }
+
+            put_bits(self, self->lit_code[256], self->lit_len[256]);
+
+            self->nsyms = 0U;
+            (void)memset(self->lit_freq, 0, sizeof(self->lit_freq));
+            (void)memset(self->dist_freq, 0, sizeof(self->dist_freq));
+        }
+    }
+
+    return retval;
+}
+
+/* build the dynamic code and return its size in bits (excluding extra
+ * bits which are the same for every block type) */
+static size_t deflate_dynamic(struct wic_deflate *self)
+{
+    size_t retval = 17U;
+    size_t i;
+
+    build_lengths(self, self->lit_freq, LITLEN_CODES, MAX_BITS, self->lit_len);
+    build_lengths(self, self->dist_freq, DIST_CODES, MAX_BITS, self->dist_len);
+
+    build_codes(self->lit_len, LITLEN_CODES, self->lit_code);
+    build_codes(self->dist_len, DIST_CODES, self->dist_code);
+
+    for(self->hlit = 286U; (self->hlit > 257U) && (self->lit_len[self->hlit - 1U] == 0U); self->hlit--);
+    for(self->hdist = DIST_CODES; (self->hdist > 1U) && (self->dist_len[self->hdist - 1U] == 0U); self->hdist--);
+
+    deflate_rle(self);
+
+    build_lengths(self, self->clen_freq, CLEN_CODES, 7U, self->clen_len);
+    build_codes(self->clen_len, CLEN_CODES, self->clen_code);
+
+    for(self->hclen = CLEN_CODES; (self->hclen > 4U) && (self->clen_len[clen_order[self->hclen - 1U]] == 0U); self->hclen--);
+
+    retval += 3U * self->hclen;
+
+    for(i=0U; i < self->nrle; i++){
+
+        retval += self->clen_len[self->rle[i] & 0x1fU];
+
+        switch(self->rle[i] & 0x1fU){
+        case 16U:
+            retval += 2U;
+            break;
+        case 17U:
+            retval += 3U;
+            break;
+        case 18U:
+            retval += 7U;
+            break;
+        default:
+            break;
+        }
+    }
+
+    for(i=0U; i < 286U; i++){
+
+        retval += self->lit_freq[i] * self->lit_len[i];
+    }
+
+    for(i=0U; i < DIST_CODES; i++){
+
+        retval += self->dist_freq[i] * self->dist_len[i];
+    }
+
+    return retval;
+}
+
+/* size of the fixed code in bits (excluding extra bits) */
+static size_t deflate_fixed(const struct wic_deflate *self)
+{
+    size_t retval = 3U;
+    size_t i;
+
+    for(i=0U; i < LITLEN_CODES; i++){
+
+        if(i < 144U){
+
+            retval += self->lit_freq[i] * 8U;
+        }
+        else if(i < 256U){
+
+            retval += self->lit_freq[i] * 9U;
+        }
+        else if(i < 280U){
+
+            retval += self->lit_freq[i] * 7U;
+        }
+        else{
+
+            retval += self->lit_freq[i] * 8U;
+        }
+    }
+
+    for(i=0U; i < DIST_CODES; i++){
+
+        retval += self->dist_freq[i] * 5U;
+    }
+
+    return retval;
+}
+
+static void set_fixed(uint8_t *lit_len, uint8_t *dist_len)
+{
+    size_t i;
+
+    for(i=0U; i < LITLEN_CODES; i++){
+
+        if(i < 144U){
+
+            lit_len[i] = 8U;
+        }
+        else if(i < 256U){
+
+            lit_len[i] = 9U;
+        }
+        else if(i < 280U){
+
+            lit_len[i] = 7U;
+        }
+        else{
+
+            lit_len[i] = 8U;
+        }
+    }
+
+    for(i=0U; i < DIST_CODES; i++){
+
+        dist_len[i] = 5U;
+    }
+}
+
+/* run length encode the literal/length and distance code lengths as a
+ * single sequence */
+static void deflate_rle(struct wic_deflate *self)
+{
+    size_t total = self->hlit + self->hdist;
+    size_t i = 0U;
+    size_t run;
+    size_t n;
+    uint8_t len;
+
+    (void)memset(self->clen_freq, 0, sizeof(self->clen_freq));
+
+    self->nrle = 0U;
+
+    while(i < total){
+
+        len = (i < self->hlit) ? self->lit_len[i] : self->dist_len[i - self->hlit];
+
+        for(run=1U; (i + run) < total; run++){
+
+            if(len != (((i + run) < self->hlit) ? self->lit_len[i + run] : self->dist_len[i + run - self->hlit])){
+
+                break;
+            }
+        }
+
+        if(len == 0U){
+
+            while(run >= 11U){
+
+                n = (run > 138U) ? 138U : run;
+                self->rle[self->nrle] = 18U | ((n - 11U) << 5);
+                self->nrle++;
+                self->clen_freq[18]++;
+                run -= n;
+                i += n;
+            }
+
+            if(run >= 3U){
+
+                self->rle[self->nrle] = 17U | ((run - 3U) << 5);
+                self->nrle++;
+                self->clen_freq[17]++;
+                i += run;
+                run = 0U;
+            }
+        }
+        else{
+
+            self->rle[self->nrle] = len;
+            self->nrle++;
+            self->clen_freq[len]++;
+            run--;
+            i++;
+
+            while(run >= 3U){
+
+                n = (run > 6U) ? 6U : run;
+                self->rle[self->nrle] = 16U | ((n - 3U) << 5);
+                self->nrle++;
+                self->clen_freq[16]++;
+                run -= n;
+                i += n;
+            }
+        }
+
+        while(run > 0U){
+
+            self->rle[self->nrle] = len;
+            self->nrle++;
+            self->clen_freq[len]++;
+            run--;
+            i++;
+        }
+    }
+}
+
+/* huffman code lengths limited to limit bits */
+static void build_lengths(struct wic_deflate *self, const uint32_t *freq, size_t n, unsigned limit, uint8_t *lens)
+{
+    uint32_t *weight = self->weight;
+    uint16_t *parent = self->parent;
+    uint16_t *sorted = self->sorted;
+    uint16_t bl_count[MAX_BITS + 1U];
+    size_t leaves = 0U;
+    size_t next;
+    size_t a;
+    size_t b;
+    size_t x;
+    size_t y;
+    size_t i;
+    size_t j;
+    unsigned len;
+    uint32_t kraft = 0U;
+    uint16_t tmp;
+
+    (void)memset(lens, 0, n);
+    (void)memset(bl_count, 0, sizeof(bl_count));
+
+    for(i=0U; i < n; i++){
+
+        if(freq[i] > 0U){
+
+            sorted[leaves] = i;
+            leaves++;
+        }
+    }
+
+    /* a code needs at least two symbols */
+    if(leaves == 0U){
+
+        lens[0] = 1U;
+        lens[1] = 1U;
+    }
+    else if(leaves == 1U){
+
+        lens[sorted[0]] = 1U;
+        lens[(sorted[0] == 0U) ? 1U : 0U] = 1U;
+    }
+    else{
+
+        /* sorted by frequency (stable so that ties stay in symbol order) */
+        for(i=1U; i < leaves; i++){
+
+            tmp = sorted[i];
+
+            for(j=i; (j > 0U) && (freq[sorted[j - 1U]] > freq[tmp]); j--){
+
+                sorted[j] = sorted[j - 1U];
+            }
+
+            sorted[j] = tmp;
+        }
+
+        for(i=0U; i < leaves; i++){
+
+            weight[i] = freq[sorted[i]];
+        }
+
+        /* two queue method: leaves and then internal nodes which are
+         * created in order of weight */
+        a = 0U;
+        b = leaves;
+
+        for(next=leaves; next < ((2U * leaves) - 1U); next++){
+
+            x = ((a < leaves) && ((b == next) || (weight[a] <= weight[b]))) ? a++ : b++;
+            y = ((a < leaves) && ((b == next) || (weight[a] <= weight[b]))) ? a++ : b++;
+
+            weight[next] = weight[x] + weight[y];
+            parent[x] = next;
+            parent[y] = next;
+        }
+
+        /* weight becomes depth, parents always come after children */
+        weight[next - 1U] = 0U;
+
+        for(i=next - 1U; i > 0U; i--){
+
+            weight[i - 1U] = weight[parent[i - 1U]] + 1U;
+        }
+
+        for(i=0U; i < leaves; i++){
+
+            bl_count[(weight[i] > limit) ? limit : weight[i]]++;
+        }
+
+        /* clipping the deepest leaves oversubscribes the code, move
+         * leaves down until the kraft sum fits again (as in miniz) */
+        for(i=1U; i <= limit; i++){
+
+            kraft += (uint32_t)bl_count[i] << (limit - i);
+        }
+
+        while(kraft > (1UL << limit)){
+
+            bl_count[limit]--;
+
+            for(len=limit - 1U; len > 0U; len--){
+
+                if(bl_count[len] > 0U){
+
+                    bl_count[len]--;
+                    bl_count[len + 1U] += 2U;
+                    break;
+                }
+            }
+
+            kraft--;
+        }
+
+        /* longest codes go to the least frequent symbols */
+        i = 0U;
+
+        for(len=limit; len > 0U; len--){
+
+            for(j=0U; j < bl_count[len]; j++){
+
+                lens[sorted[i]] = len;
+                i++;
+            }
+        }
+    }
+}
+
+static void build_codes(const uint8_t *lens, size_t n, uint16_t *codes)
+{
+    uint16_t bl_count[MAX_BITS + 1U];
+    uint16_t next_code[MAX_BITS + 1U];
+    uint16_t code = 0U;
+    size_t i;
+
+    (void)memset(bl_count, 0, sizeof(bl_count));
+
+    for(i=0U; i < n; i++){
+
+        bl_count[lens[i]]++;
+    }
+
+    bl_count[0] = 0U;
+
+    for(i=1U; i <= MAX_BITS; i++){
+
+        code = (code + bl_count[i - 1U]) << 1;
+        next_code[i] = code;
+    }
+
+    for(i=0U; i < n; i++){
+
+        if(lens[i] != 0U){
+
+            codes[i] = reverse_bits(next_code[lens[i]], lens[i]);
+            next_code[lens[i]]++;
+        }
+        else{
+
+            codes[i] = 0U;
+        }
+    }
+}
+
+static void put_bits(struct wic_deflate *self, uint32_t value, unsigned n)
+{
+    self->bitbuf |= ((uint64_t)value) << self->bitcount;
+    self->bitcount += n;
+
+    while(self->bitcount >= 8U){
+
+        self->out[self->out_len] = self->bitbuf;
+        self->out_len++;
+        self->bitbuf >>= 8;
+        self->bitcount -= 8U;
+    }
+}
+
+static void put_align(struct wic_deflate *self)
+{
+    if(self->bitcount > 0U){
+
+        put_bits(self, 0U, 8U - self->bitcount);
+    }
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2020 Cameron Harper
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * */
+
+#ifndef WIC_DEFLATE_H
+#define WIC_DEFLATE_H
+
+/* Raw DEFLATE (rfc1951) streams for permessage-deflate (rfc7692)
+ *
+ * Both directions work entirely within memory given to the init
+ * functions. Neither will produce more output than fits, instead they
+ * stop and wait for the output to be taken.
+ *
+ * */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+enum wic_inflate_status {
+
+    WIC_INFLATE_OK,     /* all input consumed */
+    WIC_INFLATE_FULL,   /* output must be taken before going further */
+    WIC_INFLATE_ERROR   /* input is not valid DEFLATE */
+};
+
+struct wic_inflate;
+struct wic_deflate;
+
+/* memory needed by wic_inflate_init() */
+size_t wic_inflate_size(uint8_t window_bits);
+
+/* returns NULL if max is too small */
+struct wic_inflate *wic_inflate_init(void *buf, size_t max, uint8_t window_bits);
+
+/* bits left over at the end of the input are kept for the next call
+ * so used is always size unless output is full or there is an error */
+enum wic_inflate_status wic_inflate(struct wic_inflate *self, const void *in, size_t size, size_t *used);
+
+/* next contiguous piece of output (pending is all of the output) */
+const char *wic_inflate_output(const struct wic_inflate *self, size_t *size, size_t *pending);
+void wic_inflate_consume(struct wic_inflate *self, size_t size);
+
+/* call at the end of each message, returns false if the message didn't
+ * finish on a block boundary (output not yet taken is kept) */
+bool wic_inflate_end(struct wic_inflate *self, bool no_context_takeover);
+
+/* memory needed by wic_deflate_init() */
+size_t wic_deflate_size(uint8_t window_bits);
+
+/* returns NULL if max is too small */
+struct wic_deflate *wic_deflate_init(void *buf, size_t max, uint8_t window_bits);
+
+/* limit matches to a smaller window than was given to wic_deflate_init() */
+void wic_deflate_window(struct wic_deflate *self, uint8_t window_bits);
+
+/* returns bytes of input consumed (less than size if output is full) */
+size_t wic_deflate(struct wic_deflate *self, const void *in, size_t size);
+
+/* sync flush all input consumed so far
+ *
+ * The trailing 00 00 FF FF is left off if end is true.
+ *
+ * returns false if output is full (take the output and call again)
+ *
+ * */
+bool wic_deflate_flush(struct wic_deflate *self, bool end);
+
+const void *wic_deflate_output(const struct wic_deflate *self, size_t *size);
+void wic_deflate_consume(struct wic_deflate *self, size_t size);
+
+/* forget history (no_context_takeover) */
+void wic_deflate_reset(struct wic_deflate *self);
+
+#endif